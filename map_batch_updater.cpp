@@ -3,8 +3,17 @@
 #define _CRT_SECURE_NO_WARNINGS
 #define _CRT_NONSTDC_NO_DEPRECATE
 #include <iostream>
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <unordered_map>
 
 #include "steam/steam_api.h"
 
@@ -12,16 +21,25 @@
 #include <wincon.h>
 #include <direct.h>
 #include <io.h>
+#include <conio.h>
 
 #include "minizip/mz.h"
 #include "minizip/mz_strm.h"
 #include "minizip/mz_strm_mem.h"
 #include "minizip/mz_strm_buf.h"
+#include "minizip/mz_strm_os.h"
+#include "minizip/mz_crypt.h"
 #include "minizip/mz_zip.h"
 #include "minizip/mz_zip_rw.h"
 
+#define LZMA_API_STATIC
+#include "lzma.h"
+
 const AppId_t g_AppID = 440;
 const char* g_ConfigName = "config.ini";
+const char* g_IndexName = "pak_index.bin";
+const char* g_ManifestName = "add_manifest.txt";
+const char* g_PipeName = "\\\\.\\pipe\\map_batch_updater";
 
 HANDLE g_Console;
 char g_MapTempPath[_MAX_PATH] = { 0 };
@@ -45,6 +63,44 @@ bool g_IniCompressPakFile = true;
 int g_IniCompressionLevel = 5;
 bool g_IniWritePakFile = true;
 bool g_IniUploadMaps = false;
+bool g_IniStreamPakFile = false;
+int g_IniStreamMemoryLimit = 256; // megabytes
+int g_IniMemoryBudget = 0; // megabytes, 0 = 75% of physical memory
+int g_IniOperateThreads = 1;
+bool g_IniRecompressPakFile = false;
+int g_IniAsyncIOThreads = 4;
+int g_IniWalkThreads = 8;
+bool g_IniReuseManifest = true;
+bool g_IniPlanOperations = true;
+bool g_IniWriteDelta = false;
+bool g_IniOrderPakFile = false;
+int g_IniOrderSmallSize = 64; // kilobytes, loose files up to this size are grouped at the start of the pak
+int g_IniAlignStoredFiles = 4096; // bytes, stored entries start on this boundary (at most 32768), 0 = off
+int g_IniMapAddThreshold = 1024; // kilobytes, ADD files this large are memory mapped instead of read, 0 = never
+bool g_IniReuseLZMAContexts = true;
+char g_IniLogFile[_MAX_PATH] = { 0 };
+int g_IniWorkers = 0;
+bool g_IniLaunchWorkers = true;
+char g_IniWorkerDir[_MAX_PATH] = { 0 };
+int g_IniWorkerTimeout = 0; // seconds, 0 = wait forever
+int g_IniDecompressThreads = 0; // 0 = cores shared between operate threads
+bool g_IniVerifyMaps = true;
+int g_IniMaxMapSize = 0; // megabytes, 0 = no limit
+bool g_IniMaxMapSizeAbort = false;
+int g_IniEstimateBlocks = 64;
+int g_IniTuneSampleSize = 32; // megabytes
+int g_IniTuneSizeTarget = 0; // megabytes per map
+int g_IniTuneTimeBudget = 0; // seconds per batch
+int g_IniVerifyThreads = 0; // 0 = one per core
+int g_IniUploadInterval = 5000; // milliseconds between submits
+int g_IniUploadBurst = 1;
+int g_IniUploadRetries = 3;
+int g_IniUploadBackoff = 10000; // milliseconds, doubled on each retry
+char g_IniFakeWorkshop[_MAX_PATH] = { 0 }; // uploads are copied here instead of submitted
+int g_IniFakeWorkshopLatency = 2000; // milliseconds
+int g_IniFakeWorkshopFailRate = 0; // percent of fake submits failing transiently
+int g_IniDaemonCacheSize = 1024; // megabytes of ADD sources kept by -daemon
+int g_IniDaemonMetadataTime = 300; // seconds the workshop listing is reused by -daemon
 char g_IniChangeNote[1024] = { 0 };
 
 void FixSlashes(char* str)
@@ -66,6 +122,9 @@ struct ZipFile
         SetFilename(_filename);
         buffer = new char[_size];
         size = _size;
+        source_path = nullptr;
+        source_entry = -1;
+        mapped = false;
     }
 
     void InitFromFile(FILE* file, const char* _filename)
@@ -77,6 +136,81 @@ struct ZipFile
         fseek(file, 0, SEEK_SET);
         buffer = new char[size];
         fread(buffer, 1, size, file);
+        source_path = nullptr;
+        source_entry = -1;
+        mapped = false;
+    }
+
+    // contents stay in the source pak until written
+    void InitFromEntry(const mz_zip_file* file_info, int64_t _entry)
+    {
+        SetFilename(file_info->filename);
+        buffer = nullptr;
+        size = (size_t)file_info->uncompressed_size;
+        source_path = nullptr;
+        source_entry = _entry;
+        mapped = false;
+        source_crc = file_info->crc;
+        source_compression_method = file_info->compression_method;
+        source_compressed_size = (size_t)file_info->compressed_size;
+    }
+
+    // streaming: contents stay on disk until written
+    void InitFromPath(FILE* file, const char* path, const char* _filename)
+    {
+        SetFilename(_filename);
+
+        fseek(file, 0, SEEK_END);
+        size = (size_t)ftell(file);
+        fseek(file, 0, SEEK_SET);
+        buffer = nullptr;
+        source_path = strdup(path);
+        source_entry = -1;
+        mapped = false;
+    }
+
+    // contents are a read-only view of the file, paged in as the writer reads through it
+    bool InitFromMapping(const char* path, const char* _filename)
+    {
+        HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER file_size = { 0 };
+        void* view = nullptr;
+        if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        {
+            // the view keeps the mapping alive
+            HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping)
+            {
+                view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+
+        if (!view)
+            return false;
+
+        SetFilename(_filename);
+        buffer = (char*)view;
+        size = (size_t)file_size.QuadPart;
+        source_path = nullptr;
+        source_entry = -1;
+        mapped = true;
+        return true;
+    }
+
+    // takes ownership of the buffer
+    void InitFromBuffer(char* _buffer, size_t _size, const char* _filename)
+    {
+        SetFilename(_filename);
+        buffer = _buffer;
+        size = _size;
+        source_path = nullptr;
+        source_entry = -1;
+        mapped = false;
     }
 
     void SetFilename(const char* _filename)
@@ -89,22 +223,53 @@ struct ZipFile
     {
         free(filename);
         filename = nullptr;
-        delete[] buffer;
+        if (mapped)
+            UnmapViewOfFile(buffer);
+        else
+            delete[] buffer;
         buffer = nullptr;
+        mapped = false;
+        free(source_path);
+        source_path = nullptr;
     }
 
     char* filename;
     char* buffer;
     size_t size;
+    char* source_path;
+    int64_t source_entry; // central directory position in the source pak, -1 if replaced
+    uint32_t source_crc;
+    uint16_t source_compression_method;
+    size_t source_compressed_size;
+    bool mapped; // buffer is a view of an ADD source
 };
 
 typedef std::vector<ZipFile> ZipFileList;
 
+bool IsMappedSize(uint64_t size)
+{
+    return g_IniMapAddThreshold > 0 && !g_IniStreamPakFile && size >= (uint64_t)g_IniMapAddThreshold * 1024;
+}
+
+void InitWriteFileInfo(mz_zip_file& write_file_info, const ZipFile& zip_file, time_t the_time)
+{
+    write_file_info = { 0 };
+    write_file_info.filename = zip_file.filename;
+    write_file_info.modified_date = the_time;
+    write_file_info.version_madeby = MZ_VERSION_BUILD;
+    write_file_info.compression_method = g_IniCompressPakFile ? MZ_COMPRESS_METHOD_LZMA : MZ_COMPRESS_METHOD_STORE;
+    write_file_info.flag = MZ_ZIP_FLAG_UTF8;
+    write_file_info.zip64 = MZ_ZIP64_DISABLE;
+}
+
+// approximate liblzma encoder footprint of each compression level, in megabytes
+const int g_LZMAEncoderMemory[10] = { 3, 9, 17, 32, 48, 94, 94, 186, 370, 674 };
+
 struct ZipContainer
 {
     ZipContainer()
     {
-        stream_read = mz_zip_reader_create();
+        stream_read = mz_zip_create();
         stream_write = mz_zip_writer_create();
         stream_read_mem = mz_stream_mem_create();
         stream_write_mem = mz_stream_mem_create();
@@ -112,7 +277,7 @@ struct ZipContainer
 
     ~ZipContainer()
     {
-        mz_zip_reader_delete(&stream_read);
+        mz_zip_delete(&stream_read);
         mz_zip_writer_delete(&stream_write);
 
         mz_stream_mem_delete(&stream_read_mem);
@@ -125,6 +290,64 @@ struct ZipContainer
     void* stream_write_mem;
 };
 
+// Exposes a lump of a BSP file as its own stream so zip offsets stay relative to the lump
+struct LumpStream
+{
+    static int32_t Open(void* stream, const char* path, int32_t mode) { return MZ_OK; }
+    static int32_t IsOpen(void* stream) { return mz_stream_is_open(((LumpStream*)stream)->stream.base); }
+    static int32_t Close(void* stream) { return MZ_OK; }
+    static int32_t Error(void* stream) { return mz_stream_error(((LumpStream*)stream)->stream.base); }
+
+    static int32_t Read(void* stream, void* buf, int32_t size)
+    {
+        LumpStream* lump = (LumpStream*)stream;
+        if (lump->length >= 0)
+        {
+            int64_t remaining = lump->length - Tell(stream);
+            if (remaining <= 0)
+                return 0;
+            if (size > remaining)
+                size = (int32_t)remaining;
+        }
+        return mz_stream_read(lump->stream.base, buf, size);
+    }
+
+    static int32_t Write(void* stream, const void* buf, int32_t size)
+    {
+        return mz_stream_write(((LumpStream*)stream)->stream.base, buf, size);
+    }
+
+    static int64_t Tell(void* stream)
+    {
+        LumpStream* lump = (LumpStream*)stream;
+        int64_t position = mz_stream_tell(lump->stream.base);
+        return position < 0 ? position : position - lump->offset;
+    }
+
+    static int32_t Seek(void* stream, int64_t offset, int32_t origin)
+    {
+        LumpStream* lump = (LumpStream*)stream;
+        if (origin == MZ_SEEK_SET)
+            return mz_stream_seek(lump->stream.base, lump->offset + offset, MZ_SEEK_SET);
+        if (origin == MZ_SEEK_END && lump->length >= 0)
+            return mz_stream_seek(lump->stream.base, lump->offset + lump->length + offset, MZ_SEEK_SET);
+        return mz_stream_seek(lump->stream.base, offset, origin);
+    }
+
+    LumpStream(void* base, int64_t _offset, int64_t _length)
+    {
+        static mz_stream_vtbl vtbl = { Open, IsOpen, Read, Write, Tell, Seek, Close, Error, nullptr, nullptr, nullptr, nullptr };
+        stream.vtbl = &vtbl;
+        stream.base = (mz_stream*)base;
+        offset = _offset;
+        length = _length;
+    }
+
+    mz_stream stream;
+    int64_t offset;
+    int64_t length; // -1 if unbounded (writing)
+};
+
 struct BSPLump
 {
     int    offset;
@@ -154,23 +377,393 @@ enum ConsoleColors
     WHITE = 15
 };
 
+// Frames sent from -daemon to a -submit client, followed by length bytes of payload
+enum DaemonFrameType
+{
+    FRAME_LOG,
+    FRAME_PROGRESS,
+    FRAME_INPUT, // the client replies with a line from its console
+    FRAME_EXIT, // payload is the int32 exit code of the job
+};
+
+struct DaemonFrame
+{
+    uint8_t type;
+    uint8_t color;
+    uint16_t length;
+};
+
+// blocking transfer of the whole buffer, the daemon's pipe is overlapped so it can pump Steam while idle
+bool PipeTransfer(HANDLE pipe, bool write, void* data, DWORD size)
+{
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    DWORD done = 0;
+    char* buffer = (char*)data;
+    bool success = true;
+    while (success && size > 0)
+    {
+        ResetEvent(overlapped.hEvent);
+        BOOL ok = write ? WriteFile(pipe, buffer, size, NULL, &overlapped) : ReadFile(pipe, buffer, size, NULL, &overlapped);
+        success = (ok || GetLastError() == ERROR_IO_PENDING) && GetOverlappedResult(pipe, &overlapped, &done, TRUE) && done > 0;
+        buffer += done;
+        size -= min(done, size);
+    }
+
+    CloseHandle(overlapped.hEvent);
+    return success;
+}
+
+bool PipeWriteFrame(HANDLE pipe, DaemonFrameType type, ConsoleColors color, const void* payload, size_t length)
+{
+    DaemonFrame frame;
+    frame.type = (uint8_t)type;
+    frame.color = (uint8_t)color;
+    frame.length = (uint16_t)min(length, (size_t)UINT16_MAX);
+    return PipeTransfer(pipe, true, &frame, sizeof(frame)) &&
+        (!frame.length || PipeTransfer(pipe, true, (void*)payload, frame.length));
+}
+
+struct LogMessage
+{
+    std::atomic<size_t> sequence;
+    ConsoleColors color;
+    bool progress;
+    DWORD thread;
+    long long time; // milliseconds since start
+    char text[1024];
+};
+
+// Lock-free ring buffer drained by a background thread, so callers never wait on the console.
+// Colors only matter to the console sink, the optional log file gets JSON lines
+struct Logger
+{
+    static const size_t CAPACITY = 1024;
+
+    Logger()
+    {
+        for (size_t i = 0; i < CAPACITY; i++)
+            m_Messages[i].sequence = i;
+        m_Start = std::chrono::steady_clock::now();
+    }
+
+    ~Logger()
+    {
+        Stop();
+
+        FILE* file = m_File.exchange(nullptr);
+        if (file)
+            fclose(file);
+    }
+
+    void Start()
+    {
+        m_Running = true;
+        m_Thread = std::thread(&Logger::Run, this);
+    }
+
+    void Stop()
+    {
+        if (!m_Thread.joinable())
+            return;
+
+        m_Running = false;
+        m_Wake.notify_all();
+        m_Thread.join();
+    }
+
+    bool OpenFile(const char* path)
+    {
+        FILE* file = fopen(path, "a");
+        if (!file)
+            return false;
+
+        file = m_File.exchange(file);
+        if (file)
+            fclose(file);
+        return true;
+    }
+
+    void Push(ConsoleColors color, bool progress, const char* format, va_list args)
+    {
+        long long time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_Start).count();
+
+        if (!m_Running)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Unbuffered.color = color;
+            m_Unbuffered.progress = progress;
+            m_Unbuffered.thread = GetCurrentThreadId();
+            m_Unbuffered.time = time;
+            vsnprintf(m_Unbuffered.text, sizeof(m_Unbuffered.text), format, args);
+            Output(m_Unbuffered);
+            return;
+        }
+
+        size_t position = m_Head.load(std::memory_order_relaxed);
+        LogMessage* message;
+        while (true)
+        {
+            message = &m_Messages[position % CAPACITY];
+            size_t sequence = message->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0)
+            {
+                if (m_Head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else
+            {
+                // full, wait for the drain thread to catch up
+                if (diff < 0)
+                    std::this_thread::yield();
+                position = m_Head.load(std::memory_order_relaxed);
+            }
+        }
+
+        message->color = color;
+        message->progress = progress;
+        message->thread = GetCurrentThreadId();
+        message->time = time;
+        vsnprintf(message->text, sizeof(message->text), format, args);
+        message->sequence.store(position + 1, std::memory_order_release);
+
+        m_Wake.notify_one();
+    }
+
+    // blocks until everything logged so far has been written out
+    void Flush()
+    {
+        while (m_Running && m_Tail.load() < m_Head.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    void Run()
+    {
+        while (true)
+        {
+            bool running = m_Running;
+            if (!Drain() && !running)
+                break;
+
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Wake.wait_for(lock, std::chrono::milliseconds(10));
+        }
+    }
+
+    bool Drain()
+    {
+        bool drained = false;
+        while (true)
+        {
+            size_t position = m_Tail.load(std::memory_order_relaxed);
+            LogMessage& message = m_Messages[position % CAPACITY];
+            if (message.sequence.load(std::memory_order_acquire) != position + 1)
+                break;
+
+            Output(message);
+
+            message.sequence.store(position + CAPACITY, std::memory_order_release);
+            m_Tail.store(position + 1);
+            drained = true;
+        }
+
+        return drained;
+    }
+
+    void CloseFile()
+    {
+        FILE* file = m_File.exchange(nullptr);
+        if (file)
+            fclose(file);
+    }
+
+    void Output(LogMessage& message)
+    {
+        SetConsoleTextAttribute(g_Console, message.color);
+        fputs(message.text, stdout);
+        SetConsoleTextAttribute(g_Console, DEFAULT);
+
+        // a client that went away stops getting output, the job carries on
+        HANDLE pipe = m_Pipe.load();
+        if (pipe && !PipeWriteFrame(pipe, message.progress ? FRAME_PROGRESS : FRAME_LOG, message.color, message.text, strlen(message.text)))
+            m_Pipe.compare_exchange_strong(pipe, nullptr);
+
+        FILE* file = m_File.load();
+        if (file && !message.progress)
+            OutputJSON(file, message);
+    }
+
+    void OutputJSON(FILE* file, LogMessage& message)
+    {
+        const char* level = "info";
+        if (message.color == RED)
+            level = "error";
+        else if (message.color == YELLOW)
+            level = "warning";
+        else if (message.color == GREEN)
+            level = "success";
+
+        fprintf(file, "{\"time\":%lld,\"thread\":%lu,\"level\":\"%s\",\"message\":\"", message.time, (unsigned long)message.thread, level);
+
+        // trailing whitespace is only there for the console
+        size_t len = strlen(message.text);
+        while (len > 0 && isspace((unsigned char)message.text[len - 1]))
+            len--;
+
+        for (size_t i = 0; i < len; i++)
+        {
+            unsigned char c = (unsigned char)message.text[i];
+            if (c == '"' || c == '\\')
+                fprintf(file, "\\%c", c);
+            else if (c == '\n')
+                fputs("\\n", file);
+            else if (c == '\t')
+                fputs("\\t", file);
+            else if (c < 0x20)
+                fprintf(file, "\\u%04x", c);
+            else
+                fputc(c, file);
+        }
+
+        fputs("\"}\n", file);
+        fflush(file);
+    }
+
+    LogMessage m_Messages[CAPACITY];
+    LogMessage m_Unbuffered;
+    std::atomic<size_t> m_Head = { 0 };
+    std::atomic<size_t> m_Tail = { 0 };
+    std::atomic<bool> m_Running = { false };
+    std::atomic<FILE*> m_File = { nullptr };
+    std::atomic<HANDLE> m_Pipe = { nullptr }; // -submit client of the running daemon job
+    std::chrono::steady_clock::time_point m_Start;
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+};
+
+Logger g_Logger;
+
 void ConsolePrintf(ConsoleColors color, const char* format, ...)
 {
-    SetConsoleTextAttribute(g_Console, color);
     va_list args;
-    va_start(args, format); 
-    vprintf(format, args);
+    va_start(args, format);
+    g_Logger.Push(color, false, format, args);
+    va_end(args);
+}
+
+void ConsolePrintProgressf(ConsoleColors color, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    g_Logger.Push(color, true, format, args);
     va_end(args);
-    SetConsoleTextAttribute(g_Console, DEFAULT);
 }
 
-void ConsolePrintProgress(ConsoleColors color, size_t processed, size_t total)
+// throttled by time against the caller's own last update, the last update always goes through
+void ConsolePrintProgress(ConsoleColors color, size_t processed, size_t total, long long& last_update)
+{
+    long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (processed + 1 < total && now - last_update < 100)
+        return;
+    last_update = now;
+
+    ConsolePrintProgressf(color, "Progress: %llu/%llu (%2.0f%%)           \r", processed, total, total > 0 ? ((processed / (float)total) * 100.0) : 0.f);
+}
+
+// Process-wide memory budget that work on a map must reserve from before starting
+struct MemoryBudget
+{
+    void SetLimit(size_t limit)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Limit = limit;
+        m_Condition.notify_all();
+    }
+
+    // blocks until the reservation fits, oversized reservations wait until they can run alone
+    size_t Reserve(size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        bytes = min(bytes, m_Limit);
+        m_Condition.wait(lock, [&] { return m_Used + bytes <= m_Limit; });
+        m_Used += bytes;
+        return bytes;
+    }
+
+    void Release(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Used -= bytes;
+        m_Condition.notify_all();
+    }
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    size_t m_Limit = SIZE_MAX;
+    size_t m_Used = 0;
+};
+
+MemoryBudget g_MemoryBudget;
+
+void InitMemoryBudget()
+{
+    size_t limit = (size_t)g_IniMemoryBudget * 1024 * 1024;
+    if (!limit)
+    {
+        MEMORYSTATUSEX status = { 0 };
+        status.dwLength = sizeof(status);
+        if (GlobalMemoryStatusEx(&status))
+            limit = (size_t)(status.ullTotalPhys / 4 * 3);
+        else
+            limit = SIZE_MAX;
+    }
+
+    g_MemoryBudget.SetLimit(limit);
+}
+
+bool g_DaemonRunning = false;
+
+// reads a word of input, from the submitting client's console during a daemon job
+bool ConsoleReadInput(char* input, size_t size)
 {
-    ConsolePrintf(color, "Progress: %llu/%llu (%2.0f%%)           \r", processed, total, total > 0 ? ((processed / (float)total) * 100.0) : 0.f);
+    HANDLE pipe = g_Logger.m_Pipe.load();
+
+    // nobody is at the daemon's own console, a job whose client went away is aborted
+    if (!pipe && g_DaemonRunning)
+        return false;
+
+    if (!pipe)
+    {
+        char format[16];
+        snprintf(format, sizeof(format), "%%%llus", (uint64_t)(size - 1));
+        return scanf(format, input) == 1;
+    }
+
+    g_Logger.Flush();
+    if (!PipeWriteFrame(pipe, FRAME_INPUT, DEFAULT, NULL, 0))
+        return false;
+
+    size_t length = 0;
+    char c;
+    while (PipeTransfer(pipe, false, &c, 1))
+    {
+        if (c == '\n')
+        {
+            input[length] = '\0';
+            return length > 0;
+        }
+        if (c != '\r' && length < size - 1)
+            input[length++] = c;
+    }
+    return false;
 }
 
 void ConsoleWaitForKey()
 {
+    g_Logger.Flush();
     printf("Press any key to continue...\n");
     getchar();
 }
@@ -228,965 +821,7674 @@ void SleepUntilCondition(SleepFunc Func, uint32 Delay)
     }
 }
 
-struct OperationBase
+// Token bucket spacing out workshop submits. A token refills every UploadInterval, counted from
+// the submit that spent it, so an upload that took longer than the interval needs no extra wait
+struct UploadScheduler
 {
-    OperationBase(const char* name, char* value)
+    typedef std::chrono::steady_clock Clock;
+
+    void Init(int interval_ms, int burst)
     {
-        m_Name = name;
-        strcpy(m_Value, value);
+        m_Interval = max(interval_ms, 0) / 1000.0;
+        m_Burst = (double)max(burst, 1);
+        m_Tokens = m_Burst;
+        m_Last = m_NotBefore = Clock::now();
     }
 
-    virtual bool OperateZip(ZipFileList& file_list) { return true; }
+    void Refill(Clock::time_point now)
+    {
+        double elapsed = std::chrono::duration<double>(now - m_Last).count();
+        m_Last = now;
+        if (m_Interval <= 0.0)
+            m_Tokens = m_Burst;
+        else
+            m_Tokens = min(m_Tokens + elapsed / m_Interval, m_Burst);
+    }
 
-    const char* m_Name;
-    char m_Value[512];
-};
+    bool TryAcquire(Clock::time_point now)
+    {
+        Refill(now);
+        if (now < m_NotBefore || m_Tokens < 1.0)
+            return false;
+        m_Tokens -= 1.0;
+        return true;
+    }
 
-struct OperationAdd : OperationBase
-{
-    OperationAdd(char* value) : OperationBase("ADD", value) {}
+    // seconds until TryAcquire can succeed
+    double GetWait(Clock::time_point now)
+    {
+        Refill(now);
+        double wait = m_Tokens >= 1.0 || m_Interval <= 0.0 ? 0.0 : (1.0 - m_Tokens) * m_Interval;
+        if (now < m_NotBefore)
+            wait = max(wait, std::chrono::duration<double>(m_NotBefore - now).count());
+        return wait;
+    }
 
-    virtual bool OperateZip(ZipFileList& file_list) override
+    void Backoff(Clock::time_point until)
     {
-        char base_dir[_MAX_PATH];
-        char relative_path[_MAX_PATH];
-        char full_path[_MAX_PATH];
+        if (until > m_NotBefore)
+            m_NotBefore = until;
+    }
 
-        bool double_slash = false;
-        char* p = m_Value;
-        while (*p)
-        {
-            if (*p == '/' && *(p + 1) == '/')
-            {
-                size_t len = p - m_Value + 1;
-                strncpy(base_dir, m_Value, len);
-                base_dir[len] = '\0';
-                strcpy(relative_path, p + 2);
+    double m_Interval;
+    double m_Burst;
+    double m_Tokens;
+    Clock::time_point m_Last;
+    Clock::time_point m_NotBefore;
+};
 
-                // trailing slash
-                if (relative_path[0])
-                {
-                    p = &relative_path[strlen(relative_path) - 1];
-                    if (*p == '/')
-                        *p = '\0';
-                }
+// failures worth submitting again after a pause
+static bool IsTransientResult(EResult result)
+{
+    switch (result)
+    {
+    case k_EResultNoConnection:
+    case k_EResultBusy:
+    case k_EResultTimeout:
+    case k_EResultServiceUnavailable:
+    case k_EResultLimitExceeded:
+    case k_EResultRemoteCallFailed:
+    case k_EResultIOFailure:
+    case k_EResultRateLimitExceeded:
+        return true;
+    default:
+        return false;
+    }
+}
 
-                double_slash = true;
-                break;
-            }
+struct LoadedFile
+{
+    char* buffer;
+    size_t size;
+    bool loaded;
+    bool mapped; // left unread to be memory mapped instead
+};
 
-            p++;
-        }
+// ADD source contents kept in memory between -daemon jobs, checked against the size and
+// write time on disk before reuse. Oldest entries are dropped first once over the limit
+struct FileCache
+{
+    struct Entry
+    {
+        uint64_t write_time;
+        std::vector<char> data;
+    };
 
-        if (!double_slash)
-        {
-            ConsolePrintf(RED, "\tNo double slash found in %s\n", m_Value);
-            return false;
-        }
+    void SetLimit(size_t limit)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Limit = limit;
+        Trim();
+    }
 
-        snprintf(full_path, sizeof(full_path), "%s%s", base_dir, relative_path);
+    bool IsEnabled() const
+    {
+        return m_Limit > 0;
+    }
 
-        p = strrchr(relative_path, '/');
-        if (!p || strchr(p, '.')) // file
-        {
-            if (!AddFile(full_path, base_dir, file_list))
-                return false;
-        }
-        else
-        {
-            if (!RecurseDirectory(full_path, base_dir, file_list))
-                return false;
-        }
+    bool Get(const std::string& path, uint64_t size, uint64_t write_time, LoadedFile& loaded)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto it = m_Entries.find(path);
+        if (it == m_Entries.end())
+            return false;
+
+        Entry& entry = it->second;
+        if (entry.data.size() != size || entry.write_time != write_time)
+            return false;
 
+        loaded.size = entry.data.size();
+        loaded.buffer = new char[loaded.size];
+        memcpy(loaded.buffer, entry.data.data(), loaded.size);
+        loaded.loaded = true;
+        m_Hits++;
         return true;
     }
 
-    bool AddFile(const char* full_path, const char* base_dir, ZipFileList& file_list)
+    void Put(const std::string& path, uint64_t write_time, const char* buffer, size_t size)
     {
-        if (g_IniLogOperations)
-            ConsolePrintf(WHITE, "\tAdding file %s\n", full_path);
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (size > m_Limit / 4)
+            return;
 
-        bool valid_file = false;
+        Entry& entry = m_Entries[path];
+        if (entry.data.empty())
+            m_Order.push_back(path);
+        m_Total -= entry.data.size();
+        entry.write_time = write_time;
+        entry.data.assign(buffer, buffer + size);
+        m_Total += size;
+        Trim();
+    }
 
-        FILE* file = fopen(full_path, "rb");
-        if (!file)
+    void Trim()
+    {
+        while (m_Total > m_Limit && !m_Order.empty())
         {
-            ConsolePrintf(RED, "\tFailed to read file. Missing on disk?\n");
-            return false;
+            auto it = m_Entries.find(m_Order.front());
+            if (it != m_Entries.end())
+            {
+                m_Total -= it->second.data.size();
+                m_Entries.erase(it);
+            }
+            m_Order.pop_front();
         }
+    }
 
-        const char* file_name = &full_path[strlen(base_dir)];
+    std::unordered_map<std::string, Entry> m_Entries;
+    std::deque<std::string> m_Order;
+    size_t m_Total = 0;
+    size_t m_Limit = 0;
+    std::atomic<size_t> m_Hits = { 0 };
+    std::mutex m_Mutex;
+};
 
-        int idx = -1;
-        for (size_t i = 0; i < file_list.size(); i++)
+FileCache g_FileCache;
+
+// Reads a batch of files on a pool of threads so loading many small files isn't latency bound
+void LoadFiles(const std::vector<std::string>& paths, std::vector<LoadedFile>& files)
+{
+    files.resize(paths.size());
+
+    std::atomic<size_t> next_file(0);
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next_file++) < paths.size())
         {
-            if (!strcmp(file_list[i].filename, file_name))
+            LoadedFile& loaded = files[i];
+            loaded.buffer = nullptr;
+            loaded.size = 0;
+            loaded.loaded = false;
+            loaded.mapped = false;
+
+            uint64_t write_time = 0;
+            if (g_FileCache.IsEnabled())
             {
-                idx = (int)i;
-                break;
+                WIN32_FILE_ATTRIBUTE_DATA attributes;
+                if (GetFileAttributesEx(paths[i].c_str(), GetFileExInfoStandard, &attributes))
+                {
+                    uint64_t size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+                    write_time = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+                    if (g_FileCache.Get(paths[i], size, write_time, loaded))
+                        continue;
+                }
             }
-        }
 
-        if (idx >= 0)
-        {
-            ZipFile& zip_file = file_list[idx];
-            zip_file.Destroy();
-            zip_file.InitFromFile(file, file_name);
+            FILE* file = fopen(paths[i].c_str(), "rb");
+            if (!file)
+                continue;
+
+            _fseeki64(file, 0, SEEK_END);
+            loaded.size = (size_t)_ftelli64(file);
+            _fseeki64(file, 0, SEEK_SET);
+            if (IsMappedSize(loaded.size))
+            {
+                loaded.loaded = loaded.mapped = true;
+                fclose(file);
+                continue;
+            }
+
+            loaded.buffer = new char[loaded.size];
+            loaded.loaded = fread(loaded.buffer, 1, loaded.size, file) == loaded.size;
+            fclose(file);
+
+            if (loaded.loaded && write_time)
+                g_FileCache.Put(paths[i], write_time, loaded.buffer, loaded.size);
         }
-        else
+    };
+
+    size_t thread_count = min((size_t)max(g_IniAsyncIOThreads, 1), paths.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+struct ManifestEntry
+{
+    std::string name;
+    uint64_t size;
+    uint64_t write_time;
+    bool directory;
+};
+
+struct ManifestDirectory
+{
+    uint64_t write_time;
+    std::vector<ManifestEntry> entries; // in listing order
+};
+
+uint64_t GetFileTime(const FILETIME& time)
+{
+    return ((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime;
+}
+
+// Listing of ADD source trees, walked by a pool of threads. A directory whose write time is the
+// same as in the previous listing reuses its entries without being read again. Creating, deleting
+// or renaming a file changes that time, editing one doesn't, so sizes of reused files are only hints
+struct DirectoryManifest
+{
+    void Walk(const std::string& root, const DirectoryManifest* previous, std::vector<std::string>& errors)
+    {
+        std::deque<std::string> queue;
+        queue.push_back(root);
+        size_t active = 0;
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        auto worker = [&]()
         {
-            file_list.emplace_back();
-            ZipFile& zip_file = file_list.back();
-            zip_file.InitFromFile(file, file_name);
-        }
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                condition.wait(lock, [&]() { return !queue.empty() || !active; });
+                if (queue.empty())
+                    break;
+
+                std::string path = queue.front();
+                queue.pop_front();
+                active++;
+                lock.unlock();
+
+                ManifestDirectory directory;
+                std::string error;
+                bool reused = false;
+                if (ReadDirectory(path, previous, directory, error, &reused))
+                {
+                    lock.lock();
+                    for (ManifestEntry& entry : directory.entries)
+                        if (entry.directory)
+                            queue.push_back(path + "/" + entry.name);
+                    if (reused)
+                        m_Reused++;
+                    else
+                        m_Listed++;
+                    m_Directories[path] = std::move(directory);
+                }
+                else
+                {
+                    lock.lock();
+                    errors.push_back(error);
+                }
 
-        fclose(file);
-        return true;
+                active--;
+                condition.notify_all();
+            }
+        };
+
+        size_t thread_count = (size_t)max(g_IniWalkThreads, 1);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& thread : threads)
+            thread.join();
     }
 
-    bool RecurseDirectory(const char* start_path, const char* base_dir, ZipFileList& file_list)
+    static bool ReadDirectory(const std::string& path, const DirectoryManifest* previous, ManifestDirectory& directory, std::string& error, bool* reused)
     {
-        char path[_MAX_PATH];
-        WIN32_FIND_DATA find_data;
-
-        sprintf(path, "%s/*", start_path);
+        char message[_MAX_PATH + 64];
 
-        HANDLE find = FindFirstFile(path, &find_data);
-        if (find == INVALID_HANDLE_VALUE)
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attributes))
         {
-            ConsolePrintf(RED, "\tFailed to recurse directory %s (error: %d)\n", start_path, GetLastError());
+            snprintf(message, sizeof(message), "Failed to read directory %s (error: %d)", path.c_str(), GetLastError());
+            error = message;
             return false;
         }
+        directory.write_time = GetFileTime(attributes.ftLastWriteTime);
 
-        do 
+        if (previous)
         {
-            if (find_data.cFileName[0] != '.')
+            auto it = previous->m_Directories.find(path);
+            if (it != previous->m_Directories.end() && it->second.write_time == directory.write_time)
             {
-                sprintf(path, "%s/%s", start_path, find_data.cFileName);
-
-                if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                {
-                    if (!RecurseDirectory(path, base_dir, file_list))
-                        return false;
-                }
-                else 
-                {
-                    if (!AddFile(path, base_dir, file_list))
-                        return false;
-                }
+                directory.entries = it->second.entries;
+                *reused = true;
+                return true;
             }
-        } 
+        }
+
+        char pattern[_MAX_PATH];
+        snprintf(pattern, sizeof(pattern), "%s/*", path.c_str());
+
+        WIN32_FIND_DATA find_data;
+        HANDLE find = FindFirstFileEx(pattern, FindExInfoBasic, &find_data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (find == INVALID_HANDLE_VALUE)
+        {
+            snprintf(message, sizeof(message), "Failed to recurse directory %s (error: %d)", path.c_str(), GetLastError());
+            error = message;
+            return false;
+        }
+
+        do
+        {
+            if (find_data.cFileName[0] == '.')
+                continue;
+
+            directory.entries.emplace_back();
+            ManifestEntry& entry = directory.entries.back();
+            entry.name = find_data.cFileName;
+            entry.size = ((uint64_t)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+            entry.write_time = GetFileTime(find_data.ftLastWriteTime);
+            entry.directory = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        }
         while (FindNextFile(find, &find_data) != 0);
 
         FindClose(find);
         return true;
     }
-};
 
-struct OperationRemove : OperationBase
-{
-    OperationRemove(char* value) : OperationBase("REMOVE", value) {}
-    virtual bool OperateZip(ZipFileList& file_list) override
+    // files under path, depth first in listing order like the old recursive walk
+    void GetFiles(const std::string& path, std::vector<std::string>& paths, std::vector<uint64_t>* sizes) const
     {
-        size_t len = strlen(m_Value);
+        auto it = m_Directories.find(path);
+        if (it == m_Directories.end())
+            return;
 
-        int idx = -1;
-        for (int i = (int)file_list.size() - 1; i >= 0; i--)
+        for (const ManifestEntry& entry : it->second.entries)
         {
-            ZipFile& zip_file = file_list[i];
-            if (!strncmp(zip_file.filename, m_Value, len))
+            std::string entry_path = path + "/" + entry.name;
+            if (entry.directory)
             {
-                if (g_IniLogOperations)
-                    ConsolePrintf(WHITE, "\tRemoving file %s\n", zip_file.filename);
+                GetFiles(entry_path, paths, sizes);
+                continue;
+            }
 
-                zip_file.Destroy();
-                EraseElement(file_list, i);
+            paths.push_back(entry_path);
+            if (sizes)
+                sizes->push_back(entry.size);
+        }
+    }
+
+    bool Load(const char* path)
+    {
+        FILE* file = fopen(path, "r");
+        if (!file)
+            return false;
+
+        char line[_MAX_PATH + 64];
+        bool valid = fgets(line, sizeof(line), file) && !strcmp(line, "MapBatchManifest 1\n");
+
+        ManifestDirectory* directory = nullptr;
+        while (valid && fgets(line, sizeof(line), file))
+        {
+            line[strcspn(line, "\n")] = '\0';
+
+            unsigned long long size = 0;
+            unsigned long long write_time = 0;
+            int name_offset = 0;
+            if (sscanf(line, "D %llu %n", &write_time, &name_offset) == 1 && name_offset)
+            {
+                directory = &m_Directories[line + name_offset];
+                directory->write_time = write_time;
+                directory->entries.clear();
+            }
+            else if (directory && sscanf(line, "F %llu %llu %n", &size, &write_time, &name_offset) == 2 && name_offset)
+            {
+                directory->entries.push_back({ line + name_offset, size, write_time, false });
+            }
+            else if (directory && sscanf(line, "S %n", &name_offset) == 0 && name_offset)
+            {
+                directory->entries.push_back({ line + name_offset, 0, 0, true });
             }
         }
 
-        return true;
+        fclose(file);
+        if (!valid)
+            m_Directories.clear();
+        return valid;
     }
-};
 
-bool OperateZip(ZipFileList& file_list)
-{
-    for (OperationBase* operation : g_IniOperations)
+    bool Save(const char* path) const
     {
-        if (g_IniLogOperations)
-            ConsolePrintf(AQUA, "Running operation %s...\n", operation->m_Name);
+        // local workers share the working directory and save at the same time, each renames a whole file over it
+        char temp_path[_MAX_PATH];
+        snprintf(temp_path, sizeof(temp_path), "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
 
-        if (!operation->OperateZip(file_list))
-        {
-            ConsolePrintf(RED, "Failed to run all operations\n");
+        FILE* file = fopen(temp_path, "w");
+        if (!file)
             return false;
+
+        fputs("MapBatchManifest 1\n", file);
+        for (auto& it : m_Directories)
+        {
+            fprintf(file, "D %llu %s\n", it.second.write_time, it.first.c_str());
+            for (const ManifestEntry& entry : it.second.entries)
+            {
+                if (entry.directory)
+                    fprintf(file, "S %s\n", entry.name.c_str());
+                else
+                    fprintf(file, "F %llu %llu %s\n", entry.size, entry.write_time, entry.name.c_str());
+            }
         }
+
+        bool success = !ferror(file);
+        fclose(file);
+        success = success && MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+        if (!success)
+            DeleteFile(temp_path);
+        return success;
     }
 
-    return true;
-}
+    std::unordered_map<std::string, ManifestDirectory> m_Directories;
+    size_t m_Listed = 0;
+    size_t m_Reused = 0;
+};
 
-struct UGCWrapper
+// Each ADD tree is walked once per batch and shared by every map, then saved to g_ManifestName
+// so the next run only lists directories that changed
+struct ManifestStore
 {
-    UGCWrapper() : m_DownloadCallback(NULL, NULL) {}
-
-    void CallbackQuery(SteamUGCQueryCompleted_t* result, bool error)
+    bool GetFiles(const char* root, std::vector<std::string>& paths, std::vector<uint64_t>* sizes, std::vector<std::string>& errors)
     {
-        if (error || result->m_eResult != k_EResultOK)
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (!m_Loaded)
         {
-            ConsolePrintf(RED, "Failed to query Steam Workshop maps, result: %d\n", result->m_eResult);
-            m_Done = m_Error = true;
-            g_SteamUGC->ReleaseQueryUGCRequest(m_QueryHandle);
-            return;
+            m_Loaded = true;
+            if (g_IniReuseManifest)
+                m_Previous.Load(g_ManifestName);
         }
 
-        uint32 results = result->m_unNumResultsReturned;
-        for (uint32_t i = 0; i < results; i++)
+        auto it = m_Walked.find(root);
+        if (it == m_Walked.end())
         {
-            SteamUGCDetails_t details = {};
-            g_SteamUGC->GetQueryUGCResult(result->m_handle, i, &details);
-            m_Files.push_back(details);
-        }
-            
-        uint32 total_results = result->m_unTotalMatchingResults;
-        g_SteamUGC->ReleaseQueryUGCRequest(m_QueryHandle);
+            auto start = std::chrono::steady_clock::now();
 
-        if (results == 0 || m_Files.size() >= total_results)
-            m_Done = true;
-        else
-            Enumerate(++m_Page);
-    }
+            DirectoryManifest manifest;
+            manifest.Walk(root, g_IniReuseManifest ? &m_Previous : nullptr, errors);
+            for (auto& directory : manifest.m_Directories)
+                m_Current.m_Directories[directory.first] = directory.second;
 
-    void Enumerate(uint32_t page)
-    {
-        m_QueryHandle = g_SteamUGC->CreateQueryUserUGCRequest(g_UserAccountID,
-            k_EUserUGCList_Published,
-            k_EUGCMatchingUGCType_Items,
-            k_EUserUGCListSortOrder_CreationOrderDesc,
-            g_AppID, g_AppID, page);
+            if (g_IniLogOperations)
+            {
+                long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                ConsolePrintf(WHITE, "\tListed %s in %lld ms (%llu directories read, %llu unchanged)\n",
+                    root, elapsed, (uint64_t)manifest.m_Listed, (uint64_t)manifest.m_Reused);
+            }
 
-        if (m_QueryHandle == k_UGCQueryHandleInvalid)
-        {
-            ConsolePrintf(RED, "Failed to fetch Steam Workshop maps\n");
-            m_Done = m_Error = true;
-            return;
+            it = m_Walked.emplace(root, errors).first;
+            if (g_IniReuseManifest && !m_Current.Save(g_ManifestName))
+                ConsolePrintf(YELLOW, "Failed to save %s\n", g_ManifestName);
         }
-
-        m_Call = g_SteamUGC->SendQueryUGCRequest(m_QueryHandle);
-        if (m_Call == k_uAPICallInvalid)
+        else
         {
-            ConsolePrintf(RED, "Failed to send Steam Workshop query\n");
-            m_Done = m_Error = true;
-            return;
+            errors = it->second;
         }
 
-        m_QueryCallback.Set(m_Call, this, &UGCWrapper::CallbackQuery);
+        m_Current.GetFiles(root, paths, sizes);
+        return errors.empty();
     }
 
-    void EnumerateAll()
+    // the next batch walks again, reusing what was listed in this one
+    void Reset()
     {
-        m_Done = false;
-        m_Page = 1;
-        Enumerate(m_Page);
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (auto& directory : m_Current.m_Directories)
+            m_Previous.m_Directories[directory.first] = directory.second;
+        m_Current.m_Directories.clear();
+        m_Walked.clear();
     }
 
-    void DownloadQuery(DownloadItemResult_t* result)
-    {
-        if (result->m_unAppID != g_AppID || result->m_nPublishedFileId != m_DownloadID)
-            return;
+    DirectoryManifest m_Previous;
+    DirectoryManifest m_Current;
+    std::unordered_map<std::string, std::vector<std::string>> m_Walked; // root to its errors
+    bool m_Loaded = false;
+    std::mutex m_Mutex;
+};
 
-        if (result->m_eResult > k_EResultOK)
-        {
-            ConsolePrintf(RED, "Download failed, result: %d         \n", result->m_eResult);
-            ConsolePrintf(RED, "Check internet connection and ensure BSP is not open in any tool\n");
-            m_Done = m_Error = true;
-            return;
-        }
+ManifestStore g_Manifests;
 
-        ConsolePrintf(GREEN, "Download successful!                                    \n");
-        if (++m_Downloaded >= m_Files.size())
-            m_Done = true;
-        else
-            DownloadFile(m_Files[m_Downloaded].m_nPublishedFileId);
-    }
+struct TempMapWrite
+{
+    std::string path;
+    char* bsp_data;
+    size_t bsp_size;
+    void* zip_stream; // owns zip_buf if set
+    char* zip_buf;
+    size_t zip_len;
+    size_t reserved; // memory budget released once written
+};
 
-    void DownloadFile(PublishedFileId_t id)
+// writes next to the target and renames over it, watch mode rewrites the only patched copy in place
+static bool WriteTempMap(const char* path, const char* bsp_data, size_t bsp_size, const char* zip_buf, size_t zip_len)
+{
+    char temp_path[_MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE* bsp_temp = fopen(temp_path, "wb");
+    if (!bsp_temp)
     {
-        ConsolePrintf(WHITE, "Downloading map %llu...\n", id);
-        m_DownloadID = id;
-        g_SteamUGC->DownloadItem(id, true);
+        ConsolePrintf(RED, "Failed to open temporary BSP %s for writing\n", temp_path);
+        return false;
     }
 
-    void DownloadAll()
+    bool success = fwrite(bsp_data, 1, bsp_size, bsp_temp) == bsp_size &&
+        fwrite(zip_buf, 1, zip_len, bsp_temp) == zip_len;
+    success = fclose(bsp_temp) == 0 && success;
+    success = success && MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+
+    if (!success)
     {
-        m_Done = false;
-        m_DownloadCallback.Register(this, &UGCWrapper::DownloadQuery);
-        m_Downloaded = 0;
-        DownloadFile(m_Files[0].m_nPublishedFileId);
+        DeleteFile(temp_path);
+        ConsolePrintf(RED, "Failed to write temporary BSP %s\n", path);
     }
+    return success;
+}
 
-    bool Operate(const char* bspname)
+// Writes temporary BSPs on a background thread so the next map can start operating
+struct TempMapWriter
+{
+    void Push(TempMapWrite& write)
     {
-        FILE* bsp = fopen(bspname, "rb");
-        if (!bsp)
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_Thread.joinable())
         {
-            ConsolePrintf(RED, "Failed to open %s\n", bspname);
-            return false;
+            m_Stop = false;
+            m_Thread = std::thread(&TempMapWriter::Run, this);
         }
 
-        fseek(bsp, 0, SEEK_END);
-        size_t bsp_size = ftell(bsp);
-        fseek(bsp, 0, SEEK_SET);
-        char* bsp_data = new char[bsp_size];
-        fread(bsp_data, 1, bsp_size, bsp);
-        fclose(bsp);
+        m_Queue.push_back(write);
+        m_Condition.notify_all();
+    }
 
-        BSPHeader* header = (BSPHeader*)bsp_data;
-        if (header->ident != IDBSPHEADER)
+    // waits for all queued writes, returns false if any failed
+    bool Finish()
+    {
         {
-            ConsolePrintf(RED, "File %s is not a valid BSP!\n", bspname);
-            return false;
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stop = true;
+            m_Condition.notify_all();
         }
 
-        BSPLump& pak_file = header->lumps[40];
+        if (m_Thread.joinable())
+            m_Thread.join();
 
-        int zip_len = pak_file.length;
-        char* zip_buf = bsp_data + pak_file.offset;
+        bool success = !m_Failed;
+        m_Failed = false;
+        return success;
+    }
 
-        ZipContainer zip;
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_FailedPaths.clear();
+    }
 
-        if (g_IniWritePakFile)
+    void Run()
+    {
+        while (true)
         {
-            zip.stream_write_mem = mz_stream_mem_create();
-            mz_stream_mem_set_grow_size(zip.stream_write_mem, (1024 * 1024 * 128)); // ~128mb
-            mz_stream_open(zip.stream_write_mem, NULL, MZ_OPEN_MODE_CREATE);
-            mz_zip_writer_open(zip.stream_write, zip.stream_write_mem, 0);
-
-            if (g_IniCompressPakFile)
-            {
-                mz_zip_writer_set_compress_method(zip.stream_write, MZ_COMPRESS_METHOD_LZMA);
-                mz_zip_writer_set_compress_level(zip.stream_write, g_IniCompressionLevel);
-            }
-            else
+            TempMapWrite write;
             {
-                mz_zip_writer_set_compress_method(zip.stream_write, MZ_COMPRESS_METHOD_STORE);
-                mz_zip_writer_set_compress_level(zip.stream_write, MZ_COMPRESS_LEVEL_DEFAULT);
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Condition.wait(lock, [&] { return m_Stop || !m_Queue.empty(); });
+                if (m_Queue.empty())
+                    break;
+
+                write = m_Queue.front();
+                m_Queue.pop_front();
             }
+
+            if (!WriteTempMap(write.path.c_str(), write.bsp_data, write.bsp_size, write.zip_buf, write.zip_len))
+                SetFailed(write.path);
+
+            delete[] write.bsp_data;
+            mz_stream_mem_delete(&write.zip_stream);
+            g_MemoryBudget.Release(write.reserved);
         }
+    }
 
-        mz_stream_mem_set_buffer(zip.stream_read_mem, zip_buf, zip_len);
-        mz_zip_reader_open(zip.stream_read, zip.stream_read_mem);
-        mz_zip_reader_goto_first_entry(zip.stream_read);
+    void SetFailed(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_FailedPaths.push_back(path);
+        m_Failed = true;
+    }
 
-        ConsolePrintf(WHITE, "Decompressing pak file...\n");
-        ZipFileList file_list;
+    bool HasFailed(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return IsElementInVector(m_FailedPaths, path);
+    }
 
-        do 
-        {
-            mz_zip_reader_entry_open(zip.stream_read);
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::deque<TempMapWrite> m_Queue;
+    std::vector<std::string> m_FailedPaths;
+    std::atomic<bool> m_Failed = { false };
+    bool m_Stop = false;
+};
 
-            mz_zip_file* file_info = nullptr;
-            mz_zip_reader_entry_get_info(zip.stream_read, &file_info);
+TempMapWriter g_TempMapWriter;
 
-            if (g_IniPrintPakFile)
-                ConsolePrintf(WHITE, "\tsize: %u\t\t%s\n", file_info->uncompressed_size, file_info->filename);
+// '*' matches any run of characters including slashes, '?' any single one, case insensitive
+static bool MatchGlob(const char* pattern, const char* str, size_t len)
+{
+    const char* end = str + len;
+    const char* star = nullptr;
+    const char* star_str = nullptr;
+    while (str < end)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            star_str = str;
+        }
+        else if (*pattern && (*pattern == '?' || tolower((uint8_t)*pattern) == tolower((uint8_t)*str)))
+        {
+            pattern++;
+            str++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            str = ++star_str;
+        }
+        else
+        {
+            return false;
+        }
+    }
 
-            file_list.emplace_back();
-            ZipFile& zip_file = file_list.back();
-            zip_file.Init(file_info->filename, file_info->uncompressed_size);
+    while (*pattern == '*')
+        pattern++;
+    return !*pattern;
+}
 
-            mz_zip_reader_entry_read(zip.stream_read, zip_file.buffer, (int32_t)zip_file.size);
-            mz_zip_reader_entry_close(zip.stream_read);
-        } 
-        while (mz_zip_reader_goto_next_entry(zip.stream_read) == MZ_OK);
+static bool MatchGlob(const char* pattern, const char* str)
+{
+    return MatchGlob(pattern, str, strlen(str));
+}
 
-        mz_zip_reader_close(zip.stream_read);
-        zip.stream_read = nullptr;
+struct EntityString
+{
+    bool Equals(const char* other, size_t other_len) const { return len == other_len && !_strnicmp(str, other, len); }
 
-        bool success = OperateZip(file_list);
+    const char* str;
+    uint32_t len;
+};
 
-        if (g_IniWritePakFile)
-        {   
-            if (success)
-            {
-                if (g_IniCompressPakFile)
-                    ConsolePrintf(WHITE, "Compressing files. This will take a while!\n");
-                else
-                    ConsolePrintf(WHITE, "Writing pak file...\n");
+struct EntityKeyValue
+{
+    EntityString key;
+    EntityString value;
+};
 
-                time_t the_time = time(NULL);
-                size_t zip_file_count = file_list.size();
-                for (size_t i = 0; i < zip_file_count; i++)
-                {
-                    ZipFile& zip_file = file_list[i];
+struct Entity
+{
+    std::vector<EntityKeyValue> keyvalues;
+    bool killed;
+};
 
-                    mz_zip_file write_file_info = { 0 };
-                    write_file_info.filename = zip_file.filename;
-                    write_file_info.modified_date = the_time;
-                    write_file_info.version_madeby = MZ_VERSION_BUILD;
-                    write_file_info.compression_method = g_IniCompressPakFile ? MZ_COMPRESS_METHOD_LZMA : MZ_COMPRESS_METHOD_STORE;
-                    write_file_info.flag = MZ_ZIP_FLAG_UTF8;
-                    write_file_info.zip64 = MZ_ZIP64_DISABLE;
+// Entity lump split into keyvalues that point into the lump itself or into the rule strings,
+// nothing is copied until it is serialized again. Kept per thread so allocations are reused between maps
+struct EntityLump
+{
+    bool Parse(const char* data, size_t size)
+    {
+        m_Count = 0;
+        const char* p = data;
+        const char* end = data + size;
+        while (true)
+        {
+            while (p < end && isspace((uint8_t)*p))
+                p++;
+            if (p >= end || !*p)
+                return true;
 
-                    mz_zip_writer_entry_open(zip.stream_write, &write_file_info);
-                    mz_zip_writer_entry_write(zip.stream_write, zip_file.buffer, (int32_t)zip_file.size);
-                    mz_zip_writer_entry_close(zip.stream_write);
+            if (*p++ != '{')
+                return false;
 
-                    ConsolePrintProgress(PURPLE, i, zip_file_count);
-                }
+            if (m_Count == m_Entities.size())
+                m_Entities.emplace_back();
+            Entity& entity = m_Entities[m_Count++];
+            entity.keyvalues.clear();
+            entity.killed = false;
 
-                if (g_IniCompressPakFile)
+            while (true)
+            {
+                while (p < end && isspace((uint8_t)*p))
+                    p++;
+                if (p >= end)
+                    return false;
+                if (*p == '}')
                 {
-                    ConsolePrintf(GREEN, "Compression successful              \n");
-                    ConsolePrintf(WHITE, "Writing pak file...\n");
+                    p++;
+                    break;
                 }
 
-                mz_zip_writer_close(zip.stream_write);
-                zip.stream_write = nullptr;
+                EntityKeyValue keyvalue;
+                if (!ReadString(p, end, keyvalue.key))
+                    return false;
+                while (p < end && isspace((uint8_t)*p))
+                    p++;
+                if (!ReadString(p, end, keyvalue.value))
+                    return false;
+                entity.keyvalues.push_back(keyvalue);
+            }
+        }
+    }
 
-                mz_stream_mem_get_buffer(zip.stream_write_mem, (const void**)&zip_buf);
-                mz_stream_mem_get_buffer_length(zip.stream_write_mem, &zip_len);
+    bool ReadString(const char*& p, const char* end, EntityString& str)
+    {
+        if (p >= end || *p != '"')
+            return false;
 
-                bsp_size -= pak_file.length;
-                pak_file.length = zip_len;
-            }
-            else
+        p++;
+        const char* close = (const char*)memchr(p, '"', end - p);
+        if (!close)
+            return false;
+
+        str.str = p;
+        str.len = (uint32_t)(close - p);
+        p = close + 1;
+        return true;
+    }
+
+    // same layout vbsp writes, including the terminator
+    void Serialize(std::vector<char>& out)
+    {
+        out.clear();
+        for (size_t i = 0; i < m_Count; i++)
+        {
+            Entity& entity = m_Entities[i];
+            if (entity.killed)
+                continue;
+
+            out.insert(out.end(), { '{', '\n' });
+            for (EntityKeyValue& keyvalue : entity.keyvalues)
             {
-                mz_zip_writer_close(zip.stream_write);
-                zip.stream_write = nullptr;
+                out.push_back('"');
+                out.insert(out.end(), keyvalue.key.str, keyvalue.key.str + keyvalue.key.len);
+                out.insert(out.end(), { '"', ' ', '"' });
+                out.insert(out.end(), keyvalue.value.str, keyvalue.value.str + keyvalue.value.len);
+                out.insert(out.end(), { '"', '\n' });
             }
+            out.insert(out.end(), { '}', '\n' });
         }
+        out.push_back('\0');
+    }
 
-        for (ZipFile& zip_file : file_list)
-            zip_file.Destroy();
+    std::vector<Entity> m_Entities;
+    size_t m_Count = 0;
+};
 
-        if (!success)
-        {
-            delete[] bsp_data;
-            return false;
-        }
+thread_local EntityLump g_EntityLump;
 
-        const char* temp_filename = strrchr(bspname, '/');
-        if (temp_filename)
-            temp_filename += 1;
-        else
-            temp_filename = bspname;
+bool IsBufferUnchanged(const char* buffer, size_t size, const ZipFile& zip_file)
+{
+    if (zip_file.source_entry < 0 || size != zip_file.size)
+        return false;
+    return mz_crypt_crc32_update(0, (const uint8_t*)buffer, (int32_t)size) == zip_file.source_crc;
+}
 
-        strcpy(m_LastTempMap, g_MapTempPath);
-        strcat(m_LastTempMap, temp_filename);
+// compares size and CRC of a file on disk against an entry still untouched in the source pak
+bool IsFileUnchanged(FILE* file, const ZipFile& zip_file)
+{
+    if (zip_file.source_entry < 0)
+        return false;
 
-        ConsolePrintf(WHITE, "Writing temporary BSP to %s\n", m_LastTempMap);
+    fseek(file, 0, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size != zip_file.size)
+        return false;
 
-        FILE* bsp_temp = fopen(m_LastTempMap, "wb");
-        if (bsp_temp)
-        {
-            fwrite(bsp_data, 1, bsp_size, bsp_temp);
-            fwrite(zip_buf, 1, zip_len, bsp_temp);
-            fclose(bsp_temp);
-            delete[] bsp_data;
+    // minizip forwards this to zlib-ng, which uses the hardware accelerated CRC where available
+    uint8_t chunk[64 * 1024];
+    uint32_t crc = 0;
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        crc = mz_crypt_crc32_update(crc, chunk, (int32_t)len);
 
-            ConsolePrintf(GREEN, "Done with BSP %s\n", bspname);
-            return true;
-        }
-        else
+    fseek(file, 0, SEEK_SET);
+    return crc == zip_file.source_crc;
+}
+
+struct PlanAdd
+{
+    std::string name;
+    std::string path;
+    size_t order; // position among the appended entries
+    bool live; // not removed again after its last ADD
+    bool removed; // a REMOVE matched it before its last ADD, so an original entry can't stay in place
+};
+
+// The ADD and REMOVE operations folded into their end result: the last source of every added
+// entry, and the prefixes removing original entries. Applied in one pass over the pak it leaves
+// the same entries in the same order as running the operations one by one, but reads each source
+// file at most once and skips files a later REMOVE would delete
+struct OperationPlan
+{
+    void Clear()
+    {
+        m_Adds.clear();
+        m_AddIndex.clear();
+        m_Removes.clear();
+        m_Next = 0;
+        m_Built = false;
+    }
+
+    void Add(const char* name, const char* path)
+    {
+        auto it = m_AddIndex.find(name);
+        if (it == m_AddIndex.end())
         {
-            delete[] bsp_data;
+            m_AddIndex.emplace(name, m_Adds.size());
+            m_Adds.push_back({ name, path, m_Next++, true, IsRemoved(name) });
+            return;
+        }
 
-            ConsolePrintf(RED, "Failed to open temporary BSP for writing\n");
-            return false;
+        // a re-add after a REMOVE appends again
+        PlanAdd& add = m_Adds[it->second];
+        if (!add.live)
+        {
+            add.order = m_Next++;
+            add.live = true;
+            add.removed = true;
         }
+        add.path = path;
     }
 
-    void OperateAll()
+    void Remove(const char* prefix)
     {
-        GetTempPath(sizeof(g_MapTempPath), g_MapTempPath);
-        FixSlashes(g_MapTempPath);
-        strcat(g_MapTempPath, "maps/");
-        _mkdir(g_MapTempPath);
-        strcat(g_MapTempPath, "workshop/");
-        _mkdir(g_MapTempPath);
+        size_t len = strlen(prefix);
+        for (PlanAdd& add : m_Adds)
+            if (!strncmp(add.name.c_str(), prefix, len))
+                add.live = false;
+        m_Removes.emplace_back(prefix);
+    }
 
-        char temp_path[_MAX_PATH];
-        snprintf(temp_path, sizeof(temp_path), "%s*", g_MapTempPath);
-        WIN32_FIND_DATA find_data;
-        HANDLE find = FindFirstFile(temp_path, &find_data);
-        if (find != INVALID_HANDLE_VALUE)
+    bool IsRemoved(const char* name) const
+    {
+        for (const std::string& prefix : m_Removes)
+            if (!strncmp(name, prefix.c_str(), prefix.size()))
+                return true;
+        return false;
+    }
+
+    bool Apply(ZipFileList& file_list)
+    {
+        std::vector<bool> applied(m_Adds.size(), false);
+        std::vector<std::pair<size_t, size_t>> targets; // add, entry
+
+        // one pass dropping removed entries and finding the ones replaced in place
+        size_t kept = 0;
+        for (size_t i = 0; i < file_list.size(); i++)
         {
-            do
+            ZipFile& zip_file = file_list[i];
+            auto it = m_AddIndex.find(zip_file.filename);
+            bool in_place = it != m_AddIndex.end() && m_Adds[it->second].live && !m_Adds[it->second].removed;
+            if (!in_place && (it != m_AddIndex.end() || IsRemoved(zip_file.filename)))
             {
-                if (find_data.cFileName[0] != '.')
-                {
-                    char path[_MAX_PATH];
-                    sprintf(path, "%s%s", g_MapTempPath, find_data.cFileName);
-                    DeleteFile(path);
-                }
-            } 
-            while (FindNextFile(find, &find_data) != 0);
-        }
+                if (g_IniLogOperations && (it == m_AddIndex.end() || !m_Adds[it->second].live))
+                    ConsolePrintf(WHITE, "\tRemoving file %s\n", zip_file.filename);
 
-        for (SteamUGCDetails_t& details : m_Files)
-        {
-            char folder_path[_MAX_PATH];
-            uint64_t file_size;
-            uint32_t timestamp;
-            if (!g_SteamUGC->GetItemInstallInfo(details.m_nPublishedFileId, &file_size, folder_path, sizeof(folder_path), &timestamp))
+                zip_file.Destroy();
+                continue;
+            }
+
+            if (in_place)
             {
-                ConsolePrintf(RED, "Failed to get install information for map %llu!\n", details.m_nPublishedFileId);
-                m_Error = true;
-                break;
+                applied[it->second] = true;
+                targets.emplace_back(it->second, kept);
             }
+            file_list[kept++] = zip_file;
+        }
+        file_list.resize(kept);
+
+        std::vector<size_t> appends;
+        for (size_t i = 0; i < m_Adds.size(); i++)
+            if (m_Adds[i].live && !applied[i])
+                appends.push_back(i);
+        std::sort(appends.begin(), appends.end(), [&](size_t a, size_t b) { return m_Adds[a].order < m_Adds[b].order; });
+
+        for (size_t i : appends)
+        {
+            file_list.emplace_back();
+            file_list.back().InitFromBuffer(nullptr, 0, m_Adds[i].name.c_str());
+            targets.emplace_back(i, file_list.size() - 1);
+        }
+
+        return g_IniStreamPakFile ? LoadStreamed(file_list, targets) : Load(file_list, targets);
+    }
+
+    bool Load(ZipFileList& file_list, const std::vector<std::pair<size_t, size_t>>& targets)
+    {
+        std::vector<std::string> paths;
+        for (auto& target : targets)
+            paths.push_back(m_Adds[target.first].path);
+
+        std::vector<LoadedFile> files;
+        LoadFiles(paths, files);
 
-            FixSlashes(folder_path);
+        // every failure is reported, not just the first
+        bool success = true;
+        std::vector<size_t> failed;
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            PlanAdd& add = m_Adds[targets[i].first];
+            ZipFile& zip_file = file_list[targets[i].second];
+            LoadedFile& loaded = files[i];
+
+            if (g_IniLogOperations)
+                ConsolePrintf(WHITE, "\tAdding file %s\n", add.path.c_str());
 
-            // this is definitely the wrong way to do it but oh well
-            char find_path[_MAX_PATH];
-            snprintf(find_path, sizeof(find_path), "%s/*.bsp", folder_path);
+            ZipFile mapped_file;
+            if (loaded.mapped && !mapped_file.InitFromMapping(add.path.c_str(), add.name.c_str()))
+                loaded.loaded = false;
 
-            WIN32_FIND_DATA find;
-            HANDLE find_handle = FindFirstFile(find_path, &find);
-            if (find_handle == INVALID_HANDLE_VALUE)
+            if (!loaded.loaded)
             {
-                ConsolePrintf(RED, "Failed to locate bsp for map %llu in %s!\n", details.m_nPublishedFileId, folder_path);
-                m_Error = true;
-                break;
+                ConsolePrintf(RED, "\tFailed to read file %s. Missing on disk?\n", add.path.c_str());
+                delete[] loaded.buffer;
+                if (IsPlaceholder(zip_file))
+                    failed.push_back(targets[i].second);
+                success = false;
+                continue;
             }
-            FindClose(find_handle);
-
-            snprintf(find_path, sizeof(find_path), "%s/%s", folder_path, find.cFileName);
-            ConsolePrintf(WHITE, "Operating on %llu (%s)...\n", details.m_nPublishedFileId, find_path);
 
-            if (!Operate(find_path))
+            const char* buffer = loaded.mapped ? mapped_file.buffer : loaded.buffer;
+            if (IsBufferUnchanged(buffer, loaded.size, zip_file))
             {
-                m_Error = true;
-                break;
+                if (g_IniLogOperations)
+                    ConsolePrintf(WHITE, "\tFile is unchanged, keeping original entry\n");
+
+                if (loaded.mapped)
+                    mapped_file.Destroy();
+                delete[] loaded.buffer;
+                continue;
             }
 
-            m_TempMaps.push_back(m_LastTempMap);
+            zip_file.Destroy();
+            if (loaded.mapped)
+                zip_file = mapped_file;
+            else
+                zip_file.InitFromBuffer(loaded.buffer, loaded.size, add.name.c_str());
         }
 
-        for (std::string& map_local : g_IniLocalMaps)
+        DropPlaceholders(file_list, failed);
+        return success;
+    }
+
+    bool LoadStreamed(ZipFileList& file_list, const std::vector<std::pair<size_t, size_t>>& targets)
+    {
+        bool success = true;
+        std::vector<size_t> failed;
+        for (auto& target : targets)
         {
-            const char* map_filename = map_local.c_str();
-            ConsolePrintf(WHITE, "Operating on local map %s...\n", map_filename);
+            PlanAdd& add = m_Adds[target.first];
+            ZipFile& zip_file = file_list[target.second];
 
-            if (!Operate(map_filename))
+            if (g_IniLogOperations)
+                ConsolePrintf(WHITE, "\tAdding file %s\n", add.path.c_str());
+
+            FILE* file = fopen(add.path.c_str(), "rb");
+            if (!file)
             {
-                m_Error = true;
-                break;
+                ConsolePrintf(RED, "\tFailed to read file %s. Missing on disk?\n", add.path.c_str());
+                if (IsPlaceholder(zip_file))
+                    failed.push_back(target.second);
+                success = false;
+                continue;
+            }
+
+            if (IsFileUnchanged(file, zip_file))
+            {
+                if (g_IniLogOperations)
+                    ConsolePrintf(WHITE, "\tFile is unchanged, keeping original entry\n");
+            }
+            else
+            {
+                zip_file.Destroy();
+                zip_file.InitFromPath(file, add.path.c_str(), add.name.c_str());
             }
+            fclose(file);
         }
+
+        DropPlaceholders(file_list, failed);
+        return success;
     }
 
-    void CallbackUpload(SubmitItemUpdateResult_t* result, bool error)
+    // an appended entry Apply made room for, still without contents
+    static bool IsPlaceholder(const ZipFile& zip_file)
     {
-        const char* file_name = m_TempMaps[m_Uploaded].c_str();
+        return !zip_file.buffer && !zip_file.source_path && zip_file.source_entry < 0;
+    }
 
-        if (result->m_bUserNeedsToAcceptWorkshopLegalAgreement)
+    // appended entries whose file failed to load don't stay in the pak as empty files
+    static void DropPlaceholders(ZipFileList& file_list, std::vector<size_t>& failed)
+    {
+        std::sort(failed.begin(), failed.end());
+        for (size_t i = failed.size(); i-- > 0; )
         {
-            ConsolePrintf(RED, "Failed to upload map. User needs to agree to the workshop legal agreement\n");
-            m_Done = m_Error = true;
-            if (!DeleteFile(file_name))
-                ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
-            return;
+            file_list[failed[i]].Destroy();
+            EraseElement(file_list, failed[i]);
         }
+    }
 
-        if (error || result->m_eResult != k_EResultOK)
-        {
-            ConsolePrintf(RED, "Failed to upload map. Result: %d\n", result->m_eResult);
-            m_Done = m_Error = true;
-            if (!DeleteFile(file_name))
-                ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
-            return;
-        }
+    std::vector<PlanAdd> m_Adds;
+    std::unordered_map<std::string, size_t> m_AddIndex;
+    std::vector<std::string> m_Removes;
+    size_t m_Next = 0;
+    bool m_Built = false;
+};
 
-        ConsolePrintf(GREEN, "Upload successful!                     \n");
+OperationPlan g_OperationPlan;
 
-        if (!DeleteFile(file_name))
-        {
-            ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
-            m_Done = m_Error = true;
-            return;
-        }
+struct OperationBase
+{
+    OperationBase(const char* name, char* value)
+    {
+        m_Name = name;
+        m_Value = value;
+    }
 
-        if (++m_Uploaded >= m_Files.size())
-            m_Done = true;
-        else
-        {
-            ConsolePrintf(PURPLE, "Waiting a moment to not trip spam filters...\n");
-            Sleep(5000);
+    virtual ~OperationBase() {}
 
-            Upload(m_Files[m_Uploaded].m_nPublishedFileId);
-        }
-    }
+    virtual bool OperateZip(ZipFileList& file_list) { return true; }
+    virtual size_t EstimateMemory() { return 0; }
+    virtual bool ExpectZip(std::vector<std::string>& present, std::vector<std::string>& absent) { return true; }
+    virtual bool OperateEntities(EntityLump& lump, size_t* edited) { return true; }
+    virtual bool PlanZip(OperationPlan& plan) { return true; }
 
-    void Upload(PublishedFileId_t id)
-    {
-        ConsolePrintf(WHITE, "Uploading map %llu...\n", id);
+    const char* m_Name;
+    std::string m_Value;
+};
+
+struct OperationAdd : OperationBase
+{
+    OperationAdd(char* value) : OperationBase("ADD", value) {}
+
+    bool SplitPath(char* base_dir, char* relative_path, char* full_path, bool* is_file)
+    {
+        bool double_slash = false;
+        const char* p = m_Value.c_str();
+        while (*p)
+        {
+            if (*p == '/' && *(p + 1) == '/')
+            {
+                size_t len = p - m_Value.c_str() + 1;
+                strncpy(base_dir, m_Value.c_str(), len);
+                base_dir[len] = '\0';
+                strcpy(relative_path, p + 2);
+
+                // trailing slash
+                size_t relative_len = strlen(relative_path);
+                if (relative_len && relative_path[relative_len - 1] == '/')
+                    relative_path[relative_len - 1] = '\0';
+
+                double_slash = true;
+                break;
+            }
+
+            p++;
+        }
+
+        if (!double_slash)
+        {
+            ConsolePrintf(RED, "\tNo double slash found in %s\n", m_Value.c_str());
+            return false;
+        }
+
+        snprintf(full_path, _MAX_PATH, "%s%s", base_dir, relative_path);
+
+        p = strrchr(relative_path, '/');
+        *is_file = !p || strchr(p, '.');
+        return true;
+    }
+
+    virtual bool OperateZip(ZipFileList& file_list) override
+    {
+        char base_dir[_MAX_PATH];
+        char relative_path[_MAX_PATH];
+        char full_path[_MAX_PATH];
+
+        bool is_file;
+        if (!SplitPath(base_dir, relative_path, full_path, &is_file))
+            return false;
+
+        if (is_file)
+            return AddFile(full_path, base_dir, file_list);
+
+        // the whole tree is listed first so its files can be read as one batch
+        std::vector<std::string> paths;
+        if (!ListDirectory(full_path, paths, NULL))
+            return false;
+
+        if (g_IniStreamPakFile || g_IniAsyncIOThreads <= 0)
+        {
+            // every failure is reported, not just the first
+            bool success = true;
+            for (std::string& path : paths)
+                if (!AddFile(path.c_str(), base_dir, file_list))
+                    success = false;
+            return success;
+        }
+
+        return AddFiles(paths, base_dir, file_list);
+    }
+
+    virtual bool PlanZip(OperationPlan& plan) override
+    {
+        char base_dir[_MAX_PATH];
+        char relative_path[_MAX_PATH];
+        char full_path[_MAX_PATH];
+
+        bool is_file;
+        if (!SplitPath(base_dir, relative_path, full_path, &is_file))
+            return false;
+
+        size_t base_len = strlen(base_dir);
+        if (is_file)
+        {
+            plan.Add(full_path + base_len, full_path);
+            return true;
+        }
+
+        std::vector<std::string> paths;
+        if (!ListDirectory(full_path, paths, NULL))
+            return false;
+
+        for (std::string& path : paths)
+            plan.Add(path.c_str() + base_len, path.c_str());
+        return true;
+    }
+
+    // total size of the files this operation will read
+    virtual size_t EstimateMemory() override
+    {
+        char base_dir[_MAX_PATH];
+        char relative_path[_MAX_PATH];
+        char full_path[_MAX_PATH];
+
+        bool is_file;
+        if (!SplitPath(base_dir, relative_path, full_path, &is_file))
+            return 0;
+
+        if (is_file)
+        {
+            WIN32_FILE_ATTRIBUTE_DATA attributes;
+            if (!GetFileAttributesEx(full_path, GetFileExInfoStandard, &attributes))
+                return 0;
+            uint64_t size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+            return IsMappedSize(size) ? 0 : (size_t)size;
+        }
+
+        std::vector<std::string> paths;
+        std::vector<uint64_t> sizes;
+        std::vector<std::string> errors;
+        g_Manifests.GetFiles(full_path, paths, &sizes, errors);
+
+        // mapped files are paged from disk rather than held on the heap
+        size_t size = 0;
+        for (uint64_t file_size : sizes)
+            if (!IsMappedSize(file_size))
+                size += (size_t)file_size;
+        return size;
+    }
+
+    // the entry names this operation leaves in the pak, for the verification pass
+    virtual bool ExpectZip(std::vector<std::string>& present, std::vector<std::string>& absent) override
+    {
+        char base_dir[_MAX_PATH];
+        char relative_path[_MAX_PATH];
+        char full_path[_MAX_PATH];
+
+        bool is_file;
+        if (!SplitPath(base_dir, relative_path, full_path, &is_file))
+            return false;
+
+        std::vector<std::string> paths;
+        if (is_file)
+            paths.emplace_back(full_path);
+        else if (!ListDirectory(full_path, paths, NULL))
+            return false;
+
+        size_t base_len = strlen(base_dir);
+        for (std::string& path : paths)
+            present.emplace_back(path.c_str() + base_len);
+        return true;
+    }
+
+    bool AddFile(const char* full_path, const char* base_dir, ZipFileList& file_list)
+    {
+        if (g_IniLogOperations)
+            ConsolePrintf(WHITE, "\tAdding file %s\n", full_path);
+
+        bool valid_file = false;
+
+        FILE* file = fopen(full_path, "rb");
+        if (!file)
+        {
+            ConsolePrintf(RED, "\tFailed to read file %s. Missing on disk?\n", full_path);
+            return false;
+        }
+
+        const char* file_name = &full_path[strlen(base_dir)];
+
+        int idx = FindFile(file_list, file_name);
+        if (idx >= 0 && IsFileUnchanged(file, file_list[idx]))
+        {
+            if (g_IniLogOperations)
+                ConsolePrintf(WHITE, "\tFile is unchanged, keeping original entry\n");
+
+            fclose(file);
+            return true;
+        }
+
+        if (idx >= 0)
+            file_list[idx].Destroy();
+        else
+            file_list.emplace_back();
+
+        ZipFile& zip_file = idx >= 0 ? file_list[idx] : file_list.back();
+        if (g_IniStreamPakFile)
+        {
+            zip_file.InitFromPath(file, full_path, file_name);
+        }
+        else
+        {
+            _fseeki64(file, 0, SEEK_END);
+            bool mapped = IsMappedSize((uint64_t)_ftelli64(file)) && zip_file.InitFromMapping(full_path, file_name);
+            _fseeki64(file, 0, SEEK_SET);
+            if (!mapped)
+                zip_file.InitFromFile(file, file_name);
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    bool AddFiles(const std::vector<std::string>& paths, const char* base_dir, ZipFileList& file_list)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<LoadedFile> files;
+        LoadFiles(paths, files);
+
+        if (g_IniLogOperations)
+        {
+            size_t total_size = 0;
+            size_t mapped_count = 0;
+            for (LoadedFile& loaded : files)
+            {
+                if (loaded.mapped)
+                    mapped_count++;
+                else
+                    total_size += loaded.size;
+            }
+
+            long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            ConsolePrintf(WHITE, "\tRead %llu files (%llu KB) in %lld ms, %llu large files mapped\n",
+                (uint64_t)(files.size() - mapped_count), (uint64_t)(total_size / 1024), elapsed, (uint64_t)mapped_count);
+        }
+
+        // every failure is reported, not just the first
+        bool success = true;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (!AddLoadedFile(paths[i].c_str(), base_dir, file_list, files[i]))
+                success = false;
+            delete[] files[i].buffer;
+        }
+
+        return success;
+    }
+
+    bool AddLoadedFile(const char* full_path, const char* base_dir, ZipFileList& file_list, LoadedFile& loaded)
+    {
+        if (loaded.mapped)
+            return AddFile(full_path, base_dir, file_list);
+
+        if (g_IniLogOperations)
+            ConsolePrintf(WHITE, "\tAdding file %s\n", full_path);
+
+        if (!loaded.loaded)
+        {
+            ConsolePrintf(RED, "\tFailed to read file %s. Missing on disk?\n", full_path);
+            return false;
+        }
+
+        const char* file_name = &full_path[strlen(base_dir)];
+
+        int idx = FindFile(file_list, file_name);
+        if (idx >= 0 && IsBufferUnchanged(loaded.buffer, loaded.size, file_list[idx]))
+        {
+            if (g_IniLogOperations)
+                ConsolePrintf(WHITE, "\tFile is unchanged, keeping original entry\n");
+            return true;
+        }
+
+        if (idx >= 0)
+            file_list[idx].Destroy();
+        else
+            file_list.emplace_back();
+
+        ZipFile& zip_file = idx >= 0 ? file_list[idx] : file_list.back();
+        zip_file.InitFromBuffer(loaded.buffer, loaded.size, file_name);
+        loaded.buffer = nullptr;
+        return true;
+    }
+
+    int FindFile(const ZipFileList& file_list, const char* file_name)
+    {
+        for (size_t i = 0; i < file_list.size(); i++)
+            if (!strcmp(file_list[i].filename, file_name))
+                return (int)i;
+        return -1;
+    }
+
+    bool ListDirectory(const char* start_path, std::vector<std::string>& paths, std::vector<uint64_t>* sizes)
+    {
+        std::vector<std::string> errors;
+        if (g_Manifests.GetFiles(start_path, paths, sizes, errors))
+            return true;
+
+        for (std::string& error : errors)
+            ConsolePrintf(RED, "\t%s\n", error.c_str());
+        return false;
+    }
+};
+
+struct OperationRemove : OperationBase
+{
+    OperationRemove(char* value) : OperationBase("REMOVE", value) {}
+    virtual bool OperateZip(ZipFileList& file_list) override
+    {
+        size_t len = m_Value.size();
+
+        int idx = -1;
+        for (int i = (int)file_list.size() - 1; i >= 0; i--)
+        {
+            ZipFile& zip_file = file_list[i];
+            if (!strncmp(zip_file.filename, m_Value.c_str(), len))
+            {
+                if (g_IniLogOperations)
+                    ConsolePrintf(WHITE, "\tRemoving file %s\n", zip_file.filename);
+
+                zip_file.Destroy();
+                EraseElement(file_list, i);
+            }
+        }
+
+        return true;
+    }
+
+    virtual bool ExpectZip(std::vector<std::string>& present, std::vector<std::string>& absent) override
+    {
+        size_t len = m_Value.size();
+        for (int i = (int)present.size() - 1; i >= 0; i--)
+            if (!strncmp(present[i].c_str(), m_Value.c_str(), len))
+                EraseElement(present, i);
+
+        absent.emplace_back(m_Value);
+        return true;
+    }
+
+    virtual bool PlanZip(OperationPlan& plan) override
+    {
+        plan.Remove(m_Value.c_str());
+        return true;
+    }
+};
+
+// ENTITY=<match> <action> [key] [value]
+// match is * or comma separated key:glob conditions, action is SET, ADD, DELETE or KILL
+struct OperationEntity : OperationBase
+{
+    enum EntityAction
+    {
+        ENTITY_SET,
+        ENTITY_ADD,
+        ENTITY_DELETE,
+        ENTITY_KILL,
+    };
+
+    OperationEntity(char* value) : OperationBase("ENTITY", value) {}
+
+    // splits the rule into whitespace separated tokens, quotes group tokens with spaces
+    bool Compile()
+    {
+        std::vector<std::string> tokens;
+        const char* p = m_Value.c_str();
+        while (*p)
+        {
+            while (isspace((uint8_t)*p))
+                p++;
+            if (!*p)
+                break;
+
+            const char* start = p;
+            if (*p == '"')
+            {
+                const char* close = strchr(++start, '"');
+                if (!close)
+                    return false;
+                tokens.emplace_back(start, close);
+                p = close + 1;
+            }
+            else
+            {
+                while (*p && !isspace((uint8_t)*p))
+                    p++;
+                tokens.emplace_back(start, p);
+            }
+        }
+
+        if (tokens.size() < 2)
+            return false;
+
+        if (tokens[0] != "*")
+        {
+            size_t start = 0;
+            while (start <= tokens[0].size())
+            {
+                size_t end = tokens[0].find(',', start);
+                if (end == std::string::npos)
+                    end = tokens[0].size();
+
+                std::string condition = tokens[0].substr(start, end - start);
+                size_t colon = condition.find(':');
+                if (colon == std::string::npos || colon == 0)
+                    return false;
+
+                m_Conditions.emplace_back(condition.substr(0, colon), condition.substr(colon + 1));
+                start = end + 1;
+            }
+        }
+
+        const char* action = tokens[1].c_str();
+        size_t arguments;
+        if (!_stricmp(action, "SET"))
+            m_Action = ENTITY_SET, arguments = 2;
+        else if (!_stricmp(action, "ADD"))
+            m_Action = ENTITY_ADD, arguments = 2;
+        else if (!_stricmp(action, "DELETE"))
+            m_Action = ENTITY_DELETE, arguments = 1;
+        else if (!_stricmp(action, "KILL"))
+            m_Action = ENTITY_KILL, arguments = 0;
+        else
+            return false;
+
+        if (tokens.size() != 2 + arguments)
+            return false;
+
+        if (arguments > 0)
+            m_Key = tokens[2];
+        if (arguments > 1)
+            m_KeyValue = tokens[3];
+        return true;
+    }
+
+    bool Matches(const Entity& entity)
+    {
+        for (std::pair<std::string, std::string>& condition : m_Conditions)
+        {
+            bool matched = false;
+            for (const EntityKeyValue& keyvalue : entity.keyvalues)
+            {
+                if (keyvalue.key.Equals(condition.first.c_str(), condition.first.size()) &&
+                    MatchGlob(condition.second.c_str(), keyvalue.value.str, keyvalue.value.len))
+                {
+                    matched = true;
+                    break;
+                }
+            }
+
+            if (!matched)
+                return false;
+        }
+
+        return true;
+    }
+
+    virtual bool OperateEntities(EntityLump& lump, size_t* edited) override
+    {
+        EntityString key = { m_Key.c_str(), (uint32_t)m_Key.size() };
+        EntityString value = { m_KeyValue.c_str(), (uint32_t)m_KeyValue.size() };
+
+        for (size_t i = 0; i < lump.m_Count; i++)
+        {
+            Entity& entity = lump.m_Entities[i];
+            if (entity.killed || !Matches(entity))
+                continue;
+
+            // only count real changes so no-op rules don't force a relayout
+            bool modified = false;
+            std::vector<EntityKeyValue>& keyvalues = entity.keyvalues;
+            switch (m_Action)
+            {
+                case ENTITY_SET:
+                {
+                    bool found = false;
+                    for (EntityKeyValue& keyvalue : keyvalues)
+                    {
+                        if (keyvalue.key.Equals(key.str, key.len))
+                        {
+                            if (keyvalue.value.len != value.len || memcmp(keyvalue.value.str, value.str, value.len))
+                                modified = true;
+                            keyvalue.value = value;
+                            found = true;
+                        }
+                    }
+                    if (!found)
+                    {
+                        keyvalues.push_back({ key, value });
+                        modified = true;
+                    }
+                    break;
+                }
+                case ENTITY_ADD:
+                    keyvalues.push_back({ key, value });
+                    modified = true;
+                    break;
+                case ENTITY_DELETE:
+                {
+                    size_t count = keyvalues.size();
+                    keyvalues.erase(std::remove_if(keyvalues.begin(), keyvalues.end(),
+                        [&](const EntityKeyValue& keyvalue) { return keyvalue.key.Equals(key.str, key.len); }), keyvalues.end());
+                    modified = keyvalues.size() != count;
+                    break;
+                }
+                case ENTITY_KILL:
+                    entity.killed = true;
+                    modified = true;
+                    break;
+            }
+
+            if (modified)
+                (*edited)++;
+        }
+
+        return true;
+    }
+
+    std::vector<std::pair<std::string, std::string>> m_Conditions;
+    EntityAction m_Action;
+    std::string m_Key;
+    std::string m_KeyValue;
+};
+
+// folds the configured operations into g_OperationPlan, call again whenever g_IniOperations changes
+bool PlanOperations()
+{
+    g_OperationPlan.Clear();
+    if (!g_IniPlanOperations)
+        return true;
+
+    auto start = std::chrono::steady_clock::now();
+
+    size_t sources = 0;
+    for (OperationBase* operation : g_IniOperations)
+    {
+        if (!operation->PlanZip(g_OperationPlan))
+        {
+            ConsolePrintf(RED, "Failed to plan operation %s=%s\n", operation->m_Name, operation->m_Value.c_str());
+            g_OperationPlan.Clear();
+            return false;
+        }
+    }
+
+    for (PlanAdd& add : g_OperationPlan.m_Adds)
+        if (add.live)
+            sources++;
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(WHITE, "Planned %llu operations into %llu files to add and %llu prefixes to remove in %lld ms\n",
+        (uint64_t)g_IniOperations.size(), (uint64_t)sources, (uint64_t)g_OperationPlan.m_Removes.size(), elapsed);
+
+    g_OperationPlan.m_Built = true;
+    return true;
+}
+
+// runs the operations one by one, as written in the config
+bool OperateZipSequential(ZipFileList& file_list)
+{
+    for (OperationBase* operation : g_IniOperations)
+    {
+        if (g_IniLogOperations)
+            ConsolePrintf(AQUA, "Running operation %s...\n", operation->m_Name);
+
+        if (!operation->OperateZip(file_list))
+        {
+            ConsolePrintf(RED, "Failed to run all operations\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool OperateZip(ZipFileList& file_list)
+{
+    if (!g_OperationPlan.m_Built)
+        return OperateZipSequential(file_list);
+
+    if (g_IniLogOperations)
+        ConsolePrintf(AQUA, "Running operation plan...\n");
+
+    if (!g_OperationPlan.Apply(file_list))
+    {
+        ConsolePrintf(RED, "Failed to run all operations\n");
+        return false;
+    }
+    return true;
+}
+
+// Where an entry goes in the rebuilt pak. Small loose files (scripts, particles, configs) come first,
+// then materials, models and sounds each grouped by directory and by asset family, so a .vmt sits
+// next to its .vtf files and a model's .mdl/.vvd/.vtx/.phy are read as one run
+struct PakOrderKey
+{
+    void Init(const char* filename, size_t size)
+    {
+        std::string path = filename;
+        for (char& c : path)
+            c = (char)tolower((uint8_t)c);
+
+        size_t slash = path.rfind('/');
+        directory = slash == std::string::npos ? "" : path.substr(0, slash);
+        name = slash == std::string::npos ? path : path.substr(slash + 1);
+        family = name.substr(0, name.find('.'));
+
+        static const char* family_extensions[] = { "vmt", "vtf", "mdl", "vvd", "vtx", "phy", "ani" };
+        size_t dot = name.rfind('.');
+        const char* extension = dot == std::string::npos ? "" : name.c_str() + dot + 1;
+        rank = sizeof(family_extensions) / sizeof(*family_extensions);
+        for (int i = 0; i < rank; i++)
+        {
+            if (!strcmp(extension, family_extensions[i]))
+            {
+                rank = i;
+                break;
+            }
+        }
+
+        if (!path.compare(0, 10, "materials/"))
+            section = 1;
+        else if (!path.compare(0, 7, "models/"))
+            section = 2;
+        else if (!path.compare(0, 6, "sound/"))
+            section = 3;
+        else
+            section = size <= (size_t)g_IniOrderSmallSize * 1024 ? 0 : 4;
+    }
+
+    bool operator<(const PakOrderKey& other) const
+    {
+        if (section != other.section)
+            return section < other.section;
+        if (int cmp = directory.compare(other.directory))
+            return cmp < 0;
+        if (int cmp = family.compare(other.family))
+            return cmp < 0;
+        if (rank != other.rank)
+            return rank < other.rank;
+        return name < other.name;
+    }
+
+    int section;
+    int rank;
+    std::string directory;
+    std::string family;
+    std::string name;
+};
+
+// indices of the entries in pak order
+static void GetPakOrder(const std::vector<PakOrderKey>& keys, std::vector<size_t>& order)
+{
+    order.resize(keys.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+}
+
+void OrderPakEntries(ZipFileList& file_list)
+{
+    std::vector<PakOrderKey> keys(file_list.size());
+    for (size_t i = 0; i < file_list.size(); i++)
+        keys[i].Init(file_list[i].filename, file_list[i].size);
+
+    std::vector<size_t> order;
+    GetPakOrder(keys, order);
+
+    size_t moved = 0;
+    ZipFileList ordered;
+    ordered.reserve(file_list.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        if (order[i] != i)
+            moved++;
+        ordered.push_back(file_list[order[i]]);
+    }
+    file_list.swap(ordered);
+
+    if (g_IniLogOperations)
+        ConsolePrintf(AQUA, "Ordered pak file, %llu of %llu entries moved\n", (uint64_t)moved, (uint64_t)file_list.size());
+}
+
+// what the operations should have left in every pak, computed once per batch
+struct VerifyExpectations
+{
+    bool Init()
+    {
+        for (OperationBase* operation : g_IniOperations)
+            if (!operation->ExpectZip(present, absent))
+                return false;
+
+        // a REMOVE followed by an ADD of the same path is allowed to survive
+        std::sort(present.begin(), present.end());
+        present.erase(std::unique(present.begin(), present.end()), present.end());
+        return true;
+    }
+
+    std::vector<std::string> present;
+    std::vector<std::string> absent;
+};
+
+// where an entry's data starts in the BSP, past the name and extra field of its local header
+bool GetEntryDataOffset(void* bsp_stream, int64_t pak_offset, const mz_zip_file* file_info, int64_t* data_offset, uint16_t* extra_size = nullptr)
+{
+    uint16_t sizes[2];
+    int64_t header_offset = pak_offset + file_info->disk_offset;
+    if (mz_stream_seek(bsp_stream, header_offset + 26, MZ_SEEK_SET) != MZ_OK ||
+        mz_stream_read(bsp_stream, sizes, sizeof(sizes)) != sizeof(sizes))
+        return false;
+
+    *data_offset = header_offset + 30 + sizes[0] + sizes[1];
+    if (extra_size)
+        *extra_size = sizes[1];
+    return true;
+}
+
+// Stored entries written with AlignStoredFiles must start on the boundary. The game finds entry data
+// through the central directory's extra field length, so the local one has to match it
+bool IsEntryAligned(void* bsp_stream, int64_t pak_offset, const mz_zip_file* file_info, int alignment, int64_t* data_offset)
+{
+    if (file_info->compression_method != MZ_COMPRESS_METHOD_STORE || !file_info->uncompressed_size)
+        return true;
+
+    uint16_t extra_size;
+    return GetEntryDataOffset(bsp_stream, pak_offset, file_info, data_offset, &extra_size) &&
+        extra_size == file_info->extrafield_size && *data_offset % alignment == 0;
+}
+
+// checks the structure of a generated BSP and every entry of its pak without rebuilding anything
+bool VerifyMap(const char* path, const VerifyExpectations& expected)
+{
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, path, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Verify: failed to open %s\n", path);
+        mz_stream_os_delete(&bsp_stream);
+        return false;
+    }
+
+    bool success = true;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) != sizeof(header) || header.ident != IDBSPHEADER)
+    {
+        ConsolePrintf(RED, "Verify: %s is not a valid BSP\n", path);
+        success = false;
+    }
+
+    mz_stream_seek(bsp_stream, 0, MZ_SEEK_END);
+    int64_t bsp_size = mz_stream_tell(bsp_stream);
+
+    for (int i = 0; success && i < 64; i++)
+    {
+        BSPLump& lump = header.lumps[i];
+        if (lump.offset < 0 || lump.length < 0 || (int64_t)lump.offset + lump.length > bsp_size)
+        {
+            ConsolePrintf(RED, "Verify: lump %d of %s is out of bounds (offset %d, length %d, file size %lld)\n",
+                i, path, lump.offset, lump.length, bsp_size);
+            success = false;
+        }
+    }
+
+    void* zip_read = mz_zip_create();
+    LumpStream pak_read(bsp_stream, header.lumps[40].offset, header.lumps[40].length);
+    if (success && mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Verify: failed to open pak file of %s\n", path);
+        success = false;
+    }
+
+    std::vector<bool> found(expected.present.size(), false);
+    static thread_local uint8_t chunk[256 * 1024];
+
+    for (int32_t err = success ? mz_zip_goto_first_entry(zip_read) : MZ_END_OF_LIST; err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+    {
+        mz_zip_file* file_info = nullptr;
+        if (mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK)
+        {
+            ConsolePrintf(RED, "Verify: bad central directory entry in %s\n", path);
+            success = false;
+            break;
+        }
+
+        auto it = std::lower_bound(expected.present.begin(), expected.present.end(), file_info->filename);
+        bool is_added = it != expected.present.end() && *it == file_info->filename;
+        if (is_added)
+            found[it - expected.present.begin()] = true;
+
+        for (const std::string& prefix : expected.absent)
+        {
+            if (!is_added && !strncmp(file_info->filename, prefix.c_str(), prefix.size()))
+            {
+                ConsolePrintf(RED, "Verify: %s in %s should have been removed\n", file_info->filename, path);
+                success = false;
+                break;
+            }
+        }
+
+        int64_t data_offset = -1;
+        if (g_IniWritePakFile && !g_IniCompressPakFile && g_IniAlignStoredFiles > 0 &&
+            !IsEntryAligned(bsp_stream, header.lumps[40].offset, file_info, min(g_IniAlignStoredFiles, 32768), &data_offset))
+        {
+            ConsolePrintf(RED, "Verify: stored entry %s in %s is not aligned or its local and central extra fields differ (data at %lld)\n",
+                file_info->filename, path, data_offset);
+            success = false;
+        }
+
+        uint32_t crc = 0;
+        int64_t size = 0;
+        int32_t len = 0;
+        err = mz_zip_entry_read_open(zip_read, 0, NULL);
+        while (err == MZ_OK && (len = mz_zip_entry_read(zip_read, chunk, sizeof(chunk))) > 0)
+        {
+            crc = mz_crypt_crc32_update(crc, chunk, len);
+            size += len;
+        }
+        mz_zip_entry_close(zip_read);
+
+        if (err != MZ_OK || len < 0 || crc != file_info->crc || size != file_info->uncompressed_size)
+        {
+            ConsolePrintf(RED, "Verify: entry %s in %s is corrupt\n", file_info->filename, path);
+            success = false;
+        }
+    }
+
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        if (success && !found[i])
+        {
+            ConsolePrintf(RED, "Verify: added file %s is missing from %s\n", expected.present[i].c_str(), path);
+            success = false;
+        }
+    }
+
+    mz_zip_close(zip_read);
+    mz_zip_delete(&zip_read);
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+    return success;
+}
+
+bool VerifyMaps(const std::vector<std::string>& paths, std::vector<std::string>& failed_paths)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    VerifyExpectations expected;
+    if (g_IniWritePakFile && !expected.Init())
+    {
+        ConsolePrintf(RED, "Failed to list the files the operations should have added\n");
+        return false;
+    }
+
+    std::atomic<size_t> next_map(0);
+    std::vector<char> failed(paths.size(), 0);
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next_map++) < paths.size())
+            failed[i] = !VerifyMap(paths[i].c_str(), expected);
+    };
+
+    size_t thread_count = g_IniVerifyThreads > 0 ? (size_t)g_IniVerifyThreads : (size_t)std::thread::hardware_concurrency();
+    thread_count = min(max(thread_count, (size_t)1), paths.size());
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < paths.size(); i++)
+        if (failed[i])
+            failed_paths.push_back(paths[i]);
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (!failed_paths.empty())
+    {
+        ConsolePrintf(RED, "%llu of %llu maps failed verification\n", (uint64_t)failed_paths.size(), (uint64_t)paths.size());
+        return false;
+    }
+
+    ConsolePrintf(GREEN, "Verified %llu maps in %lld ms\n", (uint64_t)paths.size(), elapsed);
+    return true;
+}
+
+static bool HasEntityOperations()
+{
+    for (OperationBase* operation : g_IniOperations)
+        if (!strcmp(operation->m_Name, "ENTITY"))
+            return true;
+    return false;
+}
+
+const int LUMP_ENTITIES = 0;
+const int LUMP_GAME_LUMP = 35;
+const int LUMP_PAKFILE = 40;
+
+struct BSPGameLump
+{
+    int id;
+    unsigned short flags;
+    unsigned short version;
+    int offset;
+    int length;
+};
+
+// Rebuilds everything before the pak file with one lump replaced. Lumps keep their order on disk,
+// aligned to 4 bytes, and the game lump's absolute offsets follow it. The pak file is placed right after
+char* RelayoutBSP(const char* bsp_data, size_t prefix_size, int lump_index, const char* data, size_t size, size_t tail_size, size_t* out_size)
+{
+    const BSPHeader* header = (const BSPHeader*)bsp_data;
+
+    std::vector<int> order;
+    for (int i = 0; i < 64; i++)
+        if (i != LUMP_PAKFILE)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return header->lumps[a].offset < header->lumps[b].offset; });
+
+    size_t capacity = prefix_size + size + 64 * 4 + tail_size;
+    char* out = new char[capacity];
+    memcpy(out, bsp_data, sizeof(BSPHeader));
+    BSPHeader* out_header = (BSPHeader*)out;
+
+    size_t pos = sizeof(BSPHeader);
+    for (int i : order)
+    {
+        const BSPLump& lump = header->lumps[i];
+        const char* lump_data = i == lump_index ? data : bsp_data + lump.offset;
+        size_t lump_length = i == lump_index ? size : (size_t)lump.length;
+
+        while (pos & 3)
+            out[pos++] = 0;
+
+        out_header->lumps[i].offset = lump_length ? (int)pos : 0;
+        out_header->lumps[i].length = (int)lump_length;
+        memcpy(out + pos, lump_data, lump_length);
+        pos += lump_length;
+    }
+
+    while (pos & 3)
+        out[pos++] = 0;
+
+    BSPLump& game_lump = out_header->lumps[LUMP_GAME_LUMP];
+    int delta = game_lump.offset - header->lumps[LUMP_GAME_LUMP].offset;
+    if (delta && game_lump.length >= (int)sizeof(int))
+    {
+        int count = *(int*)(out + game_lump.offset);
+        BSPGameLump* game_lumps = (BSPGameLump*)(out + game_lump.offset + sizeof(int));
+        for (int i = 0; i < count && sizeof(int) + (i + 1) * sizeof(BSPGameLump) <= (size_t)game_lump.length; i++)
+            if (game_lumps[i].offset)
+                game_lumps[i].offset += delta;
+    }
+
+    out_header->lumps[LUMP_PAKFILE].offset = (int)pos;
+    *out_size = pos;
+    return out;
+}
+
+// Copies length bytes at offset of one stream to the current position of another through chunk
+static bool CopyStream(void* from, int64_t offset, int64_t length, void* to, char* chunk, int32_t chunk_size)
+{
+    if (mz_stream_seek(from, offset, MZ_SEEK_SET) != MZ_OK)
+        return false;
+
+    for (int64_t copied = 0; copied < length; )
+    {
+        int32_t len = (int32_t)min((int64_t)chunk_size, length - copied);
+        if (mz_stream_read(from, chunk, len) != len || mz_stream_write(to, chunk, len) != len)
+            return false;
+        copied += len;
+    }
+    return true;
+}
+
+// Streaming counterpart of RelayoutBSP for maps that aren't loaded whole. Writes the header and every lump
+// before the pak file from bsp_stream to out_stream with lump_index replaced by data, copying the rest through
+// chunk. out_header gets the new layout, the header written up front is only a placeholder
+bool RelayoutBSPStream(void* bsp_stream, const BSPHeader& header, int lump_index, const char* data, size_t size,
+    void* out_stream, char* chunk, int32_t chunk_size, BSPHeader* out_header, int64_t* out_size)
+{
+    static const char padding[4] = { 0 };
+
+    std::vector<int> order;
+    for (int i = 0; i < 64; i++)
+        if (i != LUMP_PAKFILE)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return header.lumps[a].offset < header.lumps[b].offset; });
+
+    *out_header = header;
+    if (mz_stream_write(out_stream, &header, sizeof(header)) != sizeof(header))
+        return false;
+
+    int64_t pos = sizeof(BSPHeader);
+    for (int i : order)
+    {
+        const BSPLump& lump = header.lumps[i];
+        size_t lump_length = i == lump_index ? size : (size_t)lump.length;
+
+        int32_t pad = (int32_t)((4 - (pos & 3)) & 3);
+        if (pad && mz_stream_write(out_stream, padding, pad) != pad)
+            return false;
+        pos += pad;
+
+        out_header->lumps[i].offset = lump_length ? (int)pos : 0;
+        out_header->lumps[i].length = (int)lump_length;
+
+        if (i == lump_index)
+        {
+            if (mz_stream_write(out_stream, data, (int32_t)size) != (int32_t)size)
+                return false;
+        }
+        else if (i == LUMP_GAME_LUMP && pos != lump.offset && lump.length >= (int)sizeof(int))
+        {
+            // the game lump directory holds absolute offsets, only it is patched and the rest copied as is
+            int count = 0;
+            if (mz_stream_seek(bsp_stream, lump.offset, MZ_SEEK_SET) != MZ_OK || mz_stream_read(bsp_stream, &count, sizeof(int)) != sizeof(int))
+                return false;
+
+            count = max(min(count, (int)((lump.length - sizeof(int)) / sizeof(BSPGameLump))), 0);
+            std::vector<BSPGameLump> game_lumps(count);
+            int32_t directory_size = (int32_t)(count * sizeof(BSPGameLump));
+            if (count && mz_stream_read(bsp_stream, game_lumps.data(), directory_size) != directory_size)
+                return false;
+
+            int delta = (int)(pos - lump.offset);
+            for (BSPGameLump& game_lump : game_lumps)
+                if (game_lump.offset)
+                    game_lump.offset += delta;
+
+            int32_t head_size = (int32_t)sizeof(int) + directory_size;
+            if (mz_stream_write(out_stream, &count, sizeof(int)) != sizeof(int) ||
+                (count && mz_stream_write(out_stream, game_lumps.data(), directory_size) != directory_size) ||
+                !CopyStream(bsp_stream, lump.offset + head_size, lump.length - head_size, out_stream, chunk, chunk_size))
+                return false;
+        }
+        else if (!CopyStream(bsp_stream, lump.offset, lump.length, out_stream, chunk, chunk_size))
+        {
+            return false;
+        }
+
+        pos += lump_length;
+    }
+
+    int32_t pad = (int32_t)((4 - (pos & 3)) & 3);
+    if (pad && mz_stream_write(out_stream, padding, pad) != pad)
+        return false;
+    pos += pad;
+
+    out_header->lumps[LUMP_PAKFILE].offset = (int)pos;
+    *out_size = pos;
+    return true;
+}
+
+bool CheckEntityLump(const BSPLump& entities, size_t prefix_size)
+{
+    if (*(const int*)entities.fourCC)
+    {
+        ConsolePrintf(RED, "Compressed entity lumps are not supported\n");
+        return false;
+    }
+
+    if (entities.offset < 0 || entities.length < 0 || (size_t)entities.offset + entities.length > prefix_size)
+    {
+        ConsolePrintf(RED, "Entity lump is out of bounds\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Applies the ENTITY operations to the raw entity lump. out_lump points at the serialized lump, owned by
+// the calling thread, or is nullptr if no entity changed
+bool EditEntityLump(const char* data, size_t size, const std::vector<char>** out_lump)
+{
+    *out_lump = nullptr;
+
+    auto start = std::chrono::steady_clock::now();
+
+    EntityLump& lump = g_EntityLump;
+    if (!lump.Parse(data, size))
+    {
+        ConsolePrintf(RED, "Failed to parse entity lump\n");
+        return false;
+    }
+
+    size_t edited = 0;
+    for (OperationBase* operation : g_IniOperations)
+        if (!operation->OperateEntities(lump, &edited))
+            return false;
+
+    if (!edited)
+    {
+        if (g_IniLogOperations)
+            ConsolePrintf(WHITE, "\tNo entities matched\n");
+        return true;
+    }
+
+    static thread_local std::vector<char> serialized;
+    lump.Serialize(serialized);
+    *out_lump = &serialized;
+
+    if (g_IniLogOperations)
+    {
+        long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        ConsolePrintf(WHITE, "\tEdited %llu of %llu entities, lump %llu -> %llu bytes in %lld us\n",
+            (uint64_t)edited, (uint64_t)lump.m_Count, (uint64_t)size, (uint64_t)serialized.size(), elapsed);
+    }
+
+    return true;
+}
+
+// Applies the ENTITY operations to the BSP up to the pak file. Returns a re-laid out copy in out_data
+// with tail_size bytes of room after it, or nullptr if no entity changed
+bool OperateEntities(const char* bsp_data, size_t prefix_size, size_t tail_size, char** out_data, size_t* out_size)
+{
+    *out_data = nullptr;
+
+    const BSPHeader* header = (const BSPHeader*)bsp_data;
+    const BSPLump& entities = header->lumps[LUMP_ENTITIES];
+    if (!CheckEntityLump(entities, prefix_size))
+        return false;
+
+    const std::vector<char>* serialized;
+    if (!EditEntityLump(bsp_data + entities.offset, entities.length, &serialized))
+        return false;
+
+    if (serialized)
+        *out_data = RelayoutBSP(bsp_data, prefix_size, LUMP_ENTITIES, serialized->data(), serialized->size(), tail_size, out_size);
+    return true;
+}
+
+// memory a map will need while operating, reserved from the global budget
+size_t EstimateOperateMemory(const char* bspname, size_t operations_size)
+{
+    if (g_IniStreamPakFile)
+        return (size_t)g_IniStreamMemoryLimit * 1024 * 1024;
+
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, bspname, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        mz_stream_os_delete(&bsp_stream);
+        return 0;
+    }
+
+    size_t size = 0;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) == sizeof(header) && header.ident == IDBSPHEADER)
+    {
+        mz_stream_seek(bsp_stream, 0, MZ_SEEK_END);
+        size_t bsp_size = (size_t)mz_stream_tell(bsp_stream);
+
+        // only the central directory is read here
+        BSPLump& pak_file = header.lumps[40];
+        LumpStream pak_read(bsp_stream, pak_file.offset, pak_file.length);
+        size_t uncompressed_size = 0;
+
+        void* zip_read = mz_zip_create();
+        if (mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK)
+        {
+            for (int32_t err = mz_zip_goto_first_entry(zip_read); err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+            {
+                mz_zip_file* file_info = nullptr;
+                if (mz_zip_entry_get_info(zip_read, &file_info) == MZ_OK)
+                    uncompressed_size += (size_t)file_info->uncompressed_size;
+            }
+            mz_zip_close(zip_read);
+        }
+        mz_zip_delete(&zip_read);
+
+        // bsp + decompressed entries + added files + write stream, which grows in 128mb steps
+        const size_t grow_size = 1024 * 1024 * 128;
+        size_t write_size = (pak_file.length + operations_size + grow_size - 1) / grow_size * grow_size;
+        size = bsp_size + uncompressed_size + operations_size + write_size;
+    }
+
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+    return size;
+}
+
+// size of data as a zip LZMA entry at the given level, including the 9 byte header
+size_t GetLZMACompressedSize(const uint8_t* data, size_t size, int level, std::vector<uint8_t>& out)
+{
+    lzma_options_lzma options;
+    if (lzma_lzma_preset(&options, (uint32_t)min(max(level, 0), 9)))
+        return size;
+
+    lzma_filter filters[2] = { { LZMA_FILTER_LZMA1, &options }, { LZMA_VLI_UNKNOWN, NULL } };
+
+    out.resize(size + size / 2 + 4096);
+    size_t out_pos = 0;
+    if (lzma_raw_buffer_encode(filters, NULL, data, size, out.data(), &out_pos, out.size()) != LZMA_OK)
+        return size + 9;
+    return out_pos + 9;
+}
+
+std::atomic<bool> g_AbortBatch(false);
+
+// Long-lived LZMA coders for the calling thread. Initializing an lzma_stream that is already
+// set up lets liblzma reuse its dictionary and hash tables instead of allocating them again
+struct LZMAContext
+{
+    ~LZMAContext()
+    {
+        lzma_end(&encoder);
+        lzma_end(&decoder);
+    }
+
+    lzma_stream encoder = LZMA_STREAM_INIT;
+    lzma_stream decoder = LZMA_STREAM_INIT;
+    uint8_t encoder_out[64 * 1024];
+    uint8_t decoder_out[256 * 1024];
+};
+
+thread_local LZMAContext g_LZMAContext;
+
+struct PakWriteContext
+{
+    void* zip_write;
+    void* zip_read;
+    time_t the_time;
+    int compression_level;
+    char* chunk;
+    int32_t chunk_size;
+
+    size_t compressed_entries;
+    long long entry_time; // microseconds spent on compressed entries, open through close
+    int64_t pak_offset; // where the pak file starts in the written BSP
+};
+
+// Pads the local header of a stored entry with a zipalign style extra field so its data starts on an
+// AlignStoredFiles boundary of the BSP, where it can be mapped and read in place. The central directory
+// record gets the same field, the game locates entry data from its length. Call right before the entry
+// is opened
+void AlignStoredEntry(PakWriteContext& context, mz_zip_file& write_file_info, size_t size)
+{
+    if (g_IniAlignStoredFiles <= 0 || write_file_info.compression_method != MZ_COMPRESS_METHOD_STORE || !size)
+        return;
+
+    void* zip_handle = nullptr;
+    void* stream = nullptr;
+    mz_zip_writer_get_zip_handle(context.zip_write, &zip_handle);
+    mz_zip_get_stream(zip_handle, &stream);
+
+    // local header and name, then the field's id, size and alignment
+    int64_t alignment = min(g_IniAlignStoredFiles, 32768);
+    int64_t data_offset = context.pak_offset + mz_stream_tell(stream) + 30 + (int64_t)strlen(write_file_info.filename) + 6;
+    uint16_t padding = (uint16_t)((alignment - data_offset % alignment) % alignment);
+
+    static thread_local std::vector<uint8_t> extra;
+    uint16_t field[3] = { 0xd935, (uint16_t)(2 + padding), (uint16_t)alignment };
+    extra.assign(sizeof(field) + padding, 0);
+    memcpy(extra.data(), field, sizeof(field));
+
+    write_file_info.extrafield = extra.data();
+    write_file_info.extrafield_size = (uint16_t)extra.size();
+}
+
+// Writes a single pak entry. LZMA entries go through the thread's LZMAContext rather than
+// minizip, which sets up and tears down a new encoder for every entry
+struct EntryWriter
+{
+    bool Open(PakWriteContext& context, mz_zip_file& write_file_info)
+    {
+        m_ZipWrite = context.zip_write;
+        m_Raw = g_IniReuseLZMAContexts && write_file_info.compression_method == MZ_COMPRESS_METHOD_LZMA;
+        m_Crc = 0;
+        m_Size = 0;
+
+        if (!m_Raw)
+            return mz_zip_writer_entry_open(m_ZipWrite, &write_file_info) == MZ_OK;
+
+        mz_zip_writer_get_zip_handle(m_ZipWrite, &m_ZipHandle);
+
+        lzma_options_lzma options;
+        if (lzma_lzma_preset(&options, (uint32_t)min(max(context.compression_level, 0), 9)))
+            return false;
+
+        lzma_filter filters[2] = { { LZMA_FILTER_LZMA1, &options }, { LZMA_VLI_UNKNOWN, NULL } };
+
+        // zip LZMA header: sdk version, properties size, properties
+        uint8_t header[9] = { LZMA_VERSION_MAJOR, LZMA_VERSION_MINOR, 5, 0 };
+        if (lzma_properties_encode(&filters[0], header + 4) != LZMA_OK)
+            return false;
+
+        if (lzma_raw_encoder(&g_LZMAContext.encoder, filters) != LZMA_OK)
+            return false;
+
+        write_file_info.flag |= MZ_ZIP_FLAG_LZMA_EOS_MARKER;
+        if (mz_zip_entry_write_open(m_ZipHandle, &write_file_info, (int16_t)context.compression_level, 1, NULL) != MZ_OK)
+            return false;
+
+        return mz_zip_entry_write(m_ZipHandle, header, sizeof(header)) == sizeof(header);
+    }
+
+    bool Write(const void* buf, int32_t len)
+    {
+        if (!m_Raw)
+            return mz_zip_writer_entry_write(m_ZipWrite, buf, len) == len;
+
+        m_Crc = mz_crypt_crc32_update(m_Crc, (const uint8_t*)buf, len);
+        m_Size += len;
+        return Encode((const uint8_t*)buf, len, LZMA_RUN);
+    }
+
+    bool Close()
+    {
+        if (!m_Raw)
+            return mz_zip_writer_entry_close(m_ZipWrite) == MZ_OK;
+
+        bool success = Encode(nullptr, 0, LZMA_FINISH);
+        if (mz_zip_entry_close_raw(m_ZipHandle, m_Size, m_Crc) != MZ_OK)
+            success = false;
+        return success;
+    }
+
+    bool Encode(const uint8_t* buf, size_t len, lzma_action action)
+    {
+        lzma_stream& encoder = g_LZMAContext.encoder;
+        encoder.next_in = buf;
+        encoder.avail_in = len;
+
+        while (true)
+        {
+            encoder.next_out = g_LZMAContext.encoder_out;
+            encoder.avail_out = sizeof(g_LZMAContext.encoder_out);
+
+            lzma_ret ret = lzma_code(&encoder, action);
+
+            int32_t out_len = (int32_t)(sizeof(g_LZMAContext.encoder_out) - encoder.avail_out);
+            if (out_len && mz_zip_entry_write(m_ZipHandle, g_LZMAContext.encoder_out, out_len) != out_len)
+                return false;
+
+            if (ret == LZMA_STREAM_END)
+                return true;
+            if (ret != LZMA_OK)
+                return false;
+            if (action == LZMA_RUN && encoder.avail_in == 0)
+                return true;
+        }
+    }
+
+    void* m_ZipWrite;
+    void* m_ZipHandle;
+    bool m_Raw;
+    uint32_t m_Crc;
+    int64_t m_Size;
+};
+
+struct MapJob
+{
+    std::string bspname;
+    PublishedFileId_t id; // 0 for local maps
+    std::string temp_map;
+    bool done;
+    bool skipped; // predicted over MaxMapSize
+};
+
+enum JournalStage
+{
+    STAGE_NONE = 0,
+    STAGE_DOWNLOADED,
+    STAGE_OPERATED,
+    STAGE_UPLOADED,
+};
+
+struct JournalEntry
+{
+    std::string key;
+    JournalStage stage;
+    uint64_t size;
+    uint32_t crc;
+};
+
+// append-only record of how far each map got, so an interrupted batch resumes instead of starting over
+struct Journal
+{
+    bool Open(const char* path, uint64_t config_hash)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_File)
+        {
+            // left open by a failed job of the daemon
+            fclose(m_File);
+            m_File = NULL;
+        }
+        strncpy(m_Path, path, sizeof(m_Path) - 1);
+        m_Entries.clear();
+
+        FILE* file = fopen(path, "r");
+        if (file)
+        {
+            char line[_MAX_PATH + 64];
+            unsigned long long hash = 0;
+            bool valid = fgets(line, sizeof(line), file) && sscanf(line, "MapBatchJournal %llx", &hash) == 1 && hash == config_hash;
+            while (valid && fgets(line, sizeof(line), file))
+            {
+                // a record torn by a crash has no newline and is dropped
+                size_t length = strlen(line);
+                if (line[length - 1] != '\n')
+                    break;
+                line[length - 1] = '\0';
+
+                int stage;
+                unsigned long long size;
+                unsigned int crc;
+                int key_offset = 0;
+                if (sscanf(line, "%d %llu %x %n", &stage, &size, &crc, &key_offset) != 3 || !key_offset)
+                    continue;
+
+                Set(line + key_offset, (JournalStage)stage, size, crc);
+            }
+            fclose(file);
+
+            if (!valid)
+            {
+                ConsolePrintf(YELLOW, "%s changed since the interrupted batch, starting over\n", g_ConfigName);
+                m_Entries.clear();
+            }
+            else if (!m_Entries.empty())
+            {
+                ConsolePrintf(YELLOW, "Resuming interrupted batch with %llu journaled maps\n", (uint64_t)m_Entries.size());
+            }
+        }
+
+        m_File = fopen(path, m_Entries.empty() ? "w" : "a");
+        if (!m_File)
+        {
+            ConsolePrintf(RED, "Failed to open journal %s\n", path);
+            return false;
+        }
+
+        if (m_Entries.empty())
+        {
+            fprintf(m_File, "MapBatchJournal %llx\n", config_hash);
+            Commit();
+        }
+
+        return true;
+    }
+
+    void Record(const std::string& key, JournalStage stage, uint64_t size = 0, uint32_t crc = 0)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Set(key, stage, size, crc);
+        if (!m_File)
+            return;
+
+        fprintf(m_File, "%d %llu %08x %s\n", (int)stage, size, crc, key.c_str());
+        Commit();
+    }
+
+    JournalStage Get(const std::string& key, uint64_t* size = NULL, uint32_t* crc = NULL)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (JournalEntry& entry : m_Entries)
+        {
+            if (entry.key != key)
+                continue;
+
+            if (size)
+                *size = entry.size;
+            if (crc)
+                *crc = entry.crc;
+            return entry.stage;
+        }
+        return STAGE_NONE;
+    }
+
+    // a temp map was patched in place, carry its operated record over to the new contents
+    void ReplaceOutput(uint64_t old_size, uint32_t old_crc, uint64_t size, uint32_t crc)
+    {
+        std::vector<std::string> keys;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            for (JournalEntry& entry : m_Entries)
+                if (entry.stage == STAGE_OPERATED && entry.size == old_size && entry.crc == old_crc)
+                    keys.push_back(entry.key);
+        }
+
+        for (std::string& key : keys)
+            Record(key, STAGE_OPERATED, size, crc);
+    }
+
+    bool HasStage(JournalStage stage)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (JournalEntry& entry : m_Entries)
+            if (entry.stage == stage)
+                return true;
+        return false;
+    }
+
+    // the batch is complete, nothing left to resume
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_File)
+            return;
+
+        fclose(m_File);
+        m_File = NULL;
+        m_Entries.clear();
+        DeleteFile(m_Path);
+    }
+
+    void Set(const std::string& key, JournalStage stage, uint64_t size, uint32_t crc)
+    {
+        for (JournalEntry& entry : m_Entries)
+        {
+            if (entry.key == key)
+            {
+                entry.stage = stage;
+                entry.size = size;
+                entry.crc = crc;
+                return;
+            }
+        }
+
+        m_Entries.push_back({ key, stage, size, crc });
+    }
+
+    // records must survive a power loss, not just a crash of this process
+    void Commit()
+    {
+        fflush(m_File);
+        _commit(_fileno(m_File));
+    }
+
+    std::mutex m_Mutex;
+    std::vector<JournalEntry> m_Entries;
+    FILE* m_File = NULL;
+    char m_Path[_MAX_PATH] = { 0 };
+};
+
+Journal g_Journal;
+
+static std::string GetJournalKey(PublishedFileId_t id, const char* bspname)
+{
+    return id ? std::to_string(id) : std::string(bspname);
+}
+
+static bool HashFile(const char* path, uint64_t* size, uint32_t* crc)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    static thread_local uint8_t chunk[1024 * 1024];
+    *size = 0;
+    *crc = 0;
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        *crc = mz_crypt_crc32_update(*crc, chunk, (int32_t)len);
+        *size += len;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// FNV-1a of the config, any edit to the operations invalidates the journal
+static uint64_t HashConfig()
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    FILE* file = fopen(g_ConfigName, "rb");
+    if (!file)
+        return hash;
+
+    int c;
+    while ((c = fgetc(file)) != EOF)
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+
+    fclose(file);
+    return hash;
+}
+
+const uint32_t DELTA_MAGIC = (('L' << 24) + ('D' << 16) + ('B' << 8) + 'M');
+const uint32_t DELTA_VERSION = 1;
+const uint32_t DELTA_BLOCK_SIZE = 2048;
+
+enum DeltaOp
+{
+    DELTA_END,
+    DELTA_COPY, // uint64 base offset, uint64 length
+    DELTA_DATA, // uint32 length, then the bytes
+};
+
+struct DeltaHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_size;
+    uint32_t base_crc;
+    uint32_t block_size;
+    uint64_t target_size;
+    uint32_t target_crc;
+    uint32_t padding;
+};
+
+// Writes delta ops, joining copies of consecutive base ranges into one
+struct DeltaWriter
+{
+    bool Copy(uint64_t offset, uint64_t length)
+    {
+        if (m_CopyLength && m_CopyOffset + m_CopyLength == offset)
+        {
+            m_CopyLength += length;
+            return true;
+        }
+
+        bool success = FlushCopy();
+        m_CopyOffset = offset;
+        m_CopyLength = length;
+        return success;
+    }
+
+    bool Data(const uint8_t* data, size_t length)
+    {
+        if (!length)
+            return true;
+
+        bool success = FlushCopy();
+        while (success && length > 0)
+        {
+            uint32_t len = (uint32_t)min(length, (size_t)64 * 1024);
+            uint8_t op = DELTA_DATA;
+            success = fwrite(&op, 1, 1, m_File) == 1 && fwrite(&len, sizeof(len), 1, m_File) == 1 && fwrite(data, 1, len, m_File) == len;
+            m_DataBytes += len;
+            data += len;
+            length -= len;
+        }
+        return success;
+    }
+
+    bool FlushCopy()
+    {
+        if (!m_CopyLength)
+            return true;
+
+        uint8_t op = DELTA_COPY;
+        bool success = fwrite(&op, 1, 1, m_File) == 1 && fwrite(&m_CopyOffset, sizeof(m_CopyOffset), 1, m_File) == 1 &&
+            fwrite(&m_CopyLength, sizeof(m_CopyLength), 1, m_File) == 1;
+        m_CopyBytes += m_CopyLength;
+        m_CopyLength = 0;
+        return success;
+    }
+
+    bool End()
+    {
+        uint8_t op = DELTA_END;
+        return FlushCopy() && fwrite(&op, 1, 1, m_File) == 1;
+    }
+
+    FILE* m_File = nullptr;
+    uint64_t m_CopyOffset = 0;
+    uint64_t m_CopyLength = 0;
+    uint64_t m_CopyBytes = 0;
+    uint64_t m_DataBytes = 0;
+};
+
+// rsync style weak checksum that can be rolled forward one byte at a time
+struct RollingChecksum
+{
+    void Init(const uint8_t* data, uint32_t size)
+    {
+        a = b = 0;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            a += data[i];
+            b += (size - i) * data[i];
+        }
+        a &= 0xffff;
+        b &= 0xffff;
+    }
+
+    void Roll(uint8_t out, uint8_t in, uint32_t size)
+    {
+        a = (a - out + in) & 0xffff;
+        b = (b - size * out + a) & 0xffff;
+    }
+
+    uint32_t Get() const
+    {
+        return a | (b << 16);
+    }
+
+    uint32_t a, b;
+};
+
+// Blocks of one base lump by weak checksum, with a bitmap to reject most misses cheaply
+struct DeltaBlockIndex
+{
+    bool Build(FILE* base, uint64_t offset, uint64_t length, uint32_t block_size)
+    {
+        m_Blocks.clear();
+        m_Filter.assign(1 << 16, 0);
+        if (length < block_size)
+            return true;
+
+        std::vector<uint8_t> block(block_size);
+        if (_fseeki64(base, offset, SEEK_SET))
+            return false;
+
+        for (uint64_t position = 0; position + block_size <= length; position += block_size)
+        {
+            if (fread(block.data(), 1, block_size, base) != block_size)
+                return false;
+
+            RollingChecksum checksum;
+            checksum.Init(block.data(), block_size);
+            uint32_t weak = checksum.Get();
+            m_Filter[(weak >> 5) & 0xffff] |= 1u << (weak & 31);
+            m_Blocks.push_back({ weak, mz_crypt_crc32_update(0, block.data(), (int32_t)block_size), offset + position });
+        }
+
+        std::sort(m_Blocks.begin(), m_Blocks.end(), [](const Block& a, const Block& b) { return a.weak < b.weak; });
+        return true;
+    }
+
+    // base offset of a block with these contents, the expected one first so runs stay contiguous
+    bool Find(uint32_t weak, const uint8_t* data, uint32_t block_size, uint64_t expected, uint64_t* offset) const
+    {
+        if (!(m_Filter[(weak >> 5) & 0xffff] & (1u << (weak & 31))))
+            return false;
+
+        auto it = std::lower_bound(m_Blocks.begin(), m_Blocks.end(), weak, [](const Block& block, uint32_t value) { return block.weak < value; });
+        if (it == m_Blocks.end() || it->weak != weak)
+            return false;
+
+        uint32_t crc = mz_crypt_crc32_update(0, data, (int32_t)block_size);
+        bool found = false;
+        for (; it != m_Blocks.end() && it->weak == weak; ++it)
+        {
+            if (it->crc != crc)
+                continue;
+            if (!found || it->offset == expected)
+                *offset = it->offset;
+            found = true;
+            if (it->offset == expected)
+                break;
+        }
+        return found;
+    }
+
+    struct Block
+    {
+        uint32_t weak;
+        uint32_t crc;
+        uint64_t offset;
+    };
+
+    std::vector<Block> m_Blocks;
+    std::vector<uint32_t> m_Filter;
+};
+
+// streams a region of the target through the rolling checksum, emitting copies of matching base blocks
+static bool DiffRegion(FILE* target, uint64_t offset, uint64_t length, const DeltaBlockIndex& index, uint32_t block_size, DeltaWriter& writer)
+{
+    if (_fseeki64(target, offset, SEEK_SET))
+        return false;
+
+    std::vector<uint8_t> buffer(1024 * 1024 + block_size);
+    uint64_t remaining = length;
+    size_t filled = 0;
+    size_t position = 0;
+    size_t literal = 0;
+    uint64_t expected = UINT64_MAX;
+    bool have_checksum = false;
+    RollingChecksum checksum;
+
+    while (true)
+    {
+        if (filled - position < block_size)
+        {
+            if (!remaining)
+                break;
+
+            // flush what can't match anymore and slide the unread tail to the front
+            if (!writer.Data(buffer.data() + literal, position - literal))
+                return false;
+            memmove(buffer.data(), buffer.data() + position, filled - position);
+            filled -= position;
+            position = literal = 0;
+
+            size_t len = (size_t)min((uint64_t)(buffer.size() - filled), remaining);
+            if (fread(buffer.data() + filled, 1, len, target) != len)
+                return false;
+            filled += len;
+            remaining -= len;
+            have_checksum = false;
+            continue;
+        }
+
+        if (!have_checksum)
+        {
+            checksum.Init(buffer.data() + position, block_size);
+            have_checksum = true;
+        }
+
+        uint64_t base_offset;
+        if (!index.m_Blocks.empty() && index.Find(checksum.Get(), buffer.data() + position, block_size, expected, &base_offset))
+        {
+            if (!writer.Data(buffer.data() + literal, position - literal) || !writer.Copy(base_offset, block_size))
+                return false;
+
+            position += block_size;
+            literal = position;
+            expected = base_offset + block_size;
+            have_checksum = false;
+            continue;
+        }
+
+        if (position + block_size < filled)
+            checksum.Roll(buffer[position], buffer[position + block_size], block_size);
+        else
+            have_checksum = false;
+        position++;
+
+        if (position - literal >= 64 * 1024)
+        {
+            if (!writer.Data(buffer.data() + literal, position - literal))
+                return false;
+            literal = position;
+        }
+    }
+
+    return writer.Data(buffer.data() + literal, filled - literal);
+}
+
+// Writes a delta rebuilding target from base. Each lump of the target is matched only against
+// the same lump of the base, so unchanged lumps become one copy and the pak's untouched entries
+// are found even though the rebuild shifted them. Header and padding are stored as data
+static bool WriteDelta(const char* base_path, const char* target_path, const char* delta_path)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    DeltaHeader delta_header = { 0 };
+    delta_header.magic = DELTA_MAGIC;
+    delta_header.version = DELTA_VERSION;
+    delta_header.block_size = DELTA_BLOCK_SIZE;
+    if (!HashFile(base_path, &delta_header.base_size, &delta_header.base_crc) ||
+        !HashFile(target_path, &delta_header.target_size, &delta_header.target_crc))
+    {
+        ConsolePrintf(RED, "Failed to read %s or %s for the delta\n", base_path, target_path);
+        return false;
+    }
+
+    FILE* base = fopen(base_path, "rb");
+    FILE* target = fopen(target_path, "rb");
+    BSPHeader base_header, target_header;
+    bool success = base && target &&
+        fread(&base_header, sizeof(base_header), 1, base) == 1 && base_header.ident == IDBSPHEADER &&
+        fread(&target_header, sizeof(target_header), 1, target) == 1 && target_header.ident == IDBSPHEADER;
+
+    char temp_path[_MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", delta_path);
+
+    DeltaWriter writer;
+    if (success)
+    {
+        writer.m_File = fopen(temp_path, "wb");
+        success = writer.m_File && fwrite(&delta_header, sizeof(delta_header), 1, writer.m_File) == 1;
+    }
+
+    // lumps in file order, anything between them is written as data
+    std::vector<int> order;
+    for (int i = 0; i < 64; i++)
+        if (target_header.lumps[i].length > 0)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return target_header.lumps[a].offset < target_header.lumps[b].offset; });
+
+    std::vector<uint8_t> gap;
+    DeltaBlockIndex index;
+    uint64_t cursor = 0;
+    for (size_t i = 0; success && i <= order.size(); i++)
+    {
+        uint64_t lump_offset = i < order.size() ? (uint64_t)target_header.lumps[order[i]].offset : delta_header.target_size;
+        uint64_t lump_end = i < order.size() ? lump_offset + target_header.lumps[order[i]].length : delta_header.target_size;
+        lump_end = min(lump_end, delta_header.target_size);
+
+        if (lump_offset > cursor)
+        {
+            gap.resize((size_t)(lump_offset - cursor));
+            success = _fseeki64(target, cursor, SEEK_SET) == 0 && fread(gap.data(), 1, gap.size(), target) == gap.size() &&
+                writer.Data(gap.data(), gap.size());
+            cursor = lump_offset;
+        }
+
+        if (!success || i == order.size() || lump_end <= cursor)
+            continue;
+
+        BSPLump& base_lump = base_header.lumps[order[i]];
+        uint64_t base_length = min((uint64_t)base_lump.length, delta_header.base_size - min((uint64_t)base_lump.offset, delta_header.base_size));
+        success = index.Build(base, base_lump.offset, base_length, DELTA_BLOCK_SIZE) &&
+            DiffRegion(target, cursor, lump_end - cursor, index, DELTA_BLOCK_SIZE, writer);
+        cursor = lump_end;
+    }
+
+    if (writer.m_File)
+    {
+        success = success && writer.End();
+        if (fclose(writer.m_File))
+            success = false;
+    }
+    if (base)
+        fclose(base);
+    if (target)
+        fclose(target);
+
+    if (success)
+        success = MoveFileEx(temp_path, delta_path, MOVEFILE_REPLACE_EXISTING) != 0;
+    else
+        DeleteFile(temp_path);
+
+    if (!success)
+    {
+        ConsolePrintf(RED, "Failed to write delta %s\n", delta_path);
+        return false;
+    }
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(WHITE, "Wrote delta %s: %llu KB of data, %llu MB copied from the original (%lld ms)\n",
+        delta_path, writer.m_DataBytes / 1024, writer.m_CopyBytes / (1024 * 1024), elapsed);
+    return true;
+}
+
+// rebuilds a patched BSP from the original and a delta written by WriteDelta
+static int RunApplyDelta(const char* base_path, const char* delta_path, const char* output_path)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    FILE* delta = fopen(delta_path, "rb");
+    if (!delta)
+    {
+        ConsolePrintf(RED, "Failed to open delta %s\n", delta_path);
+        return 1;
+    }
+
+    DeltaHeader header;
+    if (fread(&header, sizeof(header), 1, delta) != 1 || header.magic != DELTA_MAGIC || header.version != DELTA_VERSION)
+    {
+        ConsolePrintf(RED, "%s is not a map delta\n", delta_path);
+        fclose(delta);
+        return 1;
+    }
+
+    uint64_t base_size;
+    uint32_t base_crc;
+    if (!HashFile(base_path, &base_size, &base_crc) || base_size != header.base_size || base_crc != header.base_crc)
+    {
+        ConsolePrintf(RED, "%s is not the map this delta was made from\n", base_path);
+        fclose(delta);
+        return 1;
+    }
+
+    char temp_path[_MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", output_path);
+
+    FILE* base = fopen(base_path, "rb");
+    FILE* output = fopen(temp_path, "wb");
+    bool success = base && output;
+
+    static uint8_t chunk[1024 * 1024];
+    uint64_t size = 0;
+    uint32_t crc = 0;
+    while (success)
+    {
+        uint8_t op;
+        if (fread(&op, 1, 1, delta) != 1)
+        {
+            success = false;
+            break;
+        }
+
+        if (op == DELTA_END)
+            break;
+
+        if (op == DELTA_COPY)
+        {
+            uint64_t offset, length;
+            success = fread(&offset, sizeof(offset), 1, delta) == 1 && fread(&length, sizeof(length), 1, delta) == 1 &&
+                _fseeki64(base, offset, SEEK_SET) == 0;
+            while (success && length > 0)
+            {
+                size_t len = (size_t)min(length, (uint64_t)sizeof(chunk));
+                success = fread(chunk, 1, len, base) == len && fwrite(chunk, 1, len, output) == len;
+                crc = mz_crypt_crc32_update(crc, chunk, (int32_t)len);
+                size += len;
+                length -= len;
+            }
+        }
+        else if (op == DELTA_DATA)
+        {
+            uint32_t len;
+            success = fread(&len, sizeof(len), 1, delta) == 1 && len <= sizeof(chunk) &&
+                fread(chunk, 1, len, delta) == len && fwrite(chunk, 1, len, output) == len;
+            crc = mz_crypt_crc32_update(crc, chunk, (int32_t)len);
+            size += len;
+        }
+        else
+        {
+            success = false;
+        }
+    }
+
+    fclose(delta);
+    if (base)
+        fclose(base);
+    if (output && fclose(output))
+        success = false;
+
+    if (success && (size != header.target_size || crc != header.target_crc))
+    {
+        ConsolePrintf(RED, "Rebuilt map doesn't match the delta's checksum\n");
+        success = false;
+    }
+
+    if (success)
+        success = MoveFileEx(temp_path, output_path, MOVEFILE_REPLACE_EXISTING) != 0;
+
+    if (!success)
+    {
+        DeleteFile(temp_path);
+        ConsolePrintf(RED, "Failed to apply %s to %s\n", delta_path, base_path);
+        return 1;
+    }
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(GREEN, "Wrote %s (%llu MB) in %lld ms\n", output_path, size / (1024 * 1024), elapsed);
+    return 0;
+}
+
+struct UGCWrapper
+{
+    UGCWrapper() : m_DownloadCallback(NULL, NULL) {}
+
+    void CallbackQuery(SteamUGCQueryCompleted_t* result, bool error)
+    {
+        if (error || result->m_eResult != k_EResultOK)
+        {
+            ConsolePrintf(RED, "Failed to query Steam Workshop maps, result: %d\n", result->m_eResult);
+            m_Done = m_Error = true;
+            g_SteamUGC->ReleaseQueryUGCRequest(m_QueryHandle);
+            return;
+        }
+
+        uint32 results = result->m_unNumResultsReturned;
+        for (uint32_t i = 0; i < results; i++)
+        {
+            SteamUGCDetails_t details = {};
+            g_SteamUGC->GetQueryUGCResult(result->m_handle, i, &details);
+            m_Files.push_back(details);
+        }
+            
+        uint32 total_results = result->m_unTotalMatchingResults;
+        g_SteamUGC->ReleaseQueryUGCRequest(m_QueryHandle);
+
+        if (results == 0 || m_Files.size() >= total_results)
+            m_Done = true;
+        else
+            Enumerate(++m_Page);
+    }
+
+    void Enumerate(uint32_t page)
+    {
+        m_QueryHandle = g_SteamUGC->CreateQueryUserUGCRequest(g_UserAccountID,
+            k_EUserUGCList_Published,
+            k_EUGCMatchingUGCType_Items,
+            k_EUserUGCListSortOrder_CreationOrderDesc,
+            g_AppID, g_AppID, page);
+
+        if (m_QueryHandle == k_UGCQueryHandleInvalid)
+        {
+            ConsolePrintf(RED, "Failed to fetch Steam Workshop maps\n");
+            m_Done = m_Error = true;
+            return;
+        }
+
+        m_Call = g_SteamUGC->SendQueryUGCRequest(m_QueryHandle);
+        if (m_Call == k_uAPICallInvalid)
+        {
+            ConsolePrintf(RED, "Failed to send Steam Workshop query\n");
+            m_Done = m_Error = true;
+            return;
+        }
+
+        m_QueryCallback.Set(m_Call, this, &UGCWrapper::CallbackQuery);
+    }
+
+    void EnumerateAll()
+    {
+        m_Done = false;
+        m_Page = 1;
+        Enumerate(m_Page);
+    }
+
+    void DownloadQuery(DownloadItemResult_t* result)
+    {
+        if (result->m_unAppID != g_AppID || result->m_nPublishedFileId != m_DownloadID)
+            return;
+
+        if (result->m_eResult > k_EResultOK)
+        {
+            ConsolePrintf(RED, "Download failed, result: %d         \n", result->m_eResult);
+            ConsolePrintf(RED, "Check internet connection and ensure BSP is not open in any tool\n");
+            m_Error = true;
+        }
+        else
+        {
+            ConsolePrintf(GREEN, "Download successful!                                    \n");
+            g_Journal.Record(GetJournalKey(m_DownloadID, NULL), STAGE_DOWNLOADED);
+        }
+
+        m_Downloaded++;
+        DownloadNext();
+    }
+
+    // skips maps an interrupted batch already got further with
+    void DownloadNext()
+    {
+        for (; m_Downloaded < m_Files.size(); m_Downloaded++)
+        {
+            PublishedFileId_t id = m_Files[m_Downloaded].m_nPublishedFileId;
+            if (g_Journal.Get(GetJournalKey(id, NULL)) >= STAGE_DOWNLOADED)
+            {
+                ConsolePrintf(WHITE, "Map %llu already downloaded\n", id);
+                continue;
+            }
+
+            DownloadFile(id);
+            return;
+        }
+
+        m_Done = true;
+    }
+
+    void DownloadFile(PublishedFileId_t id)
+    {
+        ConsolePrintf(WHITE, "Downloading map %llu...\n", id);
+        m_DownloadID = id;
+        g_SteamUGC->DownloadItem(id, true);
+    }
+
+    void DownloadAll()
+    {
+        m_Done = false;
+        m_DownloadCallback.Register(this, &UGCWrapper::DownloadQuery);
+        m_Downloaded = 0;
+        DownloadNext();
+    }
+
+    static void GetTempMapPath(const char* bspname, char* temp_map)
+    {
+        const char* temp_filename = strrchr(bspname, '/');
+        if (temp_filename)
+            temp_filename += 1;
+        else
+            temp_filename = bspname;
+
+        strcpy(temp_map, g_MapTempPath);
+        strcat(temp_map, temp_filename);
+    }
+
+    // untouched entries keep their compressed bytes unless the compression method changes
+    bool CanCopyRawEntry(const ZipFile& zip_file)
+    {
+        if (zip_file.source_entry < 0 || g_IniRecompressPakFile)
+            return false;
+        return zip_file.source_compression_method == (g_IniCompressPakFile ? MZ_COMPRESS_METHOD_LZMA : MZ_COMPRESS_METHOD_STORE);
+    }
+
+    bool CopyRawEntry(PakWriteContext& context, ZipFile& zip_file)
+    {
+        void* zip_read = context.zip_read;
+        void* zip_write_handle = nullptr;
+        mz_zip_writer_get_zip_handle(context.zip_write, &zip_write_handle);
+
+        mz_zip_file* file_info = nullptr;
+        if (mz_zip_goto_entry(zip_read, zip_file.source_entry) != MZ_OK ||
+            mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK)
+        {
+            ConsolePrintf(RED, "Failed to locate pak entry %s\n", zip_file.filename);
+            return false;
+        }
+
+        mz_zip_file write_file_info;
+        InitWriteFileInfo(write_file_info, zip_file, file_info->modified_date);
+        write_file_info.compression_method = file_info->compression_method;
+        write_file_info.flag |= file_info->flag & MZ_ZIP_FLAG_LZMA_EOS_MARKER;
+        write_file_info.crc = file_info->crc;
+        write_file_info.compressed_size = file_info->compressed_size;
+        write_file_info.uncompressed_size = file_info->uncompressed_size;
+        AlignStoredEntry(context, write_file_info, (size_t)file_info->uncompressed_size);
+
+        bool success = mz_zip_entry_read_open(zip_read, 1, NULL) == MZ_OK &&
+            mz_zip_entry_write_open(zip_write_handle, &write_file_info, MZ_COMPRESS_LEVEL_DEFAULT, 1, NULL) == MZ_OK;
+
+        while (success)
+        {
+            int32_t len = mz_zip_entry_read(zip_read, context.chunk, context.chunk_size);
+            if (len <= 0)
+            {
+                success = len == 0;
+                break;
+            }
+            success = mz_zip_entry_write(zip_write_handle, context.chunk, len) == len;
+        }
+
+        mz_zip_entry_close(zip_read);
+        if (mz_zip_entry_close_raw(zip_write_handle, write_file_info.uncompressed_size, write_file_info.crc) != MZ_OK)
+            success = false;
+
+        if (!success)
+            ConsolePrintf(RED, "Failed to copy pak entry %s\n", zip_file.filename);
+        return success;
+    }
+
+    // decodes an LZMA source entry with the thread's long-lived decoder
+    template <typename Sink>
+    bool ReadLZMAEntry(void* zip_read, char* chunk, int32_t chunk_size, ZipFile& zip_file, Sink&& sink)
+    {
+        if (mz_zip_goto_entry(zip_read, zip_file.source_entry) != MZ_OK ||
+            mz_zip_entry_read_open(zip_read, 1, NULL) != MZ_OK)
+            return false;
+
+        uint8_t header[4];
+        uint8_t properties[16];
+        bool success = mz_zip_entry_read(zip_read, header, sizeof(header)) == sizeof(header);
+
+        uint16_t properties_size = header[2] | (header[3] << 8);
+        success = success && properties_size <= sizeof(properties) &&
+            mz_zip_entry_read(zip_read, properties, properties_size) == properties_size;
+
+        lzma_stream& decoder = g_LZMAContext.decoder;
+        if (success)
+        {
+            lzma_filter filters[2] = { { LZMA_FILTER_LZMA1, NULL }, { LZMA_VLI_UNKNOWN, NULL } };
+            success = lzma_properties_decode(&filters[0], NULL, properties, properties_size) == LZMA_OK &&
+                lzma_raw_decoder(&decoder, filters) == LZMA_OK;
+            free(filters[0].options);
+        }
+
+        size_t remaining = zip_file.size;
+        bool stream_end = false;
+        while (success && remaining > 0 && !stream_end)
+        {
+            int32_t len = mz_zip_entry_read(zip_read, chunk, chunk_size);
+            if (len < 0)
+            {
+                success = false;
+                break;
+            }
+
+            decoder.next_in = (const uint8_t*)chunk;
+            decoder.avail_in = len;
+
+            do
+            {
+                decoder.next_out = g_LZMAContext.decoder_out;
+                decoder.avail_out = sizeof(g_LZMAContext.decoder_out);
+
+                lzma_ret ret = lzma_code(&decoder, len ? LZMA_RUN : LZMA_FINISH);
+                stream_end = ret == LZMA_STREAM_END;
+                if (ret != LZMA_OK && !stream_end)
+                {
+                    success = false;
+                    break;
+                }
+
+                size_t out_len = min(sizeof(g_LZMAContext.decoder_out) - decoder.avail_out, remaining);
+                if (out_len && !sink(g_LZMAContext.decoder_out, (int32_t)out_len))
+                {
+                    success = false;
+                    break;
+                }
+                remaining -= out_len;
+
+                // out of input without any progress means the stream is truncated
+                if (!len && !out_len && !stream_end)
+                    success = false;
+            }
+            while (success && !stream_end && remaining > 0 && (decoder.avail_in > 0 || decoder.avail_out == 0));
+        }
+
+        mz_zip_entry_close(zip_read);
+        return success && remaining == 0;
+    }
+
+    template <typename Sink>
+    bool ReadEntry(void* zip_read, char* chunk, int32_t chunk_size, ZipFile& zip_file, Sink&& sink)
+    {
+        bool success = mz_zip_goto_entry(zip_read, zip_file.source_entry) == MZ_OK &&
+            mz_zip_entry_read_open(zip_read, 0, NULL) == MZ_OK;
+
+        while (success)
+        {
+            int32_t len = mz_zip_entry_read(zip_read, chunk, chunk_size);
+            if (len <= 0)
+            {
+                success = len == 0;
+                break;
+            }
+            success = sink(chunk, len);
+        }
+
+        mz_zip_entry_close(zip_read);
+        return success;
+    }
+
+    // inflates the source entries that will be recompressed ahead of writing, each thread
+    // with its own reader over the shared pak buffer and on its own range of entries
+    bool DecompressEntries(ZipFileList& file_list, char* zip_buf, int zip_len)
+    {
+        std::vector<size_t> indices;
+        for (size_t i = 0; i < file_list.size(); i++)
+        {
+            ZipFile& zip_file = file_list[i];
+            if (zip_file.source_entry >= 0 && !zip_file.buffer && !CanCopyRawEntry(zip_file))
+                indices.push_back(i);
+        }
+
+        size_t thread_count = (size_t)g_IniDecompressThreads;
+        if (!thread_count)
+            thread_count = max((size_t)std::thread::hardware_concurrency() / (size_t)max(g_IniOperateThreads, 1), (size_t)1);
+        thread_count = min(thread_count, indices.size());
+
+        // not worth it, WriteEntry inflates them one at a time
+        if (thread_count <= 1)
+            return true;
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::atomic<size_t> next_entry(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]()
+        {
+            void* stream_mem = mz_stream_mem_create();
+            mz_stream_mem_set_buffer(stream_mem, zip_buf, zip_len);
+            void* zip_read = mz_zip_create();
+            if (mz_zip_open(zip_read, stream_mem, MZ_OPEN_MODE_READ) != MZ_OK)
+                failed = true;
+
+            const int32_t chunk_size = 256 * 1024;
+            char* chunk = new char[chunk_size];
+
+            size_t i;
+            while (!failed && (i = next_entry++) < indices.size())
+            {
+                ZipFile& zip_file = file_list[indices[i]];
+                char* buffer = new char[zip_file.size];
+                size_t written = 0;
+                auto sink = [&](const void* buf, int32_t len)
+                {
+                    if (written + len > zip_file.size)
+                        return false;
+                    memcpy(buffer + written, buf, len);
+                    written += len;
+                    return true;
+                };
+
+                bool success;
+                if (g_IniReuseLZMAContexts && zip_file.source_compression_method == MZ_COMPRESS_METHOD_LZMA)
+                    success = ReadLZMAEntry(zip_read, chunk, chunk_size, zip_file, sink);
+                else
+                    success = ReadEntry(zip_read, chunk, chunk_size, zip_file, sink);
+
+                if (!success || written != zip_file.size)
+                {
+                    ConsolePrintf(RED, "Failed to decompress pak entry %s\n", zip_file.filename);
+                    delete[] buffer;
+                    failed = true;
+                    break;
+                }
+
+                zip_file.buffer = buffer;
+            }
+
+            delete[] chunk;
+            mz_zip_close(zip_read);
+            mz_zip_delete(&zip_read);
+            mz_stream_mem_delete(&stream_mem);
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        if (g_IniLogOperations)
+        {
+            long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            ConsolePrintf(WHITE, "Decompressed %llu entries with %llu threads in %lld ms\n", (uint64_t)indices.size(), (uint64_t)thread_count, elapsed);
+        }
+
+        return !failed;
+    }
+
+    bool WriteEntry(PakWriteContext& context, ZipFile& zip_file)
+    {
+        if (CanCopyRawEntry(zip_file))
+            return CopyRawEntry(context, zip_file);
+
+        mz_zip_file write_file_info;
+        InitWriteFileInfo(write_file_info, zip_file, context.the_time);
+        AlignStoredEntry(context, write_file_info, zip_file.size);
+
+        auto start = std::chrono::steady_clock::now();
+
+        EntryWriter writer;
+        if (!writer.Open(context, write_file_info))
+        {
+            ConsolePrintf(RED, "Failed to open pak entry %s for writing\n", zip_file.filename);
+            return false;
+        }
+
+        char* chunk = context.chunk;
+        int32_t chunk_size = context.chunk_size;
+        void* zip_read = context.zip_read;
+
+        bool success = true;
+        if (zip_file.buffer && zip_file.mapped)
+        {
+            // in blocks so the view is paged in as the compressor gets to it
+            for (size_t offset = 0; success && offset < zip_file.size; offset += chunk_size)
+                success = writer.Write(zip_file.buffer + offset, (int32_t)min((size_t)chunk_size, zip_file.size - offset));
+        }
+        else if (zip_file.buffer)
+        {
+            success = writer.Write(zip_file.buffer, (int32_t)zip_file.size);
+        }
+        else if (zip_file.source_path)
+        {
+            FILE* file = fopen(zip_file.source_path, "rb");
+            if (file)
+            {
+                size_t len;
+                while (success && (len = fread(chunk, 1, chunk_size, file)) > 0)
+                    success = writer.Write(chunk, (int32_t)len);
+                fclose(file);
+            }
+            else
+            {
+                success = false;
+            }
+        }
+        else
+        {
+            auto sink = [&](const void* buf, int32_t len) { return writer.Write(buf, len); };
+            if (g_IniReuseLZMAContexts && zip_file.source_compression_method == MZ_COMPRESS_METHOD_LZMA)
+                success = ReadLZMAEntry(zip_read, chunk, chunk_size, zip_file, sink);
+            else
+                success = ReadEntry(zip_read, chunk, chunk_size, zip_file, sink);
+        }
+
+        if (!writer.Close())
+            success = false;
+
+        // minizip frees its encoder when the entry is closed, so the close is part of the per entry cost
+        if (write_file_info.compression_method != MZ_COMPRESS_METHOD_STORE)
+        {
+            context.compressed_entries++;
+            context.entry_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        if (!success)
+            ConsolePrintf(RED, "Failed to stream pak entry %s\n", zip_file.filename);
+        return success;
+    }
+
+    // copies len bytes at offset of an entry's contents, decoding source entries only as far as needed
+    bool ReadEntryBlock(ZipFile& zip_file, void* zip_read, size_t offset, size_t len, std::vector<char>& block)
+    {
+        block.resize(len);
+        if (zip_file.buffer)
+        {
+            memcpy(block.data(), zip_file.buffer + offset, len);
+            return true;
+        }
+
+        if (zip_file.source_path)
+        {
+            FILE* file = fopen(zip_file.source_path, "rb");
+            if (!file)
+                return false;
+            bool success = _fseeki64(file, offset, SEEK_SET) == 0 && fread(block.data(), 1, len, file) == len;
+            fclose(file);
+            return success;
+        }
+
+        size_t position = 0;
+        size_t copied = 0;
+        auto sink = [&](const void* buf, int32_t buf_len)
+        {
+            const char* data = (const char*)buf;
+            size_t end = position + buf_len;
+            if (end > offset)
+            {
+                size_t start = max(position, offset);
+                size_t count = min(end, offset + len) - start;
+                memcpy(block.data() + copied, data + (start - position), count);
+                copied += count;
+            }
+            position = end;
+            return copied < len;
+        };
+
+        std::vector<char> chunk(64 * 1024);
+        if (g_IniReuseLZMAContexts && zip_file.source_compression_method == MZ_COMPRESS_METHOD_LZMA)
+            ReadLZMAEntry(zip_read, chunk.data(), (int32_t)chunk.size(), zip_file, sink);
+        else
+            ReadEntry(zip_read, chunk.data(), (int32_t)chunk.size(), zip_file, sink);
+        return copied == len;
+    }
+
+    // Predicts the size of the written pak. Raw copies and stored entries are exact, the rest is a
+    // byte-weighted sample of 64 KB blocks compressed at the configured level. Blocks don't see the
+    // rest of their file, so the ratio errs on the large side. The margin is a 95% interval from the
+    // spread of the block ratios
+    void EstimatePakSize(ZipFileList& file_list, void* zip_read, double* predicted, double* margin)
+    {
+        // end of central directory, then local header, data descriptor and central directory record per entry
+        double exact = 22;
+        uint64_t compress_total = 0;
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < file_list.size(); i++)
+        {
+            ZipFile& zip_file = file_list[i];
+            exact += 30 + 16 + 46 + 2.0 * strlen(zip_file.filename);
+
+            if (CanCopyRawEntry(zip_file))
+                exact += zip_file.source_compressed_size;
+            else if (!g_IniCompressPakFile)
+                exact += zip_file.size;
+            else if (zip_file.size)
+            {
+                compress_total += zip_file.size;
+                pending.push_back(i);
+            }
+
+            // stored entries are padded by half the alignment on average, in both headers
+            if (!g_IniCompressPakFile && g_IniAlignStoredFiles > 0 && zip_file.size)
+                exact += g_IniAlignStoredFiles;
+        }
+
+        *predicted = exact + compress_total;
+        *margin = 0.0;
+        if (!compress_total)
+            return;
+
+        const size_t block_size = 64 * 1024;
+        uint64_t step = max(compress_total / (uint64_t)max(g_IniEstimateBlocks, 1), (uint64_t)1);
+        uint64_t next_pick = step / 2;
+        uint64_t position = 0;
+
+        std::vector<char> block;
+        std::vector<uint8_t> out;
+        std::vector<double> ratios;
+        double sampled_in = 0.0;
+        double sampled_out = 0.0;
+        for (size_t index : pending)
+        {
+            ZipFile& zip_file = file_list[index];
+            uint64_t entry_start = position;
+            position += zip_file.size;
+
+            while (next_pick < position)
+            {
+                size_t offset = (size_t)(next_pick - entry_start);
+                next_pick += step;
+
+                size_t start = offset - min(offset, block_size / 2);
+                size_t len = min(block_size, zip_file.size - start);
+                if (!ReadEntryBlock(zip_file, zip_read, start, len, block))
+                    continue;
+
+                size_t compressed = GetLZMACompressedSize((const uint8_t*)block.data(), len, g_IniCompressionLevel, out);
+                ratios.push_back((double)compressed / len);
+                sampled_in += len;
+                sampled_out += compressed;
+            }
+        }
+
+        if (ratios.empty())
+            return;
+
+        double mean = 0.0;
+        for (double ratio : ratios)
+            mean += ratio;
+        mean /= ratios.size();
+
+        double variance = 0.0;
+        for (double ratio : ratios)
+            variance += (ratio - mean) * (ratio - mean);
+        variance /= max(ratios.size() - 1, (size_t)1);
+
+        *predicted = exact + sampled_out / sampled_in * compress_total;
+        *margin = 1.96 * sqrt(variance / ratios.size()) * compress_total;
+    }
+
+    // stops before compressing a map whose prediction is already over MaxMapSize
+    bool CheckMapSize(const char* bspname, ZipFileList& file_list, void* zip_read, size_t prefix_size, bool* skipped)
+    {
+        if (g_IniMaxMapSize <= 0 || !g_IniWritePakFile)
+            return true;
+
+        auto start = std::chrono::steady_clock::now();
+
+        double predicted, margin;
+        EstimatePakSize(file_list, zip_read, &predicted, &margin);
+        predicted += prefix_size;
+
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        const double mb = 1024.0 * 1024.0;
+        ConsolePrintf(WHITE, "Predicted size %.1f MB +- %.1f MB (estimated in %lld ms)\n", predicted / mb, margin / mb, elapsed);
+
+        if (predicted <= g_IniMaxMapSize * mb)
+            return true;
+
+        if (g_IniMaxMapSizeAbort)
+        {
+            ConsolePrintf(RED, "%s is predicted to exceed MaxMapSize of %d MB, aborting the batch\n", bspname, g_IniMaxMapSize);
+            g_AbortBatch = true;
+        }
+        else
+        {
+            ConsolePrintf(YELLOW, "%s is predicted to exceed MaxMapSize of %d MB, skipping it\n", bspname, g_IniMaxMapSize);
+            *skipped = true;
+        }
+        return false;
+    }
+
+    void PrintWriteStats(PakWriteContext& context)
+    {
+        if (!g_IniLogOperations || !context.compressed_entries)
+            return;
+
+        ConsolePrintf(WHITE, "Compressed %llu entries, average %.1f us per entry\n",
+            (uint64_t)context.compressed_entries, context.entry_time / (double)context.compressed_entries);
+    }
+
+    // reads, operates on and compresses one entry at a time straight into the temporary BSP
+    bool OperateStreamed(const char* bspname, char* temp_map, bool* skipped)
+    {
+        size_t memory_limit = (size_t)g_IniStreamMemoryLimit * 1024 * 1024;
+        int32_t chunk_size = (int32_t)min(max(memory_limit / 16, (size_t)64 * 1024), (size_t)16 * 1024 * 1024);
+
+        int compression_level = min(max(g_IniCompressionLevel, 0), 9);
+        if (g_IniWritePakFile && g_IniCompressPakFile)
+        {
+            while (compression_level > 0 && (size_t)g_LZMAEncoderMemory[compression_level] * 1024 * 1024 + chunk_size > memory_limit)
+                compression_level--;
+
+            if (compression_level != g_IniCompressionLevel)
+                ConsolePrintf(YELLOW, "Lowering compression level to %d to fit StreamMemoryLimit of %d MB\n", compression_level, g_IniStreamMemoryLimit);
+        }
+
+        void* bsp_stream = mz_stream_os_create();
+        if (mz_stream_open(bsp_stream, bspname, MZ_OPEN_MODE_READ) != MZ_OK)
+        {
+            ConsolePrintf(RED, "Failed to open %s\n", bspname);
+            mz_stream_os_delete(&bsp_stream);
+            return false;
+        }
+
+        BSPHeader header;
+        if (mz_stream_read(bsp_stream, &header, sizeof(header)) != sizeof(header) || header.ident != IDBSPHEADER)
+        {
+            ConsolePrintf(RED, "File %s is not a valid BSP!\n", bspname);
+            mz_stream_close(bsp_stream);
+            mz_stream_os_delete(&bsp_stream);
+            return false;
+        }
+
+        mz_stream_seek(bsp_stream, 0, MZ_SEEK_END);
+        int64_t bsp_size = mz_stream_tell(bsp_stream);
+
+        BSPLump& pak_file = header.lumps[40];
+        LumpStream pak_read(bsp_stream, pak_file.offset, pak_file.length);
+
+        void* zip_read = mz_zip_create();
+        bool success = mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK;
+        if (!success)
+            ConsolePrintf(RED, "Failed to open pak file of %s\n", bspname);
+
+        ConsolePrintf(WHITE, "Reading pak file directory...\n");
+        ZipFileList file_list;
+
+        for (int32_t err = success ? mz_zip_goto_first_entry(zip_read) : MZ_END_OF_LIST; err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+        {
+            mz_zip_file* file_info = nullptr;
+            mz_zip_entry_get_info(zip_read, &file_info);
+
+            if (g_IniPrintPakFile)
+                ConsolePrintf(WHITE, "\tsize: %u\t\t%s\n", file_info->uncompressed_size, file_info->filename);
+
+            file_list.emplace_back();
+            file_list.back().InitFromEntry(file_info, mz_zip_get_entry(zip_read));
+        }
+
+        if (success)
+            success = OperateZip(file_list);
+
+        if (success && g_IniWritePakFile && g_IniOrderPakFile)
+            OrderPakEntries(file_list);
+
+        if (success)
+            success = CheckMapSize(bspname, file_list, zip_read, (size_t)(bsp_size - pak_file.length), skipped);
+
+        void* temp_stream = nullptr;
+        if (success)
+        {
+            GetTempMapPath(bspname, temp_map);
+            ConsolePrintf(WHITE, "Streaming temporary BSP to %s\n", temp_map);
+
+            temp_stream = mz_stream_os_create();
+            if (mz_stream_open(temp_stream, temp_map, MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE) != MZ_OK)
+            {
+                ConsolePrintf(RED, "Failed to open temporary BSP for writing\n");
+                success = false;
+            }
+        }
+
+        // bytes this map holds itself, the process wide figures also cover Steam, other maps and threads
+        size_t allocated = 0;
+        size_t peak_allocated = 0;
+        auto track = [&](int64_t bytes)
+        {
+            allocated += (size_t)bytes;
+            peak_allocated = max(peak_allocated, allocated);
+        };
+
+        char* chunk = new char[chunk_size];
+        track(chunk_size);
+
+        // everything except the pak file is copied as is, the header is patched once the new pak size is known
+        int64_t prefix_size = bsp_size - pak_file.length;
+        int64_t source_pak_offset = pak_file.offset;
+        bool relaid = false;
+        if (success && HasEntityOperations())
+        {
+            // entity edits can move every lump, only the entity lump is loaded and the others are streamed to their new offsets
+            const BSPLump& entities = header.lumps[LUMP_ENTITIES];
+            success = CheckEntityLump(entities, (size_t)prefix_size);
+
+            char* entity_data = success ? new char[entities.length] : nullptr;
+            const std::vector<char>* serialized = nullptr;
+            if (success)
+            {
+                track(entities.length);
+                success = mz_stream_seek(bsp_stream, entities.offset, MZ_SEEK_SET) == MZ_OK &&
+                    mz_stream_read(bsp_stream, entity_data, entities.length) == entities.length &&
+                    EditEntityLump(entity_data, entities.length, &serialized);
+            }
+
+            if (success && serialized)
+            {
+                track(serialized->size());
+                BSPHeader relaid_header;
+                success = RelayoutBSPStream(bsp_stream, header, LUMP_ENTITIES, serialized->data(), serialized->size(),
+                    temp_stream, chunk, chunk_size, &relaid_header, &prefix_size);
+                if (!success)
+                    ConsolePrintf(RED, "Failed to write temporary BSP\n");
+
+                header = relaid_header;
+                relaid = true;
+                track(-(int64_t)serialized->size());
+            }
+
+            if (entity_data)
+            {
+                delete[] entity_data;
+                track(-entities.length);
+            }
+        }
+
+        if (success && !relaid)
+            success = CopyStream(bsp_stream, 0, prefix_size, temp_stream, chunk, chunk_size);
+
+        if (success && g_IniWritePakFile)
+        {
+            if (g_IniCompressPakFile)
+                ConsolePrintf(WHITE, "Compressing files. This will take a while!\n");
+            else
+                ConsolePrintf(WHITE, "Writing pak file...\n");
+
+            LumpStream pak_write(temp_stream, prefix_size, -1);
+            void* zip_write = mz_zip_writer_create();
+            mz_zip_writer_open(zip_write, &pak_write, 0);
+
+            if (g_IniCompressPakFile)
+            {
+                mz_zip_writer_set_compress_method(zip_write, MZ_COMPRESS_METHOD_LZMA);
+                mz_zip_writer_set_compress_level(zip_write, (int16_t)compression_level);
+            }
+            else
+            {
+                mz_zip_writer_set_compress_method(zip_write, MZ_COMPRESS_METHOD_STORE);
+                mz_zip_writer_set_compress_level(zip_write, MZ_COMPRESS_LEVEL_DEFAULT);
+            }
+
+            // the encoder's own buffers aren't visible from here, its documented footprint stands in for them
+            int64_t encoder_size = g_IniCompressPakFile ? (int64_t)g_LZMAEncoderMemory[compression_level] * 1024 * 1024 : 0;
+            track(encoder_size);
+
+            PakWriteContext context = { zip_write, zip_read, time(NULL), compression_level, chunk, chunk_size, 0, 0, prefix_size };
+            size_t zip_file_count = file_list.size();
+            long long last_update = 0;
+            for (size_t i = 0; success && i < zip_file_count; i++)
+            {
+                success = WriteEntry(context, file_list[i]);
+                ConsolePrintProgress(PURPLE, i, zip_file_count, last_update);
+            }
+
+            mz_zip_writer_close(zip_write);
+            mz_zip_writer_delete(&zip_write);
+            track(-encoder_size);
+
+            if (success && g_IniCompressPakFile)
+            {
+                ConsolePrintf(GREEN, "Compression successful              \n");
+                PrintWriteStats(context);
+            }
+
+            pak_file.length = (int)(mz_stream_tell(temp_stream) - prefix_size);
+        }
+        else if (success)
+        {
+            success = CopyStream(bsp_stream, source_pak_offset, pak_file.length, temp_stream, chunk, chunk_size);
+        }
+
+        if (success)
+        {
+            success = mz_stream_seek(temp_stream, 0, MZ_SEEK_SET) == MZ_OK &&
+                mz_stream_write(temp_stream, &header, sizeof(header)) == sizeof(header);
+            if (!success)
+                ConsolePrintf(RED, "Failed to write temporary BSP\n");
+        }
+
+        delete[] chunk;
+        track(-chunk_size);
+
+        for (ZipFile& zip_file : file_list)
+            zip_file.Destroy();
+
+        mz_zip_close(zip_read);
+        mz_zip_delete(&zip_read);
+        mz_stream_close(bsp_stream);
+        mz_stream_os_delete(&bsp_stream);
+
+        if (temp_stream)
+        {
+            mz_stream_close(temp_stream);
+            mz_stream_os_delete(&temp_stream);
+        }
+
+        if (!success)
+            return false;
+
+        ConsolePrintf(GREEN, "Done with BSP %s (peak streaming memory: %llu MB)\n", bspname, (uint64_t)(peak_allocated / (1024 * 1024)));
+        if (peak_allocated > memory_limit)
+            ConsolePrintf(YELLOW, "Peak streaming memory exceeded StreamMemoryLimit of %d MB\n", g_IniStreamMemoryLimit);
+        return true;
+    }
+
+    bool Operate(const char* bspname, char* temp_map, size_t* reserved, bool* skipped)
+    {
+        *skipped = false;
+        if (g_IniStreamPakFile)
+            return OperateStreamed(bspname, temp_map, skipped);
+
+        FILE* bsp = fopen(bspname, "rb");
+        if (!bsp)
+        {
+            ConsolePrintf(RED, "Failed to open %s\n", bspname);
+            return false;
+        }
+
+        fseek(bsp, 0, SEEK_END);
+        size_t bsp_size = ftell(bsp);
+        fseek(bsp, 0, SEEK_SET);
+        char* bsp_data = new char[bsp_size];
+        fread(bsp_data, 1, bsp_size, bsp);
+        fclose(bsp);
+
+        BSPHeader* header = (BSPHeader*)bsp_data;
+        if (header->ident != IDBSPHEADER)
+        {
+            ConsolePrintf(RED, "File %s is not a valid BSP!\n", bspname);
+            return false;
+        }
+
+        if (HasEntityOperations())
+        {
+            if (g_IniLogOperations)
+                ConsolePrintf(AQUA, "Running entity operations...\n");
+
+            // the pak file is copied straight into the room left after the new layout
+            BSPLump source_pak = header->lumps[LUMP_PAKFILE];
+            char* relaid_data;
+            size_t prefix_size;
+            if (!OperateEntities(bsp_data, source_pak.offset, source_pak.length, &relaid_data, &prefix_size))
+            {
+                delete[] bsp_data;
+                return false;
+            }
+
+            if (relaid_data)
+            {
+                memcpy(relaid_data + prefix_size, bsp_data + source_pak.offset, source_pak.length);
+                delete[] bsp_data;
+                bsp_data = relaid_data;
+                bsp_size = prefix_size + source_pak.length;
+                header = (BSPHeader*)bsp_data;
+            }
+        }
+
+        BSPLump& pak_file = header->lumps[40];
+
+        int zip_len = pak_file.length;
+        char* zip_buf = bsp_data + pak_file.offset;
+
+        ZipContainer zip;
+
+        if (g_IniWritePakFile)
+        {
+            zip.stream_write_mem = mz_stream_mem_create();
+            mz_stream_mem_set_grow_size(zip.stream_write_mem, (1024 * 1024 * 128)); // ~128mb
+            mz_stream_open(zip.stream_write_mem, NULL, MZ_OPEN_MODE_CREATE);
+            mz_zip_writer_open(zip.stream_write, zip.stream_write_mem, 0);
+
+            if (g_IniCompressPakFile)
+            {
+                mz_zip_writer_set_compress_method(zip.stream_write, MZ_COMPRESS_METHOD_LZMA);
+                mz_zip_writer_set_compress_level(zip.stream_write, g_IniCompressionLevel);
+            }
+            else
+            {
+                mz_zip_writer_set_compress_method(zip.stream_write, MZ_COMPRESS_METHOD_STORE);
+                mz_zip_writer_set_compress_level(zip.stream_write, MZ_COMPRESS_LEVEL_DEFAULT);
+            }
+        }
+
+        mz_stream_mem_set_buffer(zip.stream_read_mem, zip_buf, zip_len);
+        mz_zip_open(zip.stream_read, zip.stream_read_mem, MZ_OPEN_MODE_READ);
+
+        // entries are only decompressed when written, untouched ones may be copied as is
+        ConsolePrintf(WHITE, "Reading pak file...\n");
+        ZipFileList file_list;
+
+        for (int32_t err = mz_zip_goto_first_entry(zip.stream_read); err == MZ_OK; err = mz_zip_goto_next_entry(zip.stream_read))
+        {
+            mz_zip_file* file_info = nullptr;
+            mz_zip_entry_get_info(zip.stream_read, &file_info);
+
+            if (g_IniPrintPakFile)
+                ConsolePrintf(WHITE, "\tsize: %u\t\t%s\n", file_info->uncompressed_size, file_info->filename);
+
+            file_list.emplace_back();
+            file_list.back().InitFromEntry(file_info, mz_zip_get_entry(zip.stream_read));
+        }
+
+        bool success = OperateZip(file_list);
+
+        if (success && g_IniWritePakFile && g_IniOrderPakFile)
+            OrderPakEntries(file_list);
+
+        // estimated from the source entries, so an oversized map is rejected before anything is decompressed
+        if (success)
+            success = CheckMapSize(bspname, file_list, zip.stream_read, pak_file.offset, skipped);
+
+        if (success && g_IniWritePakFile)
+            success = DecompressEntries(file_list, zip_buf, zip_len);
+
+        if (g_IniWritePakFile)
+        {   
+            if (success)
+            {
+                if (g_IniCompressPakFile)
+                    ConsolePrintf(WHITE, "Compressing files. This will take a while!\n");
+                else
+                    ConsolePrintf(WHITE, "Writing pak file...\n");
+
+                const int32_t chunk_size = 1024 * 1024;
+                char* chunk = new char[chunk_size];
+
+                PakWriteContext context = { zip.stream_write, zip.stream_read, time(NULL), g_IniCompressionLevel, chunk, chunk_size, 0, 0,
+                    (int64_t)(bsp_size - pak_file.length) };
+                size_t zip_file_count = file_list.size();
+                long long last_update = 0;
+                for (size_t i = 0; success && i < zip_file_count; i++)
+                {
+                    success = WriteEntry(context, file_list[i]);
+                    ConsolePrintProgress(PURPLE, i, zip_file_count, last_update);
+                }
+
+                delete[] chunk;
+
+                if (success && g_IniCompressPakFile)
+                {
+                    ConsolePrintf(GREEN, "Compression successful              \n");
+                    PrintWriteStats(context);
+                    ConsolePrintf(WHITE, "Writing pak file...\n");
+                }
+
+                mz_zip_writer_close(zip.stream_write);
+                zip.stream_write = nullptr;
+
+                mz_stream_mem_get_buffer(zip.stream_write_mem, (const void**)&zip_buf);
+                mz_stream_mem_get_buffer_length(zip.stream_write_mem, &zip_len);
+
+                bsp_size -= pak_file.length;
+                pak_file.length = zip_len;
+            }
+            else
+            {
+                mz_zip_writer_close(zip.stream_write);
+                zip.stream_write = nullptr;
+            }
+        }
+
+        mz_zip_close(zip.stream_read);
+
+        for (ZipFile& zip_file : file_list)
+            zip_file.Destroy();
+
+        if (!success)
+        {
+            delete[] bsp_data;
+            return false;
+        }
+
+        GetTempMapPath(bspname, temp_map);
+
+        ConsolePrintf(WHITE, "Writing temporary BSP to %s\n", temp_map);
+
+        if (g_IniAsyncIOThreads > 0)
+        {
+            // buffers and their share of the memory budget are handed over to the writer
+            TempMapWrite write;
+            write.path = temp_map;
+            write.bsp_data = bsp_data;
+            write.bsp_size = bsp_size;
+            write.zip_stream = g_IniWritePakFile ? zip.stream_write_mem : nullptr;
+            write.zip_buf = zip_buf;
+            write.zip_len = zip_len;
+            write.reserved = min(*reserved, bsp_size + (size_t)zip_len);
+            *reserved -= write.reserved;
+
+            if (g_IniWritePakFile)
+                zip.stream_write_mem = nullptr;
+
+            g_TempMapWriter.Push(write);
+
+            ConsolePrintf(GREEN, "Done with BSP %s\n", bspname);
+            return true;
+        }
+
+        success = WriteTempMap(temp_map, bsp_data, bsp_size, zip_buf, zip_len);
+        delete[] bsp_data;
+
+        if (success)
+            ConsolePrintf(GREEN, "Done with BSP %s\n", bspname);
+        return success;
+    }
+
+    void OperateAll()
+    {
+        m_Error = false;
+
+        // outputs of an interrupted batch are kept, ResumeJob checks them against the journal
+        if (!g_Journal.HasStage(STAGE_OPERATED))
+        {
+            char temp_path[_MAX_PATH];
+            snprintf(temp_path, sizeof(temp_path), "%s*", g_MapTempPath);
+            WIN32_FIND_DATA find_data;
+            HANDLE find = FindFirstFile(temp_path, &find_data);
+            if (find != INVALID_HANDLE_VALUE)
+            {
+                do
+                {
+                    if (find_data.cFileName[0] != '.')
+                    {
+                        char path[_MAX_PATH];
+                        sprintf(path, "%s%s", g_MapTempPath, find_data.cFileName);
+                        DeleteFile(path);
+                    }
+                } 
+                while (FindNextFile(find, &find_data) != 0);
+                FindClose(find);
+            }
+        }
+
+        std::vector<MapJob> jobs;
+        for (SteamUGCDetails_t& details : m_Files)
+        {
+            // one entry per workshop map even if it fails, uploads index by position
+            jobs.emplace_back();
+            jobs.back().id = details.m_nPublishedFileId;
+            jobs.back().done = jobs.back().skipped = false;
+
+            if (g_IniDownloadMaps && g_Journal.Get(GetJournalKey(details.m_nPublishedFileId, NULL)) < STAGE_DOWNLOADED)
+            {
+                ConsolePrintf(RED, "Skipping map %llu, it failed to download\n", details.m_nPublishedFileId);
+                m_Error = true;
+                continue;
+            }
+
+            if (!GetInstalledMap(details.m_nPublishedFileId, jobs.back().bspname))
+                m_Error = true;
+        }
+
+        size_t workshop_count = jobs.size();
+
+        for (std::string& map_local : g_IniLocalMaps)
+        {
+            jobs.emplace_back();
+            jobs.back().bspname = map_local;
+            jobs.back().id = 0;
+            jobs.back().done = jobs.back().skipped = false;
+        }
+
+        std::vector<MapJob> pending;
+        std::vector<size_t> pending_index;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            MapJob& job = jobs[i];
+            if (job.bspname.empty())
+                continue;
+
+            if (ResumeJob(job))
+                continue;
+
+            pending.push_back(job);
+            pending_index.push_back(i);
+        }
+
+        if (!pending.empty())
+        {
+            bool success = g_IniWorkers > 1 ? OperateShards(pending) : OperateJobs(pending);
+            if (!success)
+                m_Error = true;
+        }
+
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            MapJob& job = pending[i];
+            if (!job.done)
+                continue;
+
+            uint64_t size;
+            uint32_t crc;
+            if (!HashFile(job.temp_map.c_str(), &size, &crc))
+            {
+                ConsolePrintf(RED, "Failed to read back %s\n", job.temp_map.c_str());
+                m_Error = true;
+                continue;
+            }
+
+            g_Journal.Record(GetJournalKey(job.id, job.bspname.c_str()), STAGE_OPERATED, size, crc);
+            jobs[pending_index[i]] = job;
+        }
+
+        m_TempMaps.resize(workshop_count);
+        for (size_t i = 0; i < workshop_count; i++)
+            m_TempMaps[i] = jobs[i].done ? jobs[i].temp_map : "";
+
+        m_OutputMaps.clear();
+        for (MapJob& job : jobs)
+            if (job.done)
+                m_OutputMaps.push_back(job.temp_map);
+    }
+
+    static bool GetInstalledMap(PublishedFileId_t id, std::string& bspname)
+    {
+        char folder_path[_MAX_PATH];
+        uint64_t file_size;
+        uint32_t timestamp;
+        if (!g_SteamUGC->GetItemInstallInfo(id, &file_size, folder_path, sizeof(folder_path), &timestamp))
+        {
+            ConsolePrintf(RED, "Failed to get install information for map %llu!\n", id);
+            return false;
+        }
+
+        FixSlashes(folder_path);
+
+        // this is definitely the wrong way to do it but oh well
+        char find_path[_MAX_PATH];
+        snprintf(find_path, sizeof(find_path), "%s/*.bsp", folder_path);
+
+        WIN32_FIND_DATA find;
+        HANDLE find_handle = FindFirstFile(find_path, &find);
+        if (find_handle == INVALID_HANDLE_VALUE)
+        {
+            ConsolePrintf(RED, "Failed to locate bsp for map %llu in %s!\n", id, folder_path);
+            return false;
+        }
+        FindClose(find_handle);
+
+        snprintf(find_path, sizeof(find_path), "%s/%s", folder_path, find.cFileName);
+        bspname = find_path;
+        return true;
+    }
+
+    // a map operated by an interrupted batch is reused if its output is still intact
+    bool ResumeJob(MapJob& job)
+    {
+        std::string key = GetJournalKey(job.id, job.bspname.c_str());
+        uint64_t size;
+        uint32_t crc;
+        JournalStage stage = g_Journal.Get(key, &size, &crc);
+        if (stage == STAGE_UPLOADED)
+        {
+            ConsolePrintf(WHITE, "Map %s was already uploaded\n", key.c_str());
+            return true;
+        }
+
+        if (stage != STAGE_OPERATED)
+            return false;
+
+        char temp_map[_MAX_PATH];
+        GetTempMapPath(job.bspname.c_str(), temp_map);
+
+        uint64_t temp_size;
+        uint32_t temp_crc;
+        if (!HashFile(temp_map, &temp_size, &temp_crc) || temp_size != size || temp_crc != crc)
+        {
+            ConsolePrintf(YELLOW, "Output of map %s is missing or damaged, operating again\n", key.c_str());
+            return false;
+        }
+
+        ConsolePrintf(WHITE, "Map %s was already operated\n", key.c_str());
+        job.temp_map = temp_map;
+        job.done = true;
+        return true;
+    }
+
+    bool OperateJobs(std::vector<MapJob>& jobs)
+    {
+        size_t operations_size = 0;
+        for (OperationBase* operation : g_IniOperations)
+            operations_size += operation->EstimateMemory();
+
+        std::atomic<size_t> next_job(0);
+        std::atomic<bool> failed(false);
+
+        // an abort only stops the batch it happened in, watch mode keeps patching afterwards
+        g_AbortBatch = false;
+        for (MapJob& job : jobs)
+            job.done = job.skipped = false;
+
+        auto worker = [&]()
+        {
+            size_t i;
+            // a failed map doesn't stop the others, the journal lets the next run retry just that one
+            while (!g_AbortBatch && (i = next_job++) < jobs.size())
+            {
+                MapJob& job = jobs[i];
+                const char* bspname = job.bspname.c_str();
+                if (job.id)
+                    ConsolePrintf(WHITE, "Operating on %llu (%s)...\n", job.id, bspname);
+                else
+                    ConsolePrintf(WHITE, "Operating on local map %s...\n", bspname);
+
+                size_t reserved = g_MemoryBudget.Reserve(EstimateOperateMemory(bspname, operations_size));
+
+                char temp_map[_MAX_PATH];
+                bool success = Operate(bspname, temp_map, &reserved, &job.skipped);
+
+                g_MemoryBudget.Release(reserved);
+
+                if (job.skipped)
+                    continue;
+
+                if (!success)
+                {
+                    ConsolePrintf(RED, "Failed to operate on %s, continuing with the remaining maps\n", bspname);
+                    failed = true;
+                    continue;
+                }
+
+                job.temp_map = temp_map;
+                job.done = true;
+            }
+        };
+
+        size_t thread_count = min((size_t)max(g_IniOperateThreads, 1), jobs.size());
+        if (thread_count <= 1)
+        {
+            worker();
+        }
+        else
+        {
+            ConsolePrintf(WHITE, "Operating on %llu maps with %llu threads (memory budget: %llu MB)\n",
+                (uint64_t)jobs.size(), (uint64_t)thread_count, (uint64_t)(g_MemoryBudget.m_Limit / (1024 * 1024)));
+
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < thread_count; i++)
+                threads.emplace_back(worker);
+            for (std::thread& thread : threads)
+                thread.join();
+        }
+
+        if (g_AbortBatch)
+            failed = true;
+
+        if (!g_TempMapWriter.Finish())
+        {
+            failed = true;
+            for (MapJob& job : jobs)
+                if (job.done && g_TempMapWriter.HasFailed(job.temp_map))
+                    job.done = false;
+        }
+        g_TempMapWriter.Reset();
+
+        if (g_IniWriteDelta && !WriteDeltas(jobs, thread_count))
+            failed = true;
+
+        return !failed;
+    }
+
+    // writes a delta against the original next to each operated map, for copying out instead of the whole BSP
+    bool WriteDeltas(std::vector<MapJob>& jobs, size_t thread_count)
+    {
+        std::atomic<size_t> next_job(0);
+        std::atomic<bool> failed(false);
+
+        auto worker = [&]()
+        {
+            size_t i;
+            while ((i = next_job++) < jobs.size())
+            {
+                MapJob& job = jobs[i];
+                // watch mode patches the map in place, so there is no original left to diff against
+                if (!job.done || job.temp_map == job.bspname)
+                    continue;
+
+                std::string delta_path = job.temp_map + ".delta";
+                if (!WriteDelta(job.bspname.c_str(), job.temp_map.c_str(), delta_path.c_str()))
+                    failed = true;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        return !failed;
+    }
+
+    // splits the maps into shards balanced by BSP size, each operated by a separate worker process
+    bool OperateShards(std::vector<MapJob>& jobs)
+    {
+        // shards carry absolute map, output and config paths, so workers on other machines
+        // only see them if WorkerDir and those paths are on a share every worker can reach
+        if (!g_IniLaunchWorkers && !g_IniWorkerDir[0])
+        {
+            ConsolePrintf(RED, "WorkerDir must be set to a shared directory when LaunchWorkers is 0\n");
+            return false;
+        }
+
+        char config_path[_MAX_PATH];
+        char work_dir[_MAX_PATH];
+        if (!_fullpath(config_path, g_ConfigName, sizeof(config_path)) || !_getcwd(work_dir, sizeof(work_dir)))
+        {
+            ConsolePrintf(RED, "Failed to resolve path of %s\n", g_ConfigName);
+            return false;
+        }
+
+        char shard_dir[_MAX_PATH];
+        if (g_IniWorkerDir[0])
+            snprintf(shard_dir, sizeof(shard_dir), "%s/", g_IniWorkerDir);
+        else
+            snprintf(shard_dir, sizeof(shard_dir), "%sshards/", g_MapTempPath);
+        _mkdir(shard_dir);
+
+        size_t shard_count = min((size_t)g_IniWorkers, jobs.size());
+
+        std::vector<uint64_t> sizes(jobs.size());
+        std::vector<size_t> order(jobs.size());
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            WIN32_FILE_ATTRIBUTE_DATA attributes;
+            if (GetFileAttributesEx(jobs[i].bspname.c_str(), GetFileExInfoStandard, &attributes))
+                sizes[i] = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+            else
+                sizes[i] = 0;
+            order[i] = i;
+        }
+
+        // largest maps first, each onto the least loaded shard
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+        std::vector<std::vector<size_t>> shards(shard_count);
+        std::vector<uint64_t> shard_sizes(shard_count, 0);
+        for (size_t idx : order)
+        {
+            size_t shard = std::min_element(shard_sizes.begin(), shard_sizes.end()) - shard_sizes.begin();
+            shards[shard].push_back(idx);
+            shard_sizes[shard] += sizes[idx];
+        }
+
+        std::vector<std::string> shard_paths;
+        for (size_t shard = 0; shard < shard_count; shard++)
+        {
+            char path[_MAX_PATH];
+            snprintf(path, sizeof(path), "%sshard_%llu.txt", shard_dir, (uint64_t)shard);
+            shard_paths.push_back(path);
+
+            char output[_MAX_PATH];
+            snprintf(output, sizeof(output), "%sshard_%llu/", shard_dir, (uint64_t)shard);
+            _mkdir(output);
+
+            snprintf(path, sizeof(path), "%sshard_%llu.result", shard_dir, (uint64_t)shard);
+            DeleteFile(path);
+
+            FILE* file = fopen(shard_paths[shard].c_str(), "w");
+            if (!file)
+            {
+                ConsolePrintf(RED, "Failed to write shard %s\n", shard_paths[shard].c_str());
+                return false;
+            }
+
+            fprintf(file, "; written by map_batch_updater, run with -worker %s\n", shard_paths[shard].c_str());
+            fprintf(file, "Config=%s\n", config_path);
+            fprintf(file, "Directory=%s\n", work_dir);
+            fprintf(file, "Output=%s\n", output);
+            if (g_IniLaunchWorkers)
+                fprintf(file, "MemoryBudget=%llu\n", (uint64_t)(g_MemoryBudget.m_Limit / shard_count / (1024 * 1024)));
+            for (size_t idx : shards[shard])
+                fprintf(file, "Map=%llu %s\n", jobs[idx].id, jobs[idx].bspname.c_str());
+            fclose(file);
+
+            ConsolePrintf(WHITE, "Shard %llu: %llu maps, %llu MB\n", (uint64_t)shard, (uint64_t)shards[shard].size(), shard_sizes[shard] / (1024 * 1024));
+        }
+
+        if (g_IniLaunchWorkers)
+        {
+            char exe_path[_MAX_PATH];
+            GetModuleFileName(NULL, exe_path, sizeof(exe_path));
+
+            std::vector<HANDLE> processes;
+            for (std::string& shard_path : shard_paths)
+            {
+                char command[_MAX_PATH * 2 + 32];
+                snprintf(command, sizeof(command), "\"%s\" -worker \"%s\"", exe_path, shard_path.c_str());
+
+                STARTUPINFO startup_info = { 0 };
+                startup_info.cb = sizeof(startup_info);
+                PROCESS_INFORMATION process_info = { 0 };
+                if (!CreateProcess(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup_info, &process_info))
+                {
+                    ConsolePrintf(RED, "Failed to launch worker for %s (error: %d)\n", shard_path.c_str(), GetLastError());
+                    continue;
+                }
+
+                CloseHandle(process_info.hThread);
+                processes.push_back(process_info.hProcess);
+            }
+
+            ConsolePrintf(PURPLE, "Waiting for %llu workers...\n", (uint64_t)processes.size());
+            for (HANDLE process : processes)
+            {
+                WaitForSingleObject(process, INFINITE);
+                CloseHandle(process);
+            }
+        }
+        else
+        {
+            ConsolePrintf(PURPLE, "Waiting for workers. On each build node, run:\n");
+            for (std::string& shard_path : shard_paths)
+                ConsolePrintf(WHITE, "\tmap_batch_updater -worker \"%s\"\n", shard_path.c_str());
+        }
+
+        return CollectShards(jobs, shard_dir, shard_count);
+    }
+
+    // reads each worker's result manifest and moves its maps next to the rest for uploading
+    bool CollectShards(std::vector<MapJob>& jobs, const char* shard_dir, size_t shard_count)
+    {
+        for (MapJob& job : jobs)
+            job.done = job.skipped = false;
+
+        bool success = true;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<bool> collected(shard_count, false);
+        size_t remaining = shard_count;
+
+        while (remaining > 0)
+        {
+            for (size_t shard = 0; shard < shard_count; shard++)
+            {
+                if (collected[shard])
+                    continue;
+
+                char path[_MAX_PATH];
+                snprintf(path, sizeof(path), "%sshard_%llu.result", shard_dir, (uint64_t)shard);
+                FILE* file = fopen(path, "r");
+                if (!file)
+                    continue;
+
+                collected[shard] = true;
+                remaining--;
+
+                char line[_MAX_PATH * 2 + 16];
+                while (fgets(line, sizeof(line), file))
+                {
+                    line[strcspn(line, "\r\n")] = 0;
+
+                    char* status = strtok(line, "\t");
+                    char* bspname = strtok(NULL, "\t");
+                    char* temp_map = strtok(NULL, "\t");
+                    if (!status || !bspname)
+                        continue;
+
+                    for (MapJob& job : jobs)
+                    {
+                        if (job.bspname != bspname)
+                            continue;
+
+                        if (!strcmp(status, "SKIPPED"))
+                        {
+                            ConsolePrintf(YELLOW, "Worker skipped %s\n", bspname);
+                            job.skipped = true;
+                            break;
+                        }
+
+                        if (strcmp(status, "OK") || !temp_map)
+                        {
+                            ConsolePrintf(RED, "Worker failed on %s\n", bspname);
+                            break;
+                        }
+
+                        char dest[_MAX_PATH];
+                        GetTempMapPath(bspname, dest);
+                        if (!MoveFileEx(temp_map, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED))
+                        {
+                            ConsolePrintf(RED, "Failed to collect %s from worker (error: %d)\n", temp_map, GetLastError());
+                            break;
+                        }
+
+                        // the worker's delta follows its map
+                        std::string delta_path = std::string(temp_map) + ".delta";
+                        if (GetFileAttributes(delta_path.c_str()) != INVALID_FILE_ATTRIBUTES)
+                        {
+                            std::string delta_dest = std::string(dest) + ".delta";
+                            if (!MoveFileEx(delta_path.c_str(), delta_dest.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED))
+                                ConsolePrintf(RED, "Failed to collect %s from worker (error: %d)\n", delta_path.c_str(), GetLastError());
+                        }
+
+                        job.temp_map = dest;
+                        job.done = true;
+                        break;
+                    }
+                }
+
+                fclose(file);
+                ConsolePrintf(GREEN, "Collected shard %llu\n", (uint64_t)shard);
+            }
+
+            if (remaining == 0)
+                break;
+
+            if (g_IniLaunchWorkers)
+            {
+                ConsolePrintf(RED, "%llu workers exited without a result\n", (uint64_t)remaining);
+                success = false;
+                break;
+            }
+
+            if (g_IniWorkerTimeout > 0 && std::chrono::steady_clock::now() - start > std::chrono::seconds(g_IniWorkerTimeout))
+            {
+                ConsolePrintf(RED, "Timed out waiting for %llu workers\n", (uint64_t)remaining);
+                success = false;
+                break;
+            }
+
+            Sleep(1000);
+        }
+
+        for (MapJob& job : jobs)
+        {
+            if (!job.done && !job.skipped)
+            {
+                ConsolePrintf(RED, "No result for %s\n", job.bspname.c_str());
+                success = false;
+            }
+        }
+
+        return success;
+    }
+
+    void CallbackUpload(SubmitItemUpdateResult_t* result, bool error)
+    {
+        const char* file_name = m_TempMaps[m_Uploaded].c_str();
+
+        if (result->m_bUserNeedsToAcceptWorkshopLegalAgreement)
+        {
+            ConsolePrintf(RED, "Failed to upload map. User needs to agree to the workshop legal agreement\n");
+            m_Done = m_Error = true;
+            if (!DeleteFile(file_name))
+                ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
+            return;
+        }
+
+        if (error || result->m_eResult != k_EResultOK)
+        {
+            if (RetryUpload(error ? k_EResultRemoteCallFailed : result->m_eResult))
+                return;
+
+            ConsolePrintf(RED, "Failed to upload map. Result: %d\n", result->m_eResult);
+            m_Done = m_Error = true;
+            if (!DeleteFile(file_name))
+                ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
+            return;
+        }
+
+        ConsolePrintf(GREEN, "Upload successful!                     \n");
+        g_Journal.Record(GetJournalKey(m_Files[m_Uploaded].m_nPublishedFileId, NULL), STAGE_UPLOADED);
+
+        if (!DeleteFile(file_name))
+        {
+            ConsolePrintf(RED, "Failed to delete temporary map at %s\n", file_name);
+            m_Done = m_Error = true;
+            return;
+        }
+
+        m_Uploaded++;
+        UploadNext();
+    }
+
+    // queues the current map again after an exponential backoff, the temp map is kept for it
+    bool RetryUpload(EResult result)
+    {
+        if (!IsTransientResult(result) || m_UploadAttempts > g_IniUploadRetries)
+            return false;
+
+        int delay = max(g_IniUploadBackoff, 0);
+        for (int i = 1; i < m_UploadAttempts && delay < 15 * 60 * 1000; i++)
+            delay *= 2;
+
+        ConsolePrintf(YELLOW, "Upload of %llu failed (result: %d), retrying in %.1f s (attempt %d of %d)\n",
+            m_Files[m_Uploaded].m_nPublishedFileId, (int)result, delay / 1000.0, m_UploadAttempts + 1, g_IniUploadRetries + 1);
+
+        m_Scheduler.Backoff(UploadScheduler::Clock::now() + std::chrono::milliseconds(delay));
+        m_UploadPending = true;
+        m_UploadWaitShown = true;
+        return true;
+    }
+
+    // maps uploaded by an interrupted batch have no temp map left
+    void UploadNext()
+    {
+        while (m_Uploaded < m_Files.size() && (m_Uploaded >= m_TempMaps.size() || m_TempMaps[m_Uploaded].empty()))
+            m_Uploaded++;
+
+        if (m_Uploaded >= m_Files.size())
+        {
+            m_Done = true;
+            return;
+        }
+
+        m_UploadAttempts = 0;
+        m_UploadPending = true;
+        m_UploadWaitShown = false;
+    }
+
+    // called from the callback loop, submits the queued upload once the scheduler allows it
+    void PumpUploads()
+    {
+        auto now = UploadScheduler::Clock::now();
+
+        if (m_FakeSubmitted && now >= m_FakeCompletion)
+            CompleteFakeUpload();
+
+        if (!m_UploadPending || m_Done)
+            return;
+
+        if (!m_Scheduler.TryAcquire(now))
+        {
+            if (!m_UploadWaitShown)
+            {
+                ConsolePrintf(PURPLE, "Waiting %.1f s to not trip spam filters...\n", m_Scheduler.GetWait(now));
+                m_UploadWaitShown = true;
+            }
+            return;
+        }
+
+        m_UploadPending = false;
+        m_UploadAttempts++;
+
+        if (m_LastSubmit != UploadScheduler::Clock::time_point())
+            ConsolePrintf(WHITE, "%.1f s since the previous submit\n", std::chrono::duration<double>(now - m_LastSubmit).count());
+        m_LastSubmit = now;
+
+        Upload(m_Files[m_Uploaded].m_nPublishedFileId);
+    }
+
+    void Upload(PublishedFileId_t id)
+    {
+        ConsolePrintf(WHITE, "Uploading map %llu...\n", id);
+
+        const char* map_path = m_TempMaps[m_Uploaded].c_str();
+        const char* map_name = strrchr(map_path, '/');
+        if (!map_name)
+        {
+            ConsolePrintf(RED, "Bad path for map %llu (%s)\n", id, map_path);
+            m_Done = m_Error = true;
+            return;
+        }
+        map_name++;
+
+        if (g_IniFakeWorkshop[0])
+        {
+            SubmitFakeUpload();
+            return;
+        }
+
+        m_UploadHandle = g_SteamUGC->StartItemUpdate(g_AppID, id);
+        if (m_UploadHandle == k_UGCUpdateHandleInvalid)
+        {
+            if (RetryUpload(k_EResultRemoteCallFailed))
+                return;
 
-        m_UploadHandle = g_SteamUGC->StartItemUpdate(g_AppID, id);
-        if (m_UploadHandle == k_UGCUpdateHandleInvalid)
-        {
             ConsolePrintf(RED, "Failed to begin update for %llu!\n", id);
             m_Done = m_Error = true;
             return;
         }
 
-        const char* map_path = m_TempMaps[m_Uploaded].c_str();
-        const char* map_name = strrchr(map_path, '/');
-        if (!map_name)
+        if (!g_SteamUGC->SetItemContent(m_UploadHandle, map_path) ||
+            !g_SteamUGC->SetItemMetadata(m_UploadHandle, map_name))
+        {
+            ConsolePrintf(RED, "Failed to set map data for %llu (%s)\n", id, map_path);
+            m_Done = m_Error = true;
+            return;
+        }
+
+        m_Call = g_SteamUGC->SubmitItemUpdate(m_UploadHandle, g_IniChangeNote[0] ? g_IniChangeNote : NULL);
+        if (m_Call == k_uAPICallInvalid)
+        {
+            if (RetryUpload(k_EResultRemoteCallFailed))
+                return;
+
+            ConsolePrintf(RED, "Failed to send Steam Upload message\n");
+            m_Done = m_Error = true;
+            return;
+        }
+
+        m_UploadCallback.Set(m_Call, this, &UGCWrapper::CallbackUpload);
+    }
+
+    // stands in for SubmitItemUpdate, the result arrives after FakeWorkshopLatency
+    void SubmitFakeUpload()
+    {
+        m_FakeSubmitted = true;
+        m_FakeCompletion = UploadScheduler::Clock::now() + std::chrono::milliseconds(max(g_IniFakeWorkshopLatency, 0));
+    }
+
+    // copies the map to <FakeWorkshop>/<id>/ unless this submit was picked to fail
+    void CompleteFakeUpload()
+    {
+        m_FakeSubmitted = false;
+
+        SubmitItemUpdateResult_t result = {};
+        result.m_nPublishedFileId = m_Files[m_Uploaded].m_nPublishedFileId;
+        result.m_eResult = k_EResultOK;
+
+        if (rand() % 100 < g_IniFakeWorkshopFailRate)
+        {
+            result.m_eResult = k_EResultBusy;
+        }
+        else
+        {
+            const char* map_path = m_TempMaps[m_Uploaded].c_str();
+            char dest[_MAX_PATH];
+            snprintf(dest, sizeof(dest), "%s/%llu", g_IniFakeWorkshop, result.m_nPublishedFileId);
+            _mkdir(g_IniFakeWorkshop);
+            _mkdir(dest);
+            snprintf(dest, sizeof(dest), "%s/%llu%s", g_IniFakeWorkshop, result.m_nPublishedFileId, strrchr(map_path, '/'));
+            if (!CopyFile(map_path, dest, FALSE))
+                result.m_eResult = k_EResultIOFailure;
+        }
+
+        CallbackUpload(&result, false);
+    }
+
+    void UploadAll()
+    {
+        m_Done = false;
+        m_UploadHandle = k_UGCUpdateHandleInvalid;
+        m_Uploaded = 0;
+        m_FakeSubmitted = false;
+        m_LastSubmit = UploadScheduler::Clock::time_point();
+        m_Scheduler.Init(g_IniUploadInterval, g_IniUploadBurst);
+        UploadNext();
+    }
+
+    void PurgeUnused()
+    {
+        for (int i = (int)m_Files.size() - 1; i >= 0; i--)
+            if (!IsElementInVector(g_IniMaps, m_Files[i].m_nPublishedFileId))
+                EraseElement(m_Files, i);
+    }
+
+    SteamAPICall_t m_Call;
+    CCallResult<UGCWrapper, SteamUGCQueryCompleted_t> m_QueryCallback;
+    CCallback<UGCWrapper, DownloadItemResult_t, false> m_DownloadCallback;
+    CCallResult<UGCWrapper, SubmitItemUpdateResult_t> m_UploadCallback;
+    std::vector<SteamUGCDetails_t> m_Files;
+    std::vector<std::string> m_TempMaps;
+    std::vector<std::string> m_OutputMaps;
+
+    UGCQueryHandle_t m_QueryHandle;
+    uint32_t m_Page;
+
+    PublishedFileId_t m_DownloadID;
+    size_t m_Downloaded;
+
+    UGCUpdateHandle_t m_UploadHandle;
+    size_t m_Uploaded;
+    int m_UploadAttempts;
+    bool m_UploadPending;
+    bool m_UploadWaitShown;
+    UploadScheduler m_Scheduler;
+    UploadScheduler::Clock::time_point m_LastSubmit;
+
+    bool m_FakeSubmitted;
+    UploadScheduler::Clock::time_point m_FakeCompletion;
+
+    bool m_Done;
+    bool m_Error;
+};
+
+UGCWrapper g_UGCWrapper;
+
+static bool IsUGCQueryFinished()
+{
+    return g_UGCWrapper.m_Done;
+}
+
+static bool IsUGCDownloadFinished()
+{
+    static long long last_update = 0;
+    if (g_UGCWrapper.m_Done)
+        return true;
+
+    uint64 bytes_downloaded = 0;
+    uint64 bytes_total = 0;
+    if (g_SteamUGC->GetItemDownloadInfo(g_UGCWrapper.m_DownloadID, &bytes_downloaded, &bytes_total))
+        ConsolePrintProgress(PURPLE, bytes_downloaded, bytes_total, last_update);
+
+    return false;
+}
+
+static bool IsUGCUploadFinished()
+{
+    static long long last_update = 0;
+    g_UGCWrapper.PumpUploads();
+
+    if (g_UGCWrapper.m_Done)
+        return true;
+
+    uint64 bytes_uploaded = 0;
+    uint64 bytes_total = 0;
+    if (g_SteamUGC && !g_UGCWrapper.m_UploadPending && g_SteamUGC->GetItemUpdateProgress(g_UGCWrapper.m_UploadHandle, &bytes_uploaded, &bytes_total))
+        ConsolePrintProgress(PURPLE, bytes_uploaded, bytes_total, last_update);
+
+    return false;
+}
+
+// workshop listing reused between -daemon jobs
+std::vector<SteamUGCDetails_t> g_WorkshopCache;
+std::chrono::steady_clock::time_point g_WorkshopCacheTime;
+
+static bool FindUGCMaps()
+{
+    if (g_IniMaps.size() == 0)
+    {
+        if (g_IniLocalMaps.size() > 0)
+        {
+            g_IniDownloadMaps = false;
+            g_IniUploadMaps = false;
+            return true;
+        }
+
+        ConsolePrintf(RED, "No map IDs defined in %s\n", g_ConfigName);
+        return false;
+    }
+
+    ConsolePrintf(PURPLE, "Finding owned workshop maps...\n");
+
+    auto now = std::chrono::steady_clock::now();
+    if (g_DaemonRunning && !g_WorkshopCache.empty() && now - g_WorkshopCacheTime < std::chrono::seconds(g_IniDaemonMetadataTime))
+    {
+        ConsolePrintf(WHITE, "Using the workshop listing from %lld s ago\n",
+            (long long)std::chrono::duration_cast<std::chrono::seconds>(now - g_WorkshopCacheTime).count());
+        g_UGCWrapper.m_Files = g_WorkshopCache;
+        g_UGCWrapper.m_Error = false;
+    }
+    else
+    {
+        g_UGCWrapper.m_Files.clear();
+        g_UGCWrapper.EnumerateAll();
+        SleepUntilCondition(IsUGCQueryFinished, 100);
+
+        if (g_DaemonRunning && !g_UGCWrapper.m_Error)
+        {
+            g_WorkshopCache = g_UGCWrapper.m_Files;
+            g_WorkshopCacheTime = now;
+        }
+    }
+
+    ConsolePrintf(WHITE, "Found %u owned workshop maps\n", g_UGCWrapper.m_Files.size());
+    for (SteamUGCDetails_t& details : g_UGCWrapper.m_Files)
+    {
+        if (details.m_eFileType != k_EWorkshopFileTypeCommunity)
+            continue;
+
+        ConsoleColors clr = WHITE;
+        if (IsElementInVector(g_IniMaps, details.m_nPublishedFileId))
+            clr = AQUA;
+        ConsolePrintf(clr, "\t%s (%llu)\n", details.m_rgchTitle, details.m_nPublishedFileId);
+    }
+
+    bool ok = !g_UGCWrapper.m_Error;
+    for (PublishedFileId_t id : g_IniMaps)
+    {
+        for (SteamUGCDetails_t& details : g_UGCWrapper.m_Files)
+            if (details.m_nPublishedFileId == id)
+                goto next;
+
+        ConsolePrintf(RED, "Failed to find workshop map %llu listed in %s\n", id, g_ConfigName);
+        ok = false;
+        next: {}
+    }
+
+    g_UGCWrapper.PurgeUnused();
+
+    if (g_UGCWrapper.m_Files.size() == 0)
+    {
+        ConsolePrintf(RED, "ERROR: No owned workshop maps found!\n");
+        return false;
+    }
+
+    return ok;
+}
+
+static bool DownloadUGCMaps()
+{
+    ConsolePrintf(PURPLE, "Downloading workshop maps to modify...\n");
+
+    g_UGCWrapper.DownloadAll();
+    SleepUntilCondition(IsUGCDownloadFinished, 100);
+    return !g_UGCWrapper.m_Error;
+}
+
+static bool OperateUGCMaps()
+{
+    ConsolePrintf(PURPLE, "Operating on selected maps...\n");
+
+    g_UGCWrapper.OperateAll();
+
+    if (g_UGCWrapper.m_Error)
+        return false;
+
+    if (g_IniVerifyMaps && !g_UGCWrapper.m_OutputMaps.empty())
+    {
+        ConsolePrintf(PURPLE, "Verifying modified maps...\n");
+
+        std::vector<std::string> failed_paths;
+        if (!VerifyMaps(g_UGCWrapper.m_OutputMaps, failed_paths))
+        {
+            // renamed so an interrupted batch doesn't resume from them but they can still be inspected
+            for (std::string& path : failed_paths)
+            {
+                std::string bad_path = path + ".bad";
+                MoveFileEx(path.c_str(), bad_path.c_str(), MOVEFILE_REPLACE_EXISTING);
+            }
+            return false;
+        }
+    }
+
+    ShellExecute(NULL, "open", g_MapTempPath, NULL, NULL, SW_SHOWDEFAULT);
+    return true;
+}
+
+static bool UploadUGCMaps()
+{
+    ConsolePrintf(RED, "*********************************************************\n");
+    ConsolePrintf(WHITE, "The next step uploads the modified maps to the workshop.\n");
+    ConsolePrintf(WHITE, "Before proceding, ensure you have reviewed one of the modified BSPs.\n");
+    ConsolePrintf(WHITE, "Copy paste any .bsp from the temp folder to your TF2 maps folder and check in-game to ensure it works as expected.\n");
+    ConsolePrintf(WHITE, "To continue, type in the text \"iamsure\". If something is wrong, type the text \"abort\".\n");
+    ConsolePrintf(YELLOW, "NOTE: TF2 won't launch if not currently open because Steam believes it's already running.\n");
+    ConsolePrintf(YELLOW, "      As a workaround, you can launch it manually through hl2.exe, for example through a .bat file\n");
+    ConsolePrintf(YELLOW, "      hl2.exe -game tf -steam -insecure\n");
+    ConsolePrintf(RED, "*********************************************************\n");
+
+    ShellExecute(NULL, "open", g_MapTempPath, NULL, NULL, SW_SHOWDEFAULT);
+    g_Logger.Flush();
+
+    do
+    {
+        char input[256] = { 0 };
+        if (!ConsoleReadInput(input, sizeof(input)) || !strcmp(input, "abort"))
+            return false;
+        else if (!strcmp(input, "iamsure"))
+            break;
+    }
+    while (true);
+
+    ConsolePrintf(PURPLE, "Uploading modified workshop maps...\n");
+
+    g_UGCWrapper.UploadAll();
+    SleepUntilCondition(IsUGCUploadFinished, 100);
+
+    // update times changed
+    g_WorkshopCache.clear();
+
+    return !g_UGCWrapper.m_Error;
+}
+
+static bool ParseIni()
+{
+    ConsolePrintf(WHITE, "Reading %s ...\n", g_ConfigName);
+
+    FILE* ini = fopen(g_ConfigName, "r");
+    if (!ini)
+    {
+        ConsolePrintf(RED, "Failed to open %s. Does the file exist?\n", g_ConfigName);
+        return false;
+    }
+
+    bool success = true;
+    enum IniSections
+    {
+        SECTION_INVALID = 1,
+        SECTION_MAPS,
+        SECTION_OPERATIONS,
+        SECTION_TOOL,
+    };
+    IniSections parse_section = SECTION_INVALID;
+
+    char line[1024];
+    for (int line_counter = 0; fgets(line, sizeof(line), ini); line_counter++)
+    {
+        if (line[0] == '\0' || line[0] == ';' || line[0] == '\n' || line[0] == '\r')
+            continue;
+
+        line[strcspn(line, "\n")] = 0;
+
+        if (line[0] == '[')
+        {
+            if (!strnicmp(line, "[Maps]", 6))
+                parse_section = SECTION_MAPS;
+            else if (!strnicmp(line, "[Operations]", 12))
+                parse_section = SECTION_OPERATIONS;
+            else if (!strnicmp(line, "[Tool]", 6))
+                parse_section = SECTION_TOOL;
+            else
+            {
+                ConsolePrintf(RED, "%s: Unrecognized section '%s' on line %d\n", g_ConfigName, line, line_counter);
+                success = false;
+            }
+            continue;
+        }
+
+        char* key = strtok(line, "=");
+        if (!key)
+        {
+            ConsolePrintf(RED, "%s: Missing token = on line %d\n", g_ConfigName, line_counter);
+            success = false;
+            continue;
+        }
+
+        // the rest of the line, entity rules and change notes may contain '='
+        char* value = strtok(NULL, "");
+        if (!value)
+        {
+            ConsolePrintf(RED, "%s: Missing value on line %d\n", g_ConfigName, line_counter);
+            success = false;
+            continue;
+        }
+
+        // entity keyvalues and change notes may contain backslashes of their own
+        bool is_path = parse_section == SECTION_MAPS ||
+            (parse_section == SECTION_OPERATIONS && strcmp(key, "ENTITY")) ||
+            (parse_section == SECTION_TOOL && (!strcmp(key, "LogFile") || !strcmp(key, "FakeWorkshop") || !strcmp(key, "WorkerDir")));
+        if (is_path)
+            FixSlashes(value);
+
+        if (parse_section == SECTION_MAPS)
+        {
+            if (strspn(value, "0123456789") == strlen(value))
+                g_IniMaps.emplace_back(strtoull(value, NULL, 10));
+            else
+                g_IniLocalMaps.emplace_back(value);
+        }
+        else if (parse_section == SECTION_OPERATIONS)
+        {
+            if (!strcmp(key, "ADD"))
+                g_IniOperations.emplace_back(new OperationAdd(value));
+            else if (!strcmp(key, "REMOVE"))
+                g_IniOperations.emplace_back(new OperationRemove(value));
+            else if (!strcmp(key, "ENTITY"))
+            {
+                OperationEntity* operation = new OperationEntity(value);
+                if (operation->Compile())
+                {
+                    g_IniOperations.emplace_back(operation);
+                }
+                else
+                {
+                    ConsolePrintf(RED, "%s: Invalid entity rule '%s' on line %d\n", g_ConfigName, value, line_counter);
+                    delete operation;
+                    success = false;
+                }
+            }
+            else
+            {
+                ConsolePrintf(RED, "%s: Unrecognized operation '%s' on line %d\n", g_ConfigName, value);
+                success = false;
+            }
+        }
+        else if (parse_section == SECTION_TOOL)
+        {
+            if (!strcmp(key, "DownloadMaps"))
+                g_IniDownloadMaps = !!atoi(value);
+            else if (!strcmp(key, "LogOperations"))
+                g_IniLogOperations = !!atoi(value);
+            else if (!strcmp(key, "OperateMaps"))
+                g_IniOperateMaps = !!atoi(value);
+            else if (!strcmp(key, "PrintPakFile"))
+                g_IniPrintPakFile = !!atoi(value);
+            else if (!strcmp(key, "CompressPakFile"))
+                g_IniCompressPakFile = !!atoi(value);
+            else if (!strcmp(key, "CompressionLevel"))
+                g_IniCompressionLevel = atoi(value);
+            else if (!strcmp(key, "WritePakFile"))
+                g_IniWritePakFile = !!atoi(value);
+            else if (!strcmp(key, "UploadMaps"))
+                g_IniUploadMaps = !!atoi(value);
+            else if (!strcmp(key, "StreamPakFile"))
+                g_IniStreamPakFile = !!atoi(value);
+            else if (!strcmp(key, "StreamMemoryLimit"))
+                g_IniStreamMemoryLimit = atoi(value);
+            else if (!strcmp(key, "MemoryBudget"))
+                g_IniMemoryBudget = atoi(value);
+            else if (!strcmp(key, "OperateThreads"))
+                g_IniOperateThreads = atoi(value);
+            else if (!strcmp(key, "RecompressPakFile"))
+                g_IniRecompressPakFile = !!atoi(value);
+            else if (!strcmp(key, "AsyncIOThreads"))
+                g_IniAsyncIOThreads = atoi(value);
+            else if (!strcmp(key, "ReuseLZMAContexts"))
+                g_IniReuseLZMAContexts = !!atoi(value);
+            else if (!strcmp(key, "LogFile"))
+                strncpy(g_IniLogFile, value, sizeof(g_IniLogFile) - 1);
+            else if (!strcmp(key, "DecompressThreads"))
+                g_IniDecompressThreads = atoi(value);
+            else if (!strcmp(key, "WalkThreads"))
+                g_IniWalkThreads = atoi(value);
+            else if (!strcmp(key, "ReuseManifest"))
+                g_IniReuseManifest = !!atoi(value);
+            else if (!strcmp(key, "PlanOperations"))
+                g_IniPlanOperations = !!atoi(value);
+            else if (!strcmp(key, "WriteDelta"))
+                g_IniWriteDelta = !!atoi(value);
+            else if (!strcmp(key, "OrderPakFile"))
+                g_IniOrderPakFile = !!atoi(value);
+            else if (!strcmp(key, "OrderSmallSize"))
+                g_IniOrderSmallSize = atoi(value);
+            else if (!strcmp(key, "AlignStoredFiles"))
+                g_IniAlignStoredFiles = atoi(value);
+            else if (!strcmp(key, "MapAddThreshold"))
+                g_IniMapAddThreshold = atoi(value);
+            else if (!strcmp(key, "DaemonCacheSize"))
+                g_IniDaemonCacheSize = atoi(value);
+            else if (!strcmp(key, "DaemonMetadataTime"))
+                g_IniDaemonMetadataTime = atoi(value);
+            else if (!strcmp(key, "UploadInterval"))
+                g_IniUploadInterval = atoi(value);
+            else if (!strcmp(key, "UploadBurst"))
+                g_IniUploadBurst = atoi(value);
+            else if (!strcmp(key, "UploadRetries"))
+                g_IniUploadRetries = atoi(value);
+            else if (!strcmp(key, "UploadBackoff"))
+                g_IniUploadBackoff = atoi(value);
+            else if (!strcmp(key, "FakeWorkshop"))
+            {
+                strncpy(g_IniFakeWorkshop, value, sizeof(g_IniFakeWorkshop) - 1);
+                FixSlashes(g_IniFakeWorkshop);
+            }
+            else if (!strcmp(key, "FakeWorkshopLatency"))
+                g_IniFakeWorkshopLatency = atoi(value);
+            else if (!strcmp(key, "FakeWorkshopFailRate"))
+                g_IniFakeWorkshopFailRate = atoi(value);
+            else if (!strcmp(key, "MaxMapSize"))
+                g_IniMaxMapSize = atoi(value);
+            else if (!strcmp(key, "MaxMapSizeAction"))
+                g_IniMaxMapSizeAbort = !_stricmp(value, "abort");
+            else if (!strcmp(key, "EstimateBlocks"))
+                g_IniEstimateBlocks = atoi(value);
+            else if (!strcmp(key, "TuneSampleSize"))
+                g_IniTuneSampleSize = atoi(value);
+            else if (!strcmp(key, "TuneSizeTarget"))
+                g_IniTuneSizeTarget = atoi(value);
+            else if (!strcmp(key, "TuneTimeBudget"))
+                g_IniTuneTimeBudget = atoi(value);
+            else if (!strcmp(key, "VerifyMaps"))
+                g_IniVerifyMaps = !!atoi(value);
+            else if (!strcmp(key, "VerifyThreads"))
+                g_IniVerifyThreads = atoi(value);
+            else if (!strcmp(key, "Workers"))
+                g_IniWorkers = atoi(value);
+            else if (!strcmp(key, "LaunchWorkers"))
+                g_IniLaunchWorkers = !!atoi(value);
+            else if (!strcmp(key, "WorkerDir"))
+                strncpy(g_IniWorkerDir, value, sizeof(g_IniWorkerDir) - 1);
+            else if (!strcmp(key, "WorkerTimeout"))
+                g_IniWorkerTimeout = atoi(value);
+            else if (!strcmp(key, "ChangeNote"))
+            {
+                if (!strcmp(value, "NULL"))
+                    g_IniChangeNote[0] = '\0';
+                else
+                    strncpy(g_IniChangeNote, value, sizeof(g_IniChangeNote));
+            }
+            else
+            {
+                ConsolePrintf(RED, "%s: Unrecognized debug key '%s' on line % d\n", g_ConfigName, value);
+                success = false;
+            }
+        }
+    }
+
+    fclose(ini);
+    return success;
+}
+
+const uint32_t PAK_INDEX_VERSION = 1;
+
+struct PakIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t map_count;
+    uint32_t entry_count;
+    uint32_t strings_size;
+    uint32_t padding;
+};
+
+struct PakIndexMap
+{
+    uint64_t id;
+    uint64_t size;
+    uint64_t modified;
+    uint32_t path;
+    uint32_t first_entry;
+    uint32_t entry_count;
+    uint32_t padding;
+};
+
+struct PakIndexEntry
+{
+    uint64_t size;
+    uint32_t name;
+    uint32_t crc;
+    uint32_t map;
+    uint32_t padding;
+};
+
+// Central directory listing of every configured map, kept on disk so lookups don't touch any BSP.
+// Layout: header, maps, entries grouped by map, entry indices sorted by name, string table
+struct PakIndex
+{
+    bool Load(const char* path)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return false;
+
+        fseek(file, 0, SEEK_END);
+        size_t size = (size_t)ftell(file);
+        fseek(file, 0, SEEK_SET);
+        m_Data.resize(size);
+        bool success = fread(m_Data.data(), 1, size, file) == size;
+        fclose(file);
+
+        if (!success || size < sizeof(PakIndexHeader))
+            return false;
+
+        PakIndexHeader* header = (PakIndexHeader*)m_Data.data();
+        if (memcmp(header->magic, "MBPI", 4) || header->version != PAK_INDEX_VERSION)
+            return false;
+
+        size_t expected = sizeof(PakIndexHeader) + (size_t)header->map_count * sizeof(PakIndexMap) +
+            (size_t)header->entry_count * (sizeof(PakIndexEntry) + sizeof(uint32_t)) + header->strings_size;
+        if (expected != size)
+            return false;
+
+        m_Header = header;
+        m_Maps = (PakIndexMap*)(m_Header + 1);
+        m_Entries = (PakIndexEntry*)(m_Maps + m_Header->map_count);
+        m_Sorted = (uint32_t*)(m_Entries + m_Header->entry_count);
+        m_Strings = (const char*)(m_Sorted + m_Header->entry_count);
+        return true;
+    }
+
+    const char* GetString(uint32_t offset) const { return m_Strings + offset; }
+    const PakIndexMap* FindMap(const char* path) const
+    {
+        for (uint32_t i = 0; m_Header && i < m_Header->map_count; i++)
+            if (!strcmp(GetString(m_Maps[i].path), path))
+                return &m_Maps[i];
+        return nullptr;
+    }
+
+    // collects matching entry indices in name order
+    void Find(const char* pattern, std::vector<uint32_t>& results) const
+    {
+        if (!m_Header)
+            return;
+
+        // the literal part before the first wildcard narrows the sorted range
+        size_t prefix_len = strcspn(pattern, "*?");
+        const uint32_t* begin = m_Sorted;
+        const uint32_t* end = m_Sorted + m_Header->entry_count;
+        if (prefix_len)
+        {
+            begin = std::lower_bound(begin, end, pattern, [&](uint32_t entry, const char* prefix)
+                { return _strnicmp(GetString(m_Entries[entry].name), prefix, prefix_len) < 0; });
+            end = std::upper_bound(begin, end, pattern, [&](const char* prefix, uint32_t entry)
+                { return _strnicmp(prefix, GetString(m_Entries[entry].name), prefix_len) < 0; });
+        }
+
+        for (const uint32_t* it = begin; it != end; it++)
+            if (MatchGlob(pattern, GetString(m_Entries[*it].name)))
+                results.push_back(*it);
+    }
+
+    void FindCRC(uint32_t crc, std::vector<uint32_t>& results) const
+    {
+        for (uint32_t i = 0; m_Header && i < m_Header->entry_count; i++)
+            if (m_Entries[m_Sorted[i]].crc == crc)
+                results.push_back(m_Sorted[i]);
+    }
+
+    std::vector<char> m_Data;
+    PakIndexHeader* m_Header = nullptr;
+    PakIndexMap* m_Maps = nullptr;
+    PakIndexEntry* m_Entries = nullptr;
+    uint32_t* m_Sorted = nullptr;
+    const char* m_Strings = nullptr;
+};
+
+struct PakListing
+{
+    std::string path;
+    PublishedFileId_t id;
+    uint64_t size;
+    uint64_t modified;
+    bool reused;
+    std::vector<std::string> names;
+    std::vector<uint64_t> sizes;
+    std::vector<uint32_t> crcs;
+};
+
+// reads only the central directory of a BSP's pak file
+static bool ReadPakListing(PakListing& listing)
+{
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, listing.path.c_str(), MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", listing.path.c_str());
+        mz_stream_os_delete(&bsp_stream);
+        return false;
+    }
+
+    bool success = false;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) == sizeof(header) && header.ident == IDBSPHEADER)
+    {
+        LumpStream pak_read(bsp_stream, header.lumps[40].offset, header.lumps[40].length);
+
+        void* zip_read = mz_zip_create();
+        if (mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK)
+        {
+            success = true;
+            for (int32_t err = mz_zip_goto_first_entry(zip_read); err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+            {
+                mz_zip_file* file_info = nullptr;
+                if (mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK)
+                    continue;
+
+                listing.names.emplace_back(file_info->filename);
+                listing.sizes.push_back((uint64_t)file_info->uncompressed_size);
+                listing.crcs.push_back(file_info->crc);
+            }
+            mz_zip_close(zip_read);
+        }
+        mz_zip_delete(&zip_read);
+    }
+
+    if (!success)
+        ConsolePrintf(RED, "Failed to read pak file of %s\n", listing.path.c_str());
+
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+    return success;
+}
+
+// rebuilds the index, re-reading only maps whose BSP changed size or modification time since the last run
+static bool UpdatePakIndex(std::vector<PakListing>& listings)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // a missing or outdated index just means every map is read
+    PakIndex old_index;
+    old_index.Load(g_IndexName);
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < listings.size(); i++)
+    {
+        PakListing& listing = listings[i];
+        listing.reused = false;
+
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesEx(listing.path.c_str(), GetFileExInfoStandard, &attributes))
+        {
+            ConsolePrintf(RED, "Failed to find %s\n", listing.path.c_str());
+            return false;
+        }
+
+        listing.size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+        listing.modified = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+
+        const PakIndexMap* map = old_index.FindMap(listing.path.c_str());
+        if (map && map->size == listing.size && map->modified == listing.modified)
+        {
+            for (uint32_t j = 0; j < map->entry_count; j++)
+            {
+                const PakIndexEntry& entry = old_index.m_Entries[map->first_entry + j];
+                listing.names.emplace_back(old_index.GetString(entry.name));
+                listing.sizes.push_back(entry.size);
+                listing.crcs.push_back(entry.crc);
+            }
+            listing.reused = true;
+        }
+        else
+        {
+            pending.push_back(i);
+        }
+    }
+
+    std::atomic<size_t> next_map(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next_map++) < pending.size())
+            if (!ReadPakListing(listings[pending[i]]))
+                failed = true;
+    };
+
+    size_t thread_count = min(max((size_t)std::thread::hardware_concurrency(), (size_t)1), pending.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (failed)
+        return false;
+
+    // serialize, with file names shared between maps stored once
+    std::vector<PakIndexMap> maps;
+    std::vector<PakIndexEntry> entries;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> string_offsets;
+    auto add_string = [&](const std::string& str)
+    {
+        auto it = string_offsets.find(str);
+        if (it != string_offsets.end())
+            return it->second;
+
+        uint32_t offset = (uint32_t)strings.size();
+        strings.append(str.c_str(), str.size() + 1);
+        string_offsets[str] = offset;
+        return offset;
+    };
+
+    for (PakListing& listing : listings)
+    {
+        PakIndexMap map = { listing.id, listing.size, listing.modified, add_string(listing.path), (uint32_t)entries.size(), (uint32_t)listing.names.size(), 0 };
+        for (size_t j = 0; j < listing.names.size(); j++)
+        {
+            PakIndexEntry entry = { listing.sizes[j], add_string(listing.names[j]), listing.crcs[j], (uint32_t)maps.size(), 0 };
+            entries.push_back(entry);
+        }
+        maps.push_back(map);
+    }
+
+    std::vector<uint32_t> sorted(entries.size());
+    for (uint32_t i = 0; i < (uint32_t)sorted.size(); i++)
+        sorted[i] = i;
+    std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b)
+    {
+        int cmp = _stricmp(strings.c_str() + entries[a].name, strings.c_str() + entries[b].name);
+        return cmp ? cmp < 0 : a < b;
+    });
+
+    PakIndexHeader header = { { 'M', 'B', 'P', 'I' }, PAK_INDEX_VERSION, (uint32_t)maps.size(), (uint32_t)entries.size(), (uint32_t)strings.size(), 0 };
+
+    char temp_path[_MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", g_IndexName);
+    FILE* file = fopen(temp_path, "wb");
+    if (!file)
+    {
+        ConsolePrintf(RED, "Failed to write %s\n", temp_path);
+        return false;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(maps.data(), sizeof(PakIndexMap), maps.size(), file);
+    fwrite(entries.data(), sizeof(PakIndexEntry), entries.size(), file);
+    fwrite(sorted.data(), sizeof(uint32_t), sorted.size(), file);
+    fwrite(strings.data(), 1, strings.size(), file);
+    bool success = !ferror(file);
+    fclose(file);
+
+    if (!success || !MoveFileEx(temp_path, g_IndexName, MOVEFILE_REPLACE_EXISTING))
+    {
+        ConsolePrintf(RED, "Failed to write %s\n", g_IndexName);
+        return false;
+    }
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(GREEN, "Indexed %llu files in %llu maps (%llu re-read) in %lld ms\n",
+        (uint64_t)entries.size(), (uint64_t)maps.size(), (uint64_t)pending.size(), elapsed);
+    return true;
+}
+
+// BSP paths of all configured maps, workshop maps as currently installed by Steam
+static bool GetConfiguredMaps(std::vector<MapJob>& maps)
+{
+    if (!g_IniMaps.empty())
+    {
+        if (!SteamInit())
+            return false;
+
+        for (PublishedFileId_t id : g_IniMaps)
+        {
+            maps.emplace_back();
+            maps.back().id = id;
+            if (!UGCWrapper::GetInstalledMap(id, maps.back().bspname))
+            {
+                SteamAPI_Shutdown();
+                return false;
+            }
+        }
+
+        SteamAPI_Shutdown();
+    }
+
+    for (std::string& map_local : g_IniLocalMaps)
+    {
+        maps.emplace_back();
+        maps.back().id = 0;
+        maps.back().bspname = map_local;
+    }
+
+    return true;
+}
+
+static int RunIndex()
+{
+    if (!ParseIni())
+        return 1;
+
+    std::vector<MapJob> maps;
+    if (!GetConfiguredMaps(maps))
+        return 1;
+
+    std::vector<PakListing> listings(maps.size());
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+        listings[i].id = maps[i].id;
+        listings[i].path = maps[i].bspname;
+    }
+
+    return UpdatePakIndex(listings) ? 0 : 1;
+}
+
+// prints matches grouped by file name, flagging names whose contents differ between maps
+static int RunFind(const char* pattern, bool by_crc)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    PakIndex index;
+    if (!index.Load(g_IndexName))
+    {
+        ConsolePrintf(RED, "No valid %s, build it with -index first\n", g_IndexName);
+        return 1;
+    }
+
+    std::vector<uint32_t> results;
+    if (by_crc)
+        index.FindCRC((uint32_t)strtoul(pattern, NULL, 16), results);
+    else
+        index.Find(pattern, results);
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t i = 0; i < results.size(); )
+    {
+        const char* name = index.GetString(index.m_Entries[results[i]].name);
+        size_t group_end = i;
+        bool differs = false;
+        while (group_end < results.size() && !_stricmp(index.GetString(index.m_Entries[results[group_end]].name), name))
+        {
+            differs |= index.m_Entries[results[group_end]].crc != index.m_Entries[results[i]].crc;
+            group_end++;
+        }
+
+        ConsolePrintf(differs ? YELLOW : AQUA, "%s (%llu maps%s)\n", name, (uint64_t)(group_end - i), differs ? ", versions differ" : "");
+        for (; i < group_end; i++)
+        {
+            const PakIndexEntry& entry = index.m_Entries[results[i]];
+            const PakIndexMap& map = index.m_Maps[entry.map];
+            ConsolePrintf(WHITE, "\t%08x\t%llu\t%s\n", entry.crc, entry.size, index.GetString(map.path));
+        }
+    }
+
+    ConsolePrintf(GREEN, "%llu matches in %lld us\n", (uint64_t)results.size(), elapsed);
+    return 0;
+}
+
+// replaces key=value under [Tool] in config.ini, adding it if missing
+static bool SetConfigValue(const char* key, const char* value)
+{
+    FILE* ini = fopen(g_ConfigName, "r");
+    if (!ini)
+        return false;
+
+    std::vector<std::string> lines;
+    char line[1024];
+    while (fgets(line, sizeof(line), ini))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        lines.emplace_back(line);
+    }
+    fclose(ini);
+
+    size_t key_len = strlen(key);
+    std::string new_line = std::string(key) + "=" + value;
+    bool in_tool = false;
+    bool replaced = false;
+    size_t tool_line = lines.size();
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        if (lines[i][0] == '[')
+        {
+            in_tool = !strnicmp(lines[i].c_str(), "[Tool]", 6);
+            if (in_tool)
+                tool_line = i;
+        }
+        else if (in_tool && !strncmp(lines[i].c_str(), key, key_len) && lines[i][key_len] == '=')
+        {
+            lines[i] = new_line;
+            replaced = true;
+        }
+    }
+
+    if (!replaced)
+    {
+        if (tool_line == lines.size())
+        {
+            lines.emplace_back("[Tool]");
+            tool_line = lines.size() - 1;
+        }
+        lines.insert(lines.begin() + tool_line + 1, new_line);
+    }
+
+    char temp_path[_MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", g_ConfigName);
+    FILE* out = fopen(temp_path, "w");
+    if (!out)
+        return false;
+    for (std::string& str : lines)
+        fprintf(out, "%s\n", str.c_str());
+    bool success = !ferror(out);
+    fclose(out);
+
+    return success && MoveFileEx(temp_path, g_ConfigName, MOVEFILE_REPLACE_EXISTING);
+}
+
+// reads a byte-weighted systematic sample of blocks from a map's pak entries, so large files are as likely to be picked as their share of the pak
+static bool SampleMapEntries(const char* bspname, uint64_t budget, std::vector<std::vector<char>>& samples, uint64_t* pak_size)
+{
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, bspname, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", bspname);
+        mz_stream_os_delete(&bsp_stream);
+        return false;
+    }
+
+    bool success = false;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) == sizeof(header) && header.ident == IDBSPHEADER)
+    {
+        LumpStream pak_read(bsp_stream, header.lumps[LUMP_PAKFILE].offset, header.lumps[LUMP_PAKFILE].length);
+        void* zip_read = mz_zip_create();
+        if (mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK)
+        {
+            std::vector<std::pair<int64_t, uint64_t>> entries;
+            uint64_t total = 0;
+            for (int32_t err = mz_zip_goto_first_entry(zip_read); err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+            {
+                mz_zip_file* file_info = nullptr;
+                if (mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK || !file_info->uncompressed_size)
+                    continue;
+                entries.emplace_back(mz_zip_get_entry(zip_read), (uint64_t)file_info->uncompressed_size);
+                total += file_info->uncompressed_size;
+            }
+            *pak_size = total;
+
+            // blocks of at most 64 KB spread evenly over the pak by bytes, so one large entry can't exceed the budget
+            success = true;
+            const uint64_t block_size = 64 * 1024;
+            uint64_t step = max(total / max(budget / block_size, (uint64_t)1), (uint64_t)1);
+            uint64_t next_pick = step / 2;
+            uint64_t position = 0;
+            std::vector<char> chunk(block_size);
+            for (std::pair<int64_t, uint64_t>& entry : entries)
+            {
+                uint64_t entry_start = position;
+                position += entry.second;
+
+                std::vector<std::pair<uint64_t, uint64_t>> blocks;
+                for (; next_pick < position; next_pick += step)
+                {
+                    uint64_t offset = next_pick - entry_start;
+                    uint64_t start = offset - min(offset, block_size / 2);
+                    blocks.emplace_back(start, min(block_size, entry.second - start));
+                }
+                if (blocks.empty())
+                    continue;
+
+                // decoded once, up to the end of the last block
+                std::vector<std::vector<char>> data(blocks.size());
+                for (size_t i = 0; i < blocks.size(); i++)
+                    data[i].resize((size_t)blocks[i].second);
+
+                uint64_t end = blocks.back().first + blocks.back().second;
+                uint64_t read = 0;
+                int32_t len = 0;
+                if (mz_zip_goto_entry(zip_read, entry.first) == MZ_OK && mz_zip_entry_read_open(zip_read, 0, NULL) == MZ_OK)
+                {
+                    while (read < end && (len = mz_zip_entry_read(zip_read, chunk.data(), (int32_t)chunk.size())) > 0)
+                    {
+                        for (size_t i = 0; i < blocks.size(); i++)
+                        {
+                            uint64_t copy_start = max(read, blocks[i].first);
+                            uint64_t copy_end = min(read + len, blocks[i].first + blocks[i].second);
+                            if (copy_start < copy_end)
+                                memcpy(data[i].data() + (copy_start - blocks[i].first), chunk.data() + (copy_start - read), (size_t)(copy_end - copy_start));
+                        }
+                        read += len;
+                    }
+                    mz_zip_entry_close(zip_read);
+                }
+
+                if (read < end)
+                    continue;
+
+                for (std::vector<char>& block : data)
+                    samples.push_back(std::move(block));
+            }
+            mz_zip_close(zip_read);
+        }
+        mz_zip_delete(&zip_read);
+    }
+
+    if (!success)
+        ConsolePrintf(RED, "Failed to read pak file of %s\n", bspname);
+
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+    return success;
+}
+
+struct TuneResult
+{
+    int level; // -1 for STORE
+    uint64_t compressed;
+    double seconds;
+};
+
+// compresses a sample of the configured maps' pak entries at every level and recommends one
+static int RunTune(bool apply)
+{
+    if (!ParseIni())
+        return 1;
+
+    std::vector<MapJob> maps;
+    if (!GetConfiguredMaps(maps) || maps.empty())
+        return 1;
+
+    uint64_t budget = (uint64_t)max(g_IniTuneSampleSize, 1) * 1024 * 1024 / maps.size();
+    std::vector<std::vector<char>> samples;
+    uint64_t batch_size = 0;
+    for (MapJob& map : maps)
+    {
+        uint64_t pak_size = 0;
+        if (!SampleMapEntries(map.bspname.c_str(), budget, samples, &pak_size))
+            return 1;
+        batch_size += pak_size;
+    }
+
+    uint64_t sample_size = 0;
+    for (std::vector<char>& sample : samples)
+        sample_size += sample.size();
+
+    if (!sample_size)
+    {
+        ConsolePrintf(RED, "No pak entries to sample\n");
+        return 1;
+    }
+
+    ConsolePrintf(WHITE, "Sampled %llu blocks (%llu KB) out of %llu MB in %llu maps\n",
+        (uint64_t)samples.size(), sample_size / 1024, batch_size / (1024 * 1024), (uint64_t)maps.size());
+
+    std::vector<TuneResult> results;
+    std::vector<uint8_t> out;
+    for (int level = -1; level <= 9; level++)
+    {
+        TuneResult result = { level, 0, 0.0 };
+        auto start = std::chrono::steady_clock::now();
+        for (std::vector<char>& sample : samples)
+        {
+            if (level < 0)
+            {
+                result.compressed += sample.size();
+                continue;
+            }
+
+            result.compressed += GetLZMACompressedSize((const uint8_t*)sample.data(), sample.size(), level, out);
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        results.push_back(result);
+    }
+
+    // scaled from the sample to the whole batch, per map size and total time with the configured threads
+    double map_count = (double)maps.size();
+    double threads = (double)max(g_IniOperateThreads, 1);
+    auto projected_size = [&](const TuneResult& result) { return (double)result.compressed / sample_size * batch_size / map_count / (1024 * 1024); };
+    auto projected_time = [&](const TuneResult& result) { return result.seconds / sample_size * batch_size / threads; };
+
+    ConsolePrintf(AQUA, "Level\tRatio\tMB/s\tMB per map\tBatch time\n");
+    for (TuneResult& result : results)
+    {
+        char level[16];
+        if (result.level < 0)
+            strcpy(level, "STORE");
+        else
+            sprintf(level, "%d", result.level);
+
+        double throughput = result.seconds > 0.0 ? sample_size / result.seconds / (1024 * 1024) : 0.0;
+        ConsolePrintf(WHITE, "%s\t%.3f\t%.1f\t%.1f\t\t%.0f s\n", level, (double)result.compressed / sample_size,
+            throughput, projected_size(result), projected_time(result));
+    }
+
+    // size target: cheapest level that fits. time budget: smallest output that fits.
+    // neither: the lowest level within 1% of the best ratio
+    const TuneResult* best = nullptr;
+    if (g_IniTuneSizeTarget > 0)
+    {
+        for (TuneResult& result : results)
+            if (projected_size(result) <= g_IniTuneSizeTarget && (!best || projected_time(result) < projected_time(*best)))
+                best = &result;
+
+        if (!best)
+            ConsolePrintf(YELLOW, "No level reaches TuneSizeTarget of %d MB per map\n", g_IniTuneSizeTarget);
+    }
+    else if (g_IniTuneTimeBudget > 0)
+    {
+        for (TuneResult& result : results)
+            if (projected_time(result) <= g_IniTuneTimeBudget && (!best || result.compressed < best->compressed))
+                best = &result;
+
+        if (!best)
+            ConsolePrintf(YELLOW, "No level fits TuneTimeBudget of %d seconds\n", g_IniTuneTimeBudget);
+    }
+    else
+    {
+        uint64_t smallest = UINT64_MAX;
+        for (TuneResult& result : results)
+            smallest = min(smallest, result.compressed);
+        for (TuneResult& result : results)
+        {
+            if (result.level >= 0 && result.compressed <= smallest + smallest / 100)
+            {
+                best = &result;
+                break;
+            }
+        }
+    }
+
+    if (!best)
+        return 1;
+
+    if (best->level < 0)
+        ConsolePrintf(GREEN, "Recommended: CompressPakFile=0\n");
+    else
+        ConsolePrintf(GREEN, "Recommended: CompressionLevel=%d\n", best->level);
+
+    if (apply)
+    {
+        char level[16];
+        sprintf(level, "%d", max(best->level, 0));
+        bool success = SetConfigValue("CompressPakFile", best->level < 0 ? "0" : "1") &&
+            (best->level < 0 || SetConfigValue("CompressionLevel", level));
+        if (!success)
+        {
+            ConsolePrintf(RED, "Failed to update %s\n", g_ConfigName);
+            return 1;
+        }
+        ConsolePrintf(GREEN, "Updated %s\n", g_ConfigName);
+    }
+
+    return 0;
+}
+
+// Uploads copies of the configured maps to FakeWorkshop through the upload scheduler,
+// to try out the UploadInterval, UploadBurst and UploadRetries policy offline
+static int RunFakeUpload()
+{
+    if (!ParseIni())
+        return 1;
+
+    if (!g_IniFakeWorkshop[0])
+    {
+        ConsolePrintf(RED, "FakeWorkshop is not set in %s\n", g_ConfigName);
+        return 1;
+    }
+
+    std::vector<MapJob> maps;
+    if (!GetConfiguredMaps(maps) || maps.empty())
+        return 1;
+
+    char temp_dir[_MAX_PATH];
+    GetTempPath(sizeof(temp_dir), temp_dir);
+    FixSlashes(temp_dir);
+    strcat(temp_dir, "maps/");
+    _mkdir(temp_dir);
+    strcat(temp_dir, "fake_upload/");
+    _mkdir(temp_dir);
+
+    g_UGCWrapper.m_Files.clear();
+    g_UGCWrapper.m_TempMaps.clear();
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+        const char* map_name = strrchr(maps[i].bspname.c_str(), '/');
+        std::string temp_map = std::string(temp_dir) + (map_name ? map_name + 1 : maps[i].bspname.c_str());
+        if (!CopyFile(maps[i].bspname.c_str(), temp_map.c_str(), FALSE))
+        {
+            ConsolePrintf(RED, "Failed to copy %s to %s (error: %d)\n", maps[i].bspname.c_str(), temp_map.c_str(), GetLastError());
+            return 1;
+        }
+
+        SteamUGCDetails_t details = {};
+        details.m_nPublishedFileId = maps[i].id ? maps[i].id : i + 1;
+        g_UGCWrapper.m_Files.push_back(details);
+        g_UGCWrapper.m_TempMaps.push_back(temp_map);
+    }
+
+    ConsolePrintf(PURPLE, "Uploading %llu maps to %s...\n", (uint64_t)maps.size(), g_IniFakeWorkshop);
+
+    auto start = std::chrono::steady_clock::now();
+    g_UGCWrapper.UploadAll();
+    while (!IsUGCUploadFinished())
+        Sleep(10);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(g_UGCWrapper.m_Error ? RED : GREEN, "Uploaded %llu of %llu maps in %.1f s\n",
+        (uint64_t)g_UGCWrapper.m_Uploaded, (uint64_t)maps.size(), elapsed);
+    return g_UGCWrapper.m_Error ? 1 : 0;
+}
+
+// size and CRC of an entry's contents, wherever they are held
+static bool GetEntryContent(const ZipFile& zip_file, uint64_t* size, uint32_t* crc)
+{
+    *size = zip_file.size;
+    if (zip_file.source_entry >= 0)
+    {
+        *crc = zip_file.source_crc;
+        return true;
+    }
+
+    if (zip_file.buffer)
+    {
+        *crc = mz_crypt_crc32_update(0, (const uint8_t*)zip_file.buffer, (int32_t)zip_file.size);
+        return true;
+    }
+
+    if (!zip_file.source_path)
+        return false;
+
+    uint64_t file_size;
+    return HashFile(zip_file.source_path, &file_size, crc) && file_size == zip_file.size;
+}
+
+// Runs the operations on every configured map's pak listing both one by one and through the plan,
+// and reports any map where the entries, their order or their contents differ
+static int RunCheckPlan()
+{
+    if (!ParseIni())
+        return 1;
+
+    g_IniPlanOperations = true;
+    if (!PlanOperations())
+        return 1;
+
+    std::vector<MapJob> maps;
+    if (!GetConfiguredMaps(maps) || maps.empty())
+        return 1;
+
+    bool log_operations = g_IniLogOperations;
+    g_IniLogOperations = false;
+
+    size_t mismatches = 0;
+    for (MapJob& map : maps)
+    {
+        PakListing listing;
+        listing.path = map.bspname;
+        if (!ReadPakListing(listing))
+        {
+            mismatches++;
+            continue;
+        }
+
+        ZipFileList sequential;
+        ZipFileList planned;
+        for (size_t i = 0; i < listing.names.size(); i++)
+        {
+            mz_zip_file file_info = { 0 };
+            file_info.filename = listing.names[i].c_str();
+            file_info.uncompressed_size = (int64_t)listing.sizes[i];
+            file_info.crc = listing.crcs[i];
+
+            sequential.emplace_back();
+            sequential.back().InitFromEntry(&file_info, (int64_t)i);
+            planned.emplace_back();
+            planned.back().InitFromEntry(&file_info, (int64_t)i);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool sequential_ok = OperateZipSequential(sequential);
+        auto middle = std::chrono::steady_clock::now();
+        bool planned_ok = g_OperationPlan.Apply(planned);
+        auto end = std::chrono::steady_clock::now();
+
+        char difference[_MAX_PATH + 64] = { 0 };
+        if (sequential_ok != planned_ok)
+            snprintf(difference, sizeof(difference), "sequential %s but the plan %s", sequential_ok ? "succeeded" : "failed", planned_ok ? "succeeded" : "failed");
+        else if (sequential.size() != planned.size())
+            snprintf(difference, sizeof(difference), "%llu entries instead of %llu", (uint64_t)planned.size(), (uint64_t)sequential.size());
+
+        for (size_t i = 0; !difference[0] && i < sequential.size(); i++)
+        {
+            uint64_t sequential_size, planned_size;
+            uint32_t sequential_crc, planned_crc;
+            if (strcmp(sequential[i].filename, planned[i].filename))
+                snprintf(difference, sizeof(difference), "entry %llu is %s instead of %s", (uint64_t)i, planned[i].filename, sequential[i].filename);
+            else if (!GetEntryContent(sequential[i], &sequential_size, &sequential_crc) || !GetEntryContent(planned[i], &planned_size, &planned_crc) ||
+                sequential_size != planned_size || sequential_crc != planned_crc)
+                snprintf(difference, sizeof(difference), "contents of %s differ", planned[i].filename);
+        }
+
+        long long sequential_ms = std::chrono::duration_cast<std::chrono::milliseconds>(middle - start).count();
+        long long planned_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - middle).count();
+        if (difference[0])
+        {
+            ConsolePrintf(RED, "%s: %s\n", map.bspname.c_str(), difference);
+            mismatches++;
+        }
+        else
+        {
+            ConsolePrintf(GREEN, "%s: %llu entries match (sequential %lld ms, plan %lld ms)\n",
+                map.bspname.c_str(), (uint64_t)planned.size(), sequential_ms, planned_ms);
+        }
+
+        for (ZipFile& zip_file : sequential)
+            zip_file.Destroy();
+        for (ZipFile& zip_file : planned)
+            zip_file.Destroy();
+    }
+
+    g_IniLogOperations = log_operations;
+    ConsolePrintf(mismatches ? RED : GREEN, "%llu of %llu maps differ\n", (uint64_t)mismatches, (uint64_t)maps.size());
+    return mismatches ? 1 : 0;
+}
+
+// times the entity pass on one map, e.g. -benchentities big_map.bsp 200
+static int RunEntityBenchmark(const char* bspname, int iterations)
+{
+    if (!ParseIni())
+        return 1;
+
+    if (!HasEntityOperations())
+    {
+        ConsolePrintf(RED, "No ENTITY operations in %s to benchmark\n", g_ConfigName);
+        return 1;
+    }
+
+    FILE* bsp = fopen(bspname, "rb");
+    if (!bsp)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", bspname);
+        return 1;
+    }
+
+    fseek(bsp, 0, SEEK_END);
+    size_t bsp_size = ftell(bsp);
+    fseek(bsp, 0, SEEK_SET);
+    std::vector<char> bsp_data(bsp_size);
+    fread(bsp_data.data(), 1, bsp_size, bsp);
+    fclose(bsp);
+
+    const BSPHeader* header = (const BSPHeader*)bsp_data.data();
+    if (bsp_size < sizeof(BSPHeader) || header->ident != IDBSPHEADER)
+    {
+        ConsolePrintf(RED, "File %s is not a valid BSP!\n", bspname);
+        return 1;
+    }
+
+    g_IniLogOperations = false;
+    size_t prefix_size = header->lumps[LUMP_PAKFILE].offset;
+    iterations = max(iterations, 1);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        char* relaid_data;
+        size_t relaid_size;
+        if (!OperateEntities(bsp_data.data(), prefix_size, 0, &relaid_data, &relaid_size))
+            return 1;
+        delete[] relaid_data;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double lump_mb = header->lumps[LUMP_ENTITIES].length / (1024.0 * 1024.0);
+    ConsolePrintf(GREEN, "%d passes over %.2f MB of entities (%llu entities): %.3f ms per map, %.1f MB/s, %.0f maps per minute\n",
+        iterations, lump_mb, (uint64_t)g_EntityLump.m_Count, seconds * 1000.0 / iterations,
+        lump_mb * iterations / seconds, iterations * 60.0 / seconds);
+    return 0;
+}
+
+// Compresses every entry of a map's pak in memory through the minizip path and the reused LZMA context
+// path and compares the time per entry, open through close, e.g. -benchlzma small_file_map.bsp 3
+static int RunLZMABenchmark(const char* bspname, int passes)
+{
+    if (!ParseIni())
+        return 1;
+
+    FILE* bsp = fopen(bspname, "rb");
+    if (!bsp)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", bspname);
+        return 1;
+    }
+
+    fseek(bsp, 0, SEEK_END);
+    size_t bsp_size = ftell(bsp);
+    fseek(bsp, 0, SEEK_SET);
+    std::vector<char> bsp_data(bsp_size);
+    fread(bsp_data.data(), 1, bsp_size, bsp);
+    fclose(bsp);
+
+    const BSPHeader* header = (const BSPHeader*)bsp_data.data();
+    if (bsp_size < sizeof(BSPHeader) || header->ident != IDBSPHEADER)
+    {
+        ConsolePrintf(RED, "File %s is not a valid BSP!\n", bspname);
+        return 1;
+    }
+
+    const BSPLump& pak_file = header->lumps[LUMP_PAKFILE];
+    if (pak_file.offset < 0 || pak_file.length < 0 || (size_t)pak_file.offset + pak_file.length > bsp_size)
+    {
+        ConsolePrintf(RED, "Pak file of %s is out of bounds\n", bspname);
+        return 1;
+    }
+
+    // decoded up front so only the compression side is timed
+    ZipContainer zip;
+    mz_stream_mem_set_buffer(zip.stream_read_mem, bsp_data.data() + pak_file.offset, pak_file.length);
+    bool success = mz_zip_open(zip.stream_read, zip.stream_read_mem, MZ_OPEN_MODE_READ) == MZ_OK;
+
+    ZipFileList file_list;
+    uint64_t total_size = 0;
+    for (int32_t err = success ? mz_zip_goto_first_entry(zip.stream_read) : MZ_END_OF_LIST; success && err == MZ_OK; err = mz_zip_goto_next_entry(zip.stream_read))
+    {
+        mz_zip_file* file_info = nullptr;
+        mz_zip_entry_get_info(zip.stream_read, &file_info);
+
+        file_list.emplace_back();
+        ZipFile& zip_file = file_list.back();
+        zip_file.Init(file_info->filename, (size_t)file_info->uncompressed_size);
+        total_size += zip_file.size;
+
+        success = mz_zip_entry_read_open(zip.stream_read, 0, NULL) == MZ_OK;
+        for (size_t read = 0; success && read < zip_file.size; )
+        {
+            int32_t len = mz_zip_entry_read(zip.stream_read, zip_file.buffer + read, (int32_t)(zip_file.size - read));
+            success = len > 0;
+            read += len;
+        }
+        mz_zip_entry_close(zip.stream_read);
+    }
+    mz_zip_close(zip.stream_read);
+
+    if (!success || file_list.empty())
+    {
+        ConsolePrintf(RED, "Failed to read pak file of %s\n", bspname);
+        for (ZipFile& zip_file : file_list)
+            zip_file.Destroy();
+        return 1;
+    }
+
+    g_IniCompressPakFile = true;
+    int compression_level = min(max(g_IniCompressionLevel, 0), 9);
+    passes = max(passes, 1);
+
+    // the modes alternate every pass so neither one gets a warmer cache
+    long long entry_time[2] = { 0, 0 };
+    int64_t compressed_size[2] = { 0, 0 };
+    for (int pass = 0; success && pass < passes; pass++)
+    {
+        for (int reuse = 0; success && reuse < 2; reuse++)
+        {
+            g_IniReuseLZMAContexts = !!reuse;
+
+            void* stream_write_mem = mz_stream_mem_create();
+            mz_stream_mem_set_grow_size(stream_write_mem, (1024 * 1024 * 128)); // ~128mb
+            mz_stream_open(stream_write_mem, NULL, MZ_OPEN_MODE_CREATE);
+
+            void* zip_write = mz_zip_writer_create();
+            mz_zip_writer_open(zip_write, stream_write_mem, 0);
+            mz_zip_writer_set_compress_method(zip_write, MZ_COMPRESS_METHOD_LZMA);
+            mz_zip_writer_set_compress_level(zip_write, (int16_t)compression_level);
+
+            PakWriteContext context = { zip_write, NULL, time(NULL), compression_level, NULL, 0, 0, 0, 0 };
+            for (size_t i = 0; success && i < file_list.size(); i++)
+            {
+                ZipFile& zip_file = file_list[i];
+                mz_zip_file write_file_info;
+                InitWriteFileInfo(write_file_info, zip_file, context.the_time);
+
+                auto start = std::chrono::steady_clock::now();
+                EntryWriter writer;
+                success = writer.Open(context, write_file_info) && writer.Write(zip_file.buffer, (int32_t)zip_file.size);
+                if (!writer.Close())
+                    success = false;
+                entry_time[reuse] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+                if (!success)
+                    ConsolePrintf(RED, "Failed to compress pak entry %s\n", zip_file.filename);
+            }
+
+            mz_zip_writer_close(zip_write);
+            mz_zip_writer_delete(&zip_write);
+            compressed_size[reuse] = mz_stream_tell(stream_write_mem);
+            mz_stream_mem_delete(&stream_write_mem);
+        }
+    }
+
+    size_t entry_count = file_list.size();
+    for (ZipFile& zip_file : file_list)
+        zip_file.Destroy();
+
+    if (!success)
+        return 1;
+
+    const double mb = 1024.0 * 1024.0;
+    ConsolePrintf(WHITE, "%llu entries, %.1f MB at compression level %d, %d passes\n",
+        (uint64_t)entry_count, total_size / mb, compression_level, passes);
+    for (int reuse = 0; reuse < 2; reuse++)
+    {
+        double entries = (double)entry_count * passes;
+        ConsolePrintf(reuse ? GREEN : WHITE, "ReuseLZMAContexts=%d: %.1f us per entry, %.0f ms per pass, %.1f MB written\n",
+            reuse, entry_time[reuse] / entries, entry_time[reuse] / 1000.0 / passes, compressed_size[reuse] / mb);
+    }
+    return 0;
+}
+
+// Reads every directory ADD of the config one file at a time and as batches on a pool of threads, the
+// AsyncIOThreads=0 and =N paths. The trees are listed once, only the loading is timed, e.g. -benchio 8 3
+static int RunIOBenchmark(int threads, int passes)
+{
+    if (!ParseIni())
+        return 1;
+
+    struct AddTree
+    {
+        OperationAdd* operation;
+        std::string base_dir;
+        std::vector<std::string> paths;
+    };
+
+    std::vector<AddTree> trees;
+    size_t file_count = 0;
+    for (OperationBase* operation : g_IniOperations)
+    {
+        if (strcmp(operation->m_Name, "ADD"))
+            continue;
+
+        char base_dir[_MAX_PATH];
+        char relative_path[_MAX_PATH];
+        char full_path[_MAX_PATH];
+        bool is_file;
+        OperationAdd* add = (OperationAdd*)operation;
+        if (!add->SplitPath(base_dir, relative_path, full_path, &is_file))
+            return 1;
+        if (is_file)
+            continue;
+
+        trees.push_back({ add, base_dir });
+        if (!add->ListDirectory(full_path, trees.back().paths, NULL))
+            return 1;
+        file_count += trees.back().paths.size();
+    }
+
+    if (!file_count)
+    {
+        ConsolePrintf(RED, "No directory ADD operations with files in %s to benchmark\n", g_ConfigName);
+        return 1;
+    }
+
+    g_IniLogOperations = false;
+    threads = threads > 0 ? threads : max(g_IniAsyncIOThreads, 2);
+    passes = max(passes, 1);
+
+    // pass 0 only warms the OS file cache so neither mode reads from a colder disk, the modes then alternate
+    long long elapsed[2] = { 0, 0 };
+    uint64_t total_size = 0;
+    for (int pass = 0; pass <= passes; pass++)
+    {
+        for (int batched = 0; batched < 2; batched++)
+        {
+            g_IniAsyncIOThreads = batched ? threads : 0;
+
+            ZipFileList file_list;
+            bool success = true;
+            auto start = std::chrono::steady_clock::now();
+            for (AddTree& tree : trees)
+            {
+                if (batched)
+                {
+                    success = tree.operation->AddFiles(tree.paths, tree.base_dir.c_str(), file_list) && success;
+                    continue;
+                }
+
+                for (std::string& path : tree.paths)
+                    success = tree.operation->AddFile(path.c_str(), tree.base_dir.c_str(), file_list) && success;
+            }
+            long long pass_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            total_size = 0;
+            for (ZipFile& zip_file : file_list)
+            {
+                total_size += zip_file.size;
+                zip_file.Destroy();
+            }
+
+            if (!success)
+                return 1;
+            if (pass)
+                elapsed[batched] += pass_time;
+        }
+    }
+
+    const double mb = 1024.0 * 1024.0;
+    ConsolePrintf(WHITE, "%llu files, %.1f MB in %llu ADD trees, %d passes\n",
+        (uint64_t)file_count, total_size / mb, (uint64_t)trees.size(), passes);
+    for (int batched = 0; batched < 2; batched++)
+    {
+        double seconds = max(elapsed[batched] / 1000000.0 / passes, 0.000001);
+        ConsolePrintf(batched ? GREEN : WHITE, "AsyncIOThreads=%d: %.1f ms per pass, %.0f files/s, %.1f MB/s\n",
+            batched ? threads : 0, seconds * 1000.0, file_count / seconds, total_size / mb / seconds);
+    }
+    return 0;
+}
+
+// client reads are modelled as whole aligned windows, like the read-ahead of the filesystem
+struct PakReadStats
+{
+    void Read(uint64_t offset, uint64_t length)
+    {
+        uint64_t first = offset / m_Window;
+        uint64_t last = (offset + max(length, (uint64_t)1) - 1) / m_Window;
+        for (uint64_t window = first; window <= last; window++)
+        {
+            if (m_Reads && window == m_LastWindow)
+                continue;
+
+            if (m_Reads && window != m_LastWindow + 1)
+            {
+                m_Seeks++;
+                m_SeekDistance += (window > m_LastWindow ? window - m_LastWindow - 1 : m_LastWindow + 1 - window) * m_Window;
+            }
+
+            m_Reads++;
+            m_LastWindow = window;
+        }
+    }
+
+    uint64_t m_Window = 64 * 1024;
+    uint64_t m_LastWindow = 0;
+    uint64_t m_Reads = 0;
+    uint64_t m_Seeks = 0;
+    uint64_t m_SeekDistance = 0;
+};
+
+// Measures the reads and seeks a client makes resolving a map's pak entries in the order of a load
+// list, one pak path per line as recorded from a client loading the map. The list drives both the pak
+// as stored and the pak as OrderPakFile would lay it out, and the stored layout is also read back
+// unbuffered. Without a list only the unbuffered time of reading every entry by path is reported,
+// run it on the original and on an ordered temp map to compare
+static int RunPakBenchmark(const char* bspname, const char* load_list)
+{
+    if (!ParseIni())
+        return 1;
+
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, bspname, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", bspname);
+        mz_stream_os_delete(&bsp_stream);
+        return 1;
+    }
+
+    // each entry spans its local header, name, extra field and data
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> lengths;
+    std::vector<PakOrderKey> keys;
+    std::unordered_map<std::string, size_t> entries; // lowercase path to entry
+    bool success = false;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) == sizeof(header) && header.ident == IDBSPHEADER)
+    {
+        BSPLump& pak_file = header.lumps[LUMP_PAKFILE];
+        LumpStream pak_read(bsp_stream, pak_file.offset, pak_file.length);
+
+        void* zip_read = mz_zip_create();
+        if (mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK)
+        {
+            success = true;
+            for (int32_t err = mz_zip_goto_first_entry(zip_read); success && err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+            {
+                mz_zip_file* file_info = nullptr;
+                if (mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK)
+                    continue;
+
+                int64_t data_offset = 0;
+                success = GetEntryDataOffset(bsp_stream, pak_file.offset, file_info, &data_offset);
+
+                keys.emplace_back();
+                keys.back().Init(file_info->filename, (size_t)file_info->uncompressed_size);
+                entries[keys.back().directory + "/" + keys.back().name] = keys.size() - 1;
+                offsets.push_back((uint64_t)pak_file.offset + file_info->disk_offset);
+                lengths.push_back((uint64_t)(data_offset - offsets.back() + file_info->compressed_size));
+            }
+            mz_zip_close(zip_read);
+        }
+        mz_zip_delete(&zip_read);
+    }
+
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+
+    if (!success)
+    {
+        ConsolePrintf(RED, "Failed to read pak file of %s\n", bspname);
+        return 1;
+    }
+
+    // each entry is read the first time the list names it
+    std::vector<size_t> trace;
+    if (load_list)
+    {
+        FILE* list = fopen(load_list, "r");
+        if (!list)
+        {
+            ConsolePrintf(RED, "Failed to open load list %s\n", load_list);
+            return 1;
+        }
+
+        std::vector<bool> loaded(keys.size(), false);
+        char line[_MAX_PATH];
+        while (fgets(line, sizeof(line), list))
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            if (line[0] == ';' || !line[0])
+                continue;
+
+            FixSlashes(line);
+            std::string path = line;
+            for (char& c : path)
+                c = (char)tolower((uint8_t)c);
+            if (path.find('/') == std::string::npos)
+                path = "/" + path;
+
+            auto it = entries.find(path);
+            if (it != entries.end() && !loaded[it->second])
+            {
+                loaded[it->second] = true;
+                trace.push_back(it->second);
+            }
+        }
+        fclose(list);
+
+        if (trace.empty())
+        {
+            ConsolePrintf(RED, "None of the paths in %s are in the pak file of %s\n", load_list, bspname);
+            return 1;
+        }
+    }
+    else
+    {
+        std::vector<std::pair<std::string, size_t>> paths(entries.begin(), entries.end());
+        std::sort(paths.begin(), paths.end());
+        for (auto& path : paths)
+            trace.push_back(path.second);
+    }
+
+    PakReadStats stored;
+    for (size_t i : trace)
+        stored.Read(offsets[i], lengths[i]);
+
+    // the same entries packed back to back in OrderPakFile order, read in the list's order
+    std::vector<size_t> layout;
+    GetPakOrder(keys, layout);
+    std::vector<uint64_t> ordered_offsets(keys.size());
+    uint64_t offset = header.lumps[LUMP_PAKFILE].offset;
+    for (size_t i : layout)
+    {
+        ordered_offsets[i] = offset;
+        offset += lengths[i];
+    }
+
+    PakReadStats ordered;
+    for (size_t i : trace)
+        ordered.Read(ordered_offsets[i], lengths[i]);
+
+    // replay the stored reads past the file cache
+    HANDLE file = CreateFile(bspname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+    char* window = (char*)VirtualAlloc(NULL, (SIZE_T)stored.m_Window, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    double seconds = -1.0;
+    if (file != INVALID_HANDLE_VALUE && window)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t last_window = UINT64_MAX;
+        for (size_t i : trace)
+        {
+            uint64_t first = offsets[i] / stored.m_Window;
+            uint64_t last = (offsets[i] + max(lengths[i], (uint64_t)1) - 1) / stored.m_Window;
+            for (uint64_t w = first; w <= last; w++)
+            {
+                if (w == last_window)
+                    continue;
+
+                OVERLAPPED overlapped = { 0 };
+                uint64_t position = w * stored.m_Window;
+                overlapped.Offset = (DWORD)position;
+                overlapped.OffsetHigh = (DWORD)(position >> 32);
+                DWORD read;
+                ReadFile(file, window, (DWORD)stored.m_Window, &read, &overlapped);
+                last_window = w;
+            }
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (window)
+        VirtualFree(window, 0, MEM_RELEASE);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+
+    ConsolePrintf(WHITE, "Pak file of %s: %llu entries, %.1f MB, %llu entries read %s\n", bspname,
+        (uint64_t)keys.size(), header.lumps[LUMP_PAKFILE].length / (1024.0 * 1024.0), (uint64_t)trace.size(),
+        load_list ? "in load list order" : "by path");
+    if (seconds >= 0.0)
+        ConsolePrintf(WHITE, "\tunbuffered: %.1f ms\n", seconds * 1000.0);
+    else
+        ConsolePrintf(YELLOW, "\tunbuffered: failed to open %s without buffering\n", bspname);
+
+    if (load_list)
+    {
+        ConsolePrintf(WHITE, "\tas stored:  %llu reads, %llu seeks, %.1f MB seek distance\n",
+            stored.m_Reads, stored.m_Seeks, stored.m_SeekDistance / (1024.0 * 1024.0));
+        ConsolePrintf(GREEN, "\tif ordered: %llu reads, %llu seeks, %.1f MB seek distance\n",
+            ordered.m_Reads, ordered.m_Seeks, ordered.m_SeekDistance / (1024.0 * 1024.0));
+    }
+    return 0;
+}
+
+// lists the stored entries of a BSP's pak whose data doesn't start on the alignment boundary
+static int RunCheckAlign(const char* bspname, int alignment)
+{
+    if (alignment <= 0)
+    {
+        ConsolePrintf(RED, "Alignment must be above 0\n");
+        return 1;
+    }
+
+    void* bsp_stream = mz_stream_os_create();
+    if (mz_stream_open(bsp_stream, bspname, MZ_OPEN_MODE_READ) != MZ_OK)
+    {
+        ConsolePrintf(RED, "Failed to open %s\n", bspname);
+        mz_stream_os_delete(&bsp_stream);
+        return 1;
+    }
+
+    bool success = false;
+    uint64_t stored = 0;
+    uint64_t misaligned = 0;
+    uint64_t mismatched = 0;
+    uint64_t padding = 0;
+    BSPHeader header;
+    if (mz_stream_read(bsp_stream, &header, sizeof(header)) == sizeof(header) && header.ident == IDBSPHEADER)
+    {
+        BSPLump& pak_file = header.lumps[LUMP_PAKFILE];
+        LumpStream pak_read(bsp_stream, pak_file.offset, pak_file.length);
+
+        void* zip_read = mz_zip_create();
+        if (mz_zip_open(zip_read, &pak_read, MZ_OPEN_MODE_READ) == MZ_OK)
+        {
+            success = true;
+            for (int32_t err = mz_zip_goto_first_entry(zip_read); success && err == MZ_OK; err = mz_zip_goto_next_entry(zip_read))
+            {
+                mz_zip_file* file_info = nullptr;
+                if (mz_zip_entry_get_info(zip_read, &file_info) != MZ_OK)
+                    continue;
+
+                if (file_info->compression_method != MZ_COMPRESS_METHOD_STORE || !file_info->uncompressed_size)
+                    continue;
+
+                int64_t data_offset = 0;
+                uint16_t extra_size = 0;
+                success = GetEntryDataOffset(bsp_stream, pak_file.offset, file_info, &data_offset, &extra_size);
+                stored++;
+                padding += extra_size;
+                if (success && data_offset % alignment)
+                {
+                    ConsolePrintf(YELLOW, "\t%s at %lld (%lld past the boundary)\n", file_info->filename, data_offset, data_offset % alignment);
+                    misaligned++;
+                }
+                if (success && extra_size != file_info->extrafield_size)
+                {
+                    ConsolePrintf(YELLOW, "\t%s has a %u byte local extra field but %u bytes in the central directory\n",
+                        file_info->filename, (uint32_t)extra_size, (uint32_t)file_info->extrafield_size);
+                    mismatched++;
+                }
+            }
+            mz_zip_close(zip_read);
+        }
+        mz_zip_delete(&zip_read);
+    }
+
+    mz_stream_close(bsp_stream);
+    mz_stream_os_delete(&bsp_stream);
+
+    if (!success)
+    {
+        ConsolePrintf(RED, "Failed to read pak file of %s\n", bspname);
+        return 1;
+    }
+
+    ConsolePrintf(misaligned ? RED : GREEN, "%llu of %llu stored entries in %s are not aligned to %d bytes (%llu KB of padding)\n",
+        misaligned, stored, bspname, alignment, padding / 1024);
+    if (mismatched)
+        ConsolePrintf(RED, "%llu stored entries have different local and central extra fields\n", mismatched);
+    return misaligned || mismatched ? 1 : 0;
+}
+
+// operates on the maps of one shard written by OperateShards and reports back through a result manifest
+static int RunWorker(const char* shard_path)
+{
+    ConsolePrintf(AQUA, "Running as worker for %s\n", shard_path);
+
+    FILE* shard = fopen(shard_path, "r");
+    if (!shard)
+    {
+        ConsolePrintf(RED, "Failed to open shard %s\n", shard_path);
+        return 1;
+    }
+
+    std::vector<MapJob> jobs;
+    static char config_path[_MAX_PATH] = { 0 };
+    char work_dir[_MAX_PATH] = { 0 };
+    char output[_MAX_PATH] = { 0 };
+    int memory_budget = -1;
+    char line[_MAX_PATH + 64];
+    while (fgets(line, sizeof(line), shard))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == ';' || !line[0])
+            continue;
+
+        if (!strncmp(line, "Config=", 7))
+        {
+            strncpy(config_path, line + 7, sizeof(config_path) - 1);
+        }
+        else if (!strncmp(line, "Directory=", 10))
+        {
+            strncpy(work_dir, line + 10, sizeof(work_dir) - 1);
+        }
+        else if (!strncmp(line, "Output=", 7))
+        {
+            strncpy(output, line + 7, sizeof(output) - 1);
+        }
+        else if (!strncmp(line, "MemoryBudget=", 13))
+        {
+            memory_budget = atoi(line + 13);
+        }
+        else if (!strncmp(line, "Map=", 4))
+        {
+            char* bspname = strchr(line + 4, ' ');
+            if (!bspname)
+                continue;
+
+            jobs.emplace_back();
+            jobs.back().id = strtoull(line + 4, NULL, 10);
+            jobs.back().bspname = bspname + 1;
+        }
+    }
+    fclose(shard);
+
+    // relative paths in the config resolve against the coordinator's directory, so the worker runs from there
+    if (work_dir[0] && _chdir(work_dir))
+    {
+        ConsolePrintf(RED, "Failed to enter %s, is it shared with this worker?\n", work_dir);
+        return 1;
+    }
+
+    if (config_path[0])
+        g_ConfigName = config_path;
+
+    if (!ParseIni() || !PlanOperations())
+        return 1;
+
+    // the shard overrides settings the coordinator split between workers
+    if (output[0])
+        strncpy(g_MapTempPath, output, sizeof(g_MapTempPath) - 1);
+    if (memory_budget >= 0)
+        g_IniMemoryBudget = memory_budget;
+
+    InitMemoryBudget();
+
+    if (g_IniLogFile[0] && !g_Logger.OpenFile(g_IniLogFile))
+        ConsolePrintf(YELLOW, "Failed to open log file %s\n", g_IniLogFile);
+
+    _mkdir(g_MapTempPath);
+    bool success = g_UGCWrapper.OperateJobs(jobs);
+
+    // written under a temporary name first so the coordinator never reads a partial manifest
+    char result_path[_MAX_PATH];
+    char temp_path[_MAX_PATH];
+    strcpy(result_path, shard_path);
+    char* extension = strrchr(result_path, '.');
+    if (extension)
+        *extension = '\0';
+    strcat(result_path, ".result");
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", result_path);
+
+    FILE* result = fopen(temp_path, "w");
+    if (!result)
+    {
+        ConsolePrintf(RED, "Failed to write result manifest %s\n", result_path);
+        return 1;
+    }
+
+    for (MapJob& job : jobs)
+    {
+        if (job.done)
+            fprintf(result, "OK\t%s\t%s\n", job.bspname.c_str(), job.temp_map.c_str());
+        else if (job.skipped)
+            fprintf(result, "SKIPPED\t%s\n", job.bspname.c_str());
+        else
+            fprintf(result, "FAILED\t%s\n", job.bspname.c_str());
+    }
+    fclose(result);
+
+    if (!MoveFileEx(temp_path, result_path, MOVEFILE_REPLACE_EXISTING))
+    {
+        ConsolePrintf(RED, "Failed to write result manifest %s\n", result_path);
+        return 1;
+    }
+
+    ConsolePrintf(success ? GREEN : RED, "Worker finished %s\n", shard_path);
+    return success ? 0 : 1;
+}
+
+static bool OpenJournal()
+{
+    GetTempPath(sizeof(g_MapTempPath), g_MapTempPath);
+    FixSlashes(g_MapTempPath);
+    strcat(g_MapTempPath, "maps/");
+    _mkdir(g_MapTempPath);
+
+    char journal_path[_MAX_PATH];
+    snprintf(journal_path, sizeof(journal_path), "%sjournal.txt", g_MapTempPath);
+
+    strcat(g_MapTempPath, "workshop/");
+    _mkdir(g_MapTempPath);
+
+    return g_Journal.Open(journal_path, HashConfig());
+}
+
+struct WatchedDirectory
+{
+    OperationAdd* operation;
+    std::string path;
+    std::string base_dir;
+    std::string file; // set if the ADD names a single file
+    HANDLE handle;
+    HANDLE event;
+    OVERLAPPED overlapped;
+    DWORD buffer[16 * 1024];
+};
+
+// re-runs the ADD operations on just the changed files against the temp maps of the previous run
+struct Watcher
+{
+    ~Watcher()
+    {
+        for (WatchedDirectory* directory : m_Directories)
         {
-            ConsolePrintf(RED, "Bad path for map %llu (%s)\n", id, map_path);
-            m_Done = m_Error = true;
-            return;
+            CancelIo(directory->handle);
+            CloseHandle(directory->handle);
+            CloseHandle(directory->event);
+            delete directory;
         }
-        map_name++;
+    }
 
-        if (!g_SteamUGC->SetItemContent(m_UploadHandle, map_path) ||
-            !g_SteamUGC->SetItemMetadata(m_UploadHandle, map_name))
+    bool Init()
+    {
+        char path[_MAX_PATH];
+        snprintf(path, sizeof(path), "%s*.bsp", g_MapTempPath);
+        WIN32_FIND_DATA find_data;
+        HANDLE find = FindFirstFile(path, &find_data);
+        if (find != INVALID_HANDLE_VALUE)
         {
-            ConsolePrintf(RED, "Failed to set map data for %llu (%s)\n", id, map_path);
-            m_Done = m_Error = true;
-            return;
+            do
+            {
+                snprintf(path, sizeof(path), "%s%s", g_MapTempPath, find_data.cFileName);
+                m_Maps.emplace_back(path);
+            }
+            while (FindNextFile(find, &find_data) != 0);
+            FindClose(find);
         }
 
-        m_Call = g_SteamUGC->SubmitItemUpdate(m_UploadHandle, g_IniChangeNote[0] ? g_IniChangeNote : NULL);
-        if (m_Call == k_uAPICallInvalid)
+        if (m_Maps.empty())
         {
-            ConsolePrintf(RED, "Failed to send Steam Upload message\n");
-            m_Done = m_Error = true;
-            return;
+            ConsolePrintf(RED, "No temporary maps in %s, run the tool once without -watch first\n", g_MapTempPath);
+            return false;
         }
 
-        m_UploadCallback.Set(m_Call, this, &UGCWrapper::CallbackUpload);
+        for (OperationBase* operation : g_IniOperations)
+        {
+            if (strcmp(operation->m_Name, "ADD"))
+                continue;
+
+            char base_dir[_MAX_PATH];
+            char relative_path[_MAX_PATH];
+            char full_path[_MAX_PATH];
+            bool is_file;
+            if (!((OperationAdd*)operation)->SplitPath(base_dir, relative_path, full_path, &is_file))
+                return false;
+
+            WatchedDirectory* directory = new WatchedDirectory();
+            directory->operation = (OperationAdd*)operation;
+            directory->base_dir = base_dir;
+            directory->path = full_path;
+            if (is_file)
+            {
+                directory->file = full_path;
+                directory->path.resize(directory->path.rfind('/'));
+            }
+            else if (directory->path.back() == '/')
+            {
+                directory->path.pop_back();
+            }
+
+            directory->handle = CreateFile(directory->path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+            directory->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+            m_Directories.push_back(directory);
+
+            if (directory->handle == INVALID_HANDLE_VALUE || !Listen(directory))
+            {
+                ConsolePrintf(RED, "Failed to watch %s (error: %d)\n", directory->path.c_str(), GetLastError());
+                return false;
+            }
+        }
+
+        if (m_Directories.empty())
+        {
+            ConsolePrintf(RED, "No ADD operations to watch in %s\n", g_ConfigName);
+            return false;
+        }
+
+        if (m_Directories.size() > 64)
+        {
+            ConsolePrintf(RED, "Can't watch more than 64 ADD operations at once\n");
+            return false;
+        }
+
+        return true;
     }
 
-    void UploadAll()
+    bool Listen(WatchedDirectory* directory)
     {
-        m_Done = false;
-        m_UploadHandle = k_UGCUpdateHandleInvalid;
-        m_Uploaded = 0;
-        Upload(m_Files[0].m_nPublishedFileId);
+        ResetEvent(directory->event);
+        directory->overlapped = { 0 };
+        directory->overlapped.hEvent = directory->event;
+        return ReadDirectoryChangesW(directory->handle, directory->buffer, sizeof(directory->buffer), directory->file.empty(),
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE, NULL, &directory->overlapped, NULL) != 0;
     }
 
-    void PurgeUnused()
+    void Collect(WatchedDirectory* directory)
     {
-        for (int i = (int)m_Files.size() - 1; i >= 0; i--)
-            if (!IsElementInVector(g_IniMaps, m_Files[i].m_nPublishedFileId))
-                EraseElement(m_Files, i);
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(directory->handle, &directory->overlapped, &bytes, FALSE) || !bytes)
+        {
+            // the notification buffer overflowed, every file of this operation has to be assumed changed
+            ConsolePrintf(YELLOW, "Too many changes in %s, re-adding all of it\n", directory->path.c_str());
+            m_Changes.emplace_back(directory, directory->file.empty() ? directory->path : directory->file);
+            return;
+        }
+
+        uint8_t* p = (uint8_t*)directory->buffer;
+        while (true)
+        {
+            FILE_NOTIFY_INFORMATION* info = (FILE_NOTIFY_INFORMATION*)p;
+
+            char name[_MAX_PATH];
+            int len = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(wchar_t), name, sizeof(name) - 1, NULL, NULL);
+            name[len] = '\0';
+            FixSlashes(name);
+
+            std::string path = directory->path + "/" + name;
+            if (directory->file.empty() || path == directory->file)
+            {
+                if (info->Action == FILE_ACTION_REMOVED || info->Action == FILE_ACTION_RENAMED_OLD_NAME)
+                    ConsolePrintf(YELLOW, "%s was deleted, it stays in the maps until the next full run\n", path.c_str());
+                else
+                    m_Changes.emplace_back(directory, path);
+            }
+
+            if (!info->NextEntryOffset)
+                break;
+            p += info->NextEntryOffset;
+        }
     }
 
-    SteamAPICall_t m_Call;
-    CCallResult<UGCWrapper, SteamUGCQueryCompleted_t> m_QueryCallback;
-    CCallback<UGCWrapper, DownloadItemResult_t, false> m_DownloadCallback;
-    CCallResult<UGCWrapper, SubmitItemUpdateResult_t> m_UploadCallback;
-    std::vector<SteamUGCDetails_t> m_Files;
-    std::vector<std::string> m_TempMaps;
+    void Run()
+    {
+        ConsolePrintf(PURPLE, "Watching %llu ADD sources for %llu maps. Press any key to stop.\n",
+            (uint64_t)m_Directories.size(), (uint64_t)m_Maps.size());
+        g_Logger.Flush();
 
-    UGCQueryHandle_t m_QueryHandle;
-    uint32_t m_Page;
+        std::vector<HANDLE> events;
+        for (WatchedDirectory* directory : m_Directories)
+            events.push_back(directory->event);
 
-    PublishedFileId_t m_DownloadID;
-    size_t m_Downloaded;
+        auto last_change = std::chrono::steady_clock::now();
+        while (true)
+        {
+            DWORD wait = WaitForMultipleObjects((DWORD)events.size(), events.data(), FALSE, 100);
+            if (wait < WAIT_OBJECT_0 + events.size())
+            {
+                WatchedDirectory* directory = m_Directories[wait - WAIT_OBJECT_0];
+                Collect(directory);
+                if (!Listen(directory))
+                    ConsolePrintf(RED, "Stopped watching %s (error: %d)\n", directory->path.c_str(), GetLastError());
+                last_change = std::chrono::steady_clock::now();
+                continue;
+            }
 
-    UGCUpdateHandle_t m_UploadHandle;
-    size_t m_Uploaded;
+            if (_kbhit())
+            {
+                _getch();
+                break;
+            }
 
-    char m_LastTempMap[_MAX_PATH];
-    bool m_Done;
-    bool m_Error;
+            // editors tend to save in several steps, wait for them to settle
+            if (!m_Changes.empty() && std::chrono::steady_clock::now() - last_change > std::chrono::milliseconds(500))
+            {
+                Patch();
+                m_Changes.clear();
+                g_Logger.Flush();
+            }
+        }
+    }
+
+    void Patch()
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        // directories may have gained files since they were last listed
+        g_Manifests.Reset();
+
+        // same order as the config so a later REMOVE still wins over an ADD
+        std::vector<OperationBase*> operations;
+        std::vector<OperationAdd*> owned;
+        for (OperationBase* operation : g_IniOperations)
+        {
+            // entity edits were already applied to the temp maps
+            if (!strcmp(operation->m_Name, "REMOVE"))
+            {
+                operations.push_back(operation);
+                continue;
+            }
+            if (strcmp(operation->m_Name, "ADD"))
+                continue;
+
+            std::vector<std::string> added;
+            for (std::pair<WatchedDirectory*, std::string>& change : m_Changes)
+            {
+                if (change.first->operation != operation || IsElementInVector(added, change.second))
+                    continue;
+
+                DWORD attributes = GetFileAttributes(change.second.c_str());
+                if (attributes == INVALID_FILE_ATTRIBUTES || ((attributes & FILE_ATTRIBUTE_DIRECTORY) && change.second != change.first->path))
+                    continue;
+
+                added.push_back(change.second);
+
+                char value[512];
+                snprintf(value, sizeof(value), "%s/%s", change.first->base_dir.c_str(), change.second.c_str() + change.first->base_dir.size());
+                owned.push_back(new OperationAdd(value));
+                operations.push_back(owned.back());
+            }
+        }
+
+        if (owned.empty())
+            return;
+
+        ConsolePrintf(PURPLE, "%llu files changed, patching %llu maps...\n", (uint64_t)owned.size(), (uint64_t)m_Maps.size());
+
+        std::vector<MapJob> jobs(m_Maps.size());
+        std::vector<uint64_t> old_sizes(m_Maps.size());
+        std::vector<uint32_t> old_crcs(m_Maps.size());
+        for (size_t i = 0; i < m_Maps.size(); i++)
+        {
+            jobs[i].bspname = m_Maps[i];
+            jobs[i].id = 0;
+            HashFile(m_Maps[i].c_str(), &old_sizes[i], &old_crcs[i]);
+
+            // a delta from the last full run would still apply and rebuild the unpatched map
+            std::string delta_path = m_Maps[i] + ".delta";
+            if (DeleteFile(delta_path.c_str()))
+                ConsolePrintf(YELLOW, "Deleted %s, it no longer matches the patched map\n", delta_path.c_str());
+        }
+
+        // untouched entries of the previous output are copied raw, only the changed files get compressed
+        std::vector<OperationBase*> config_operations;
+        config_operations.swap(g_IniOperations);
+        g_IniOperations = operations;
+        OperationPlan config_plan = std::move(g_OperationPlan);
+
+        bool success = PlanOperations() && g_UGCWrapper.OperateJobs(jobs);
+
+        g_IniOperations.swap(config_operations);
+        g_OperationPlan = std::move(config_plan);
+        for (OperationAdd* operation : owned)
+            delete operation;
+
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            uint64_t size;
+            uint32_t crc;
+            if (jobs[i].done && HashFile(jobs[i].temp_map.c_str(), &size, &crc))
+                g_Journal.ReplaceOutput(old_sizes[i], old_crcs[i], size, crc);
+        }
+
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        if (success)
+            ConsolePrintf(GREEN, "Patched %llu maps in %lld ms\n", (uint64_t)jobs.size(), elapsed);
+        else
+            ConsolePrintf(RED, "Failed to patch some maps, fix the errors above and save again\n");
+    }
+
+    std::vector<WatchedDirectory*> m_Directories;
+    std::vector<std::pair<WatchedDirectory*, std::string>> m_Changes;
+    std::vector<std::string> m_Maps;
 };
 
-UGCWrapper g_UGCWrapper;
+static int RunWatch()
+{
+    if (!ParseIni() || !PlanOperations())
+        return 1;
 
-static bool IsUGCQueryFinished()
+    InitMemoryBudget();
+
+    if (g_IniLogFile[0] && !g_Logger.OpenFile(g_IniLogFile))
+        ConsolePrintf(YELLOW, "Failed to open log file %s\n", g_IniLogFile);
+
+    if (!OpenJournal())
+        return 1;
+
+    // maps are patched in place, so they have to be read fully before being rewritten
+    g_IniStreamPakFile = false;
+    g_IniRecompressPakFile = false;
+    g_IniWritePakFile = true;
+
+    Watcher watcher;
+    if (!watcher.Init())
+        return 1;
+
+    watcher.Run();
+    ConsolePrintf(AQUA, "Stopped watching. Run the tool normally to verify and upload the patched maps.\n");
+    return 0;
+}
+
+static int PerformUGCWork()
 {
-    return g_UGCWrapper.m_Done;
+    if (!OpenJournal())
+        return 1;
+    if (!FindUGCMaps())
+        return 1;
+
+    // maps that did download are still operated, the next run retries the rest
+    bool downloaded = !g_IniDownloadMaps || DownloadUGCMaps();
+    if (g_IniOperateMaps && !OperateUGCMaps())
+        return 1;
+    if (!downloaded)
+        return 1;
+    if (g_IniUploadMaps && !UploadUGCMaps())
+        return 1;
+
+    g_Journal.Clear();
+    return 0;
 }
 
-static bool IsUGCDownloadFinished()
+// [Tool] settings as they were before any config was read, restored before
+// each daemon job so one job's config doesn't leak into the next
+struct IniDefaults
 {
-    if (g_UGCWrapper.m_Done)
-        return true;
+    void Save()
+    {
+        Add(&g_IniDownloadMaps, sizeof(g_IniDownloadMaps));
+        Add(&g_IniLogOperations, sizeof(g_IniLogOperations));
+        Add(&g_IniOperateMaps, sizeof(g_IniOperateMaps));
+        Add(&g_IniPrintPakFile, sizeof(g_IniPrintPakFile));
+        Add(&g_IniCompressPakFile, sizeof(g_IniCompressPakFile));
+        Add(&g_IniCompressionLevel, sizeof(g_IniCompressionLevel));
+        Add(&g_IniWritePakFile, sizeof(g_IniWritePakFile));
+        Add(&g_IniUploadMaps, sizeof(g_IniUploadMaps));
+        Add(&g_IniStreamPakFile, sizeof(g_IniStreamPakFile));
+        Add(&g_IniStreamMemoryLimit, sizeof(g_IniStreamMemoryLimit));
+        Add(&g_IniMemoryBudget, sizeof(g_IniMemoryBudget));
+        Add(&g_IniOperateThreads, sizeof(g_IniOperateThreads));
+        Add(&g_IniRecompressPakFile, sizeof(g_IniRecompressPakFile));
+        Add(&g_IniAsyncIOThreads, sizeof(g_IniAsyncIOThreads));
+        Add(&g_IniWalkThreads, sizeof(g_IniWalkThreads));
+        Add(&g_IniReuseManifest, sizeof(g_IniReuseManifest));
+        Add(&g_IniPlanOperations, sizeof(g_IniPlanOperations));
+        Add(&g_IniWriteDelta, sizeof(g_IniWriteDelta));
+        Add(&g_IniOrderPakFile, sizeof(g_IniOrderPakFile));
+        Add(&g_IniOrderSmallSize, sizeof(g_IniOrderSmallSize));
+        Add(&g_IniAlignStoredFiles, sizeof(g_IniAlignStoredFiles));
+        Add(&g_IniMapAddThreshold, sizeof(g_IniMapAddThreshold));
+        Add(&g_IniReuseLZMAContexts, sizeof(g_IniReuseLZMAContexts));
+        Add(&g_IniLogFile, sizeof(g_IniLogFile));
+        Add(&g_IniWorkers, sizeof(g_IniWorkers));
+        Add(&g_IniLaunchWorkers, sizeof(g_IniLaunchWorkers));
+        Add(&g_IniWorkerDir, sizeof(g_IniWorkerDir));
+        Add(&g_IniWorkerTimeout, sizeof(g_IniWorkerTimeout));
+        Add(&g_IniDecompressThreads, sizeof(g_IniDecompressThreads));
+        Add(&g_IniVerifyMaps, sizeof(g_IniVerifyMaps));
+        Add(&g_IniMaxMapSize, sizeof(g_IniMaxMapSize));
+        Add(&g_IniMaxMapSizeAbort, sizeof(g_IniMaxMapSizeAbort));
+        Add(&g_IniEstimateBlocks, sizeof(g_IniEstimateBlocks));
+        Add(&g_IniTuneSampleSize, sizeof(g_IniTuneSampleSize));
+        Add(&g_IniTuneSizeTarget, sizeof(g_IniTuneSizeTarget));
+        Add(&g_IniTuneTimeBudget, sizeof(g_IniTuneTimeBudget));
+        Add(&g_IniVerifyThreads, sizeof(g_IniVerifyThreads));
+        Add(&g_IniUploadInterval, sizeof(g_IniUploadInterval));
+        Add(&g_IniUploadBurst, sizeof(g_IniUploadBurst));
+        Add(&g_IniUploadRetries, sizeof(g_IniUploadRetries));
+        Add(&g_IniUploadBackoff, sizeof(g_IniUploadBackoff));
+        Add(&g_IniFakeWorkshop, sizeof(g_IniFakeWorkshop));
+        Add(&g_IniFakeWorkshopLatency, sizeof(g_IniFakeWorkshopLatency));
+        Add(&g_IniFakeWorkshopFailRate, sizeof(g_IniFakeWorkshopFailRate));
+        Add(&g_IniDaemonCacheSize, sizeof(g_IniDaemonCacheSize));
+        Add(&g_IniDaemonMetadataTime, sizeof(g_IniDaemonMetadataTime));
+        Add(&g_IniChangeNote, sizeof(g_IniChangeNote));
+    }
 
-    uint64 bytes_downloaded = 0;
-    uint64 bytes_total = 0;
-    if (g_SteamUGC->GetItemDownloadInfo(g_UGCWrapper.m_DownloadID, &bytes_downloaded, &bytes_total))
-        ConsolePrintProgress(PURPLE, bytes_downloaded, bytes_total);
+    void Add(void* value, size_t size)
+    {
+        m_Values.emplace_back(value, std::vector<char>((char*)value, (char*)value + size));
+    }
 
-    return false;
+    void Restore()
+    {
+        for (auto& value : m_Values)
+            memcpy(value.first, value.second.data(), value.second.size());
+
+        for (OperationBase* operation : g_IniOperations)
+            delete operation;
+        g_IniOperations.clear();
+        g_IniMaps.clear();
+        g_IniLocalMaps.clear();
+        g_OperationPlan.Clear();
+    }
+
+    std::vector<std::pair<void*, std::vector<char>>> m_Values;
+};
+
+// runs one submitted config with Steam, the workshop listing and ADD sources still warm from earlier jobs
+static int RunDaemonJob(const char* work_dir, const char* config_path, IniDefaults& defaults)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    defaults.Restore();
+    g_Manifests.Reset();
+    g_UGCWrapper.m_Files.clear();
+    g_UGCWrapper.m_TempMaps.clear();
+    g_UGCWrapper.m_OutputMaps.clear();
+    g_UGCWrapper.m_Error = false;
+    g_AbortBatch = false;
+
+    char daemon_dir[_MAX_PATH];
+    _getcwd(daemon_dir, sizeof(daemon_dir));
+    if (_chdir(work_dir))
+    {
+        ConsolePrintf(RED, "Failed to enter %s\n", work_dir);
+        return 1;
+    }
+
+    g_ConfigName = config_path;
+    size_t cache_hits = g_FileCache.m_Hits;
+
+    int ret = 1;
+    if (ParseIni() && PlanOperations())
+    {
+        InitMemoryBudget();
+        g_FileCache.SetLimit((size_t)max(g_IniDaemonCacheSize, 0) * 1024 * 1024);
+
+        if (g_IniLogFile[0] && !g_Logger.OpenFile(g_IniLogFile))
+            ConsolePrintf(YELLOW, "Failed to open log file %s\n", g_IniLogFile);
+
+        ret = PerformUGCWork();
+    }
+
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ConsolePrintf(ret ? RED : GREEN, "Job finished in %lld ms (%llu ADD files from cache, %llu MB cached)\n",
+        elapsed, (uint64_t)(g_FileCache.m_Hits - cache_hits), (uint64_t)(g_FileCache.m_Total / (1024 * 1024)));
+
+    g_Logger.Flush();
+    g_Logger.CloseFile();
+    g_ConfigName = "config.ini";
+    _chdir(daemon_dir);
+    return ret;
 }
 
-static bool IsUGCUploadFinished()
+// Stays resident with Steam initialized and takes jobs from -submit over a named pipe, one at a time.
+// Output of the job is streamed back to the client, which also answers the upload confirmation
+static int RunDaemon()
 {
-    if (g_UGCWrapper.m_Done)
-        return true;
+    if (!SteamInit())
+        return 1;
 
-    uint64 bytes_uploaded = 0;
-    uint64 bytes_total = 0;
-    if (g_SteamUGC->GetItemUpdateProgress(g_UGCWrapper.m_UploadHandle, &bytes_uploaded, &bytes_total))
-        ConsolePrintProgress(PURPLE, bytes_uploaded, bytes_total);
+    ConsolePrintf(GREEN, "Initialized Steam as %s (%llu)\n", g_SteamFriends->GetPersonaName(), g_UserSteamID.ConvertToUint64());
+
+    IniDefaults defaults;
+    defaults.Save();
+    g_DaemonRunning = true;
+
+    ConsolePrintf(PURPLE, "Waiting for jobs on %s...\n", g_PipeName);
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    bool running = true;
+    while (running)
+    {
+        HANDLE pipe = CreateNamedPipe(g_PipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 64 * 1024, 64 * 1024, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            ConsolePrintf(RED, "Failed to create pipe %s (error: %d). Is another daemon running?\n", g_PipeName, GetLastError());
+            break;
+        }
+
+        // keep Steam callbacks flowing while idle
+        ResetEvent(overlapped.hEvent);
+        bool connected = ConnectNamedPipe(pipe, &overlapped) || GetLastError() == ERROR_PIPE_CONNECTED;
+        if (!connected && GetLastError() == ERROR_IO_PENDING)
+        {
+            while (WaitForSingleObject(overlapped.hEvent, 100) == WAIT_TIMEOUT)
+                SteamAPI_RunCallbacks();
 
-    return false;
-}
+            DWORD unused;
+            connected = GetOverlappedResult(pipe, &overlapped, &unused, FALSE) != 0;
+        }
 
-static bool FindUGCMaps()
-{
-    if (g_IniMaps.size() == 0)
-    {
-        if (g_IniLocalMaps.size() > 0)
+        char request[_MAX_PATH * 2 + 16];
+        size_t length = 0;
+        while (connected && length < sizeof(request) - 1 && PipeTransfer(pipe, false, &request[length], 1) && request[length] != '\n')
+            length++;
+        request[length] = '\0';
+
+        int32_t ret = 1;
+        char* config_path = strchr(request, '\t');
+        if (!connected || !length)
         {
-            g_IniDownloadMaps = false;
-            g_IniUploadMaps = false;
-            return true;
+            connected = false;
+        }
+        else if (!strcmp(request, "STOP"))
+        {
+            ConsolePrintf(PURPLE, "Stopping daemon\n");
+            ret = 0;
+            running = false;
+        }
+        else if (!strncmp(request, "JOB ", 4) && config_path)
+        {
+            *config_path++ = '\0';
+            ConsolePrintf(PURPLE, "Running %s in %s\n", config_path, request + 4);
+
+            g_Logger.Flush();
+            g_Logger.m_Pipe = pipe;
+            ret = RunDaemonJob(request + 4, config_path, defaults);
+            g_Logger.Flush();
+            g_Logger.m_Pipe = nullptr;
+        }
+        else
+        {
+            ConsolePrintf(RED, "Unrecognized request '%s'\n", request);
         }
 
-        ConsolePrintf(RED, "No map IDs defined in %s\n", g_ConfigName);
-        return false;
+        if (connected)
+        {
+            PipeWriteFrame(pipe, FRAME_EXIT, DEFAULT, &ret, sizeof(ret));
+            FlushFileBuffers(pipe);
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
     }
 
-    ConsolePrintf(PURPLE, "Finding owned workshop maps...\n");
-
-    g_UGCWrapper.EnumerateAll();
-    SleepUntilCondition(IsUGCQueryFinished, 100);
+    CloseHandle(overlapped.hEvent);
+    g_DaemonRunning = false;
+    SteamAPI_Shutdown();
+    return 0;
+}
 
-    ConsolePrintf(WHITE, "Found %u owned workshop maps\n", g_UGCWrapper.m_Files.size());
-    for (SteamUGCDetails_t& details : g_UGCWrapper.m_Files)
+// sends a config to the daemon and prints its output as if the job ran here
+static int RunSubmit(const char* config_path)
+{
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (int attempt = 0; attempt < 20; attempt++)
     {
-        if (details.m_eFileType != k_EWorkshopFileTypeCommunity)
-            continue;
+        pipe = CreateFile(g_PipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE)
+            break;
 
-        ConsoleColors clr = WHITE;
-        if (IsElementInVector(g_IniMaps, details.m_nPublishedFileId))
-            clr = AQUA;
-        ConsolePrintf(clr, "\t%s (%llu)\n", details.m_rgchTitle, details.m_nPublishedFileId);
+        // busy with another client's job, or between two jobs
+        if (GetLastError() == ERROR_PIPE_BUSY)
+            WaitNamedPipe(g_PipeName, NMPWAIT_WAIT_FOREVER);
+        else
+            Sleep(100);
     }
 
-    bool ok = !g_UGCWrapper.m_Error;
-    for (PublishedFileId_t id : g_IniMaps)
+    if (pipe == INVALID_HANDLE_VALUE)
     {
-        for (SteamUGCDetails_t& details : g_UGCWrapper.m_Files)
-            if (details.m_nPublishedFileId == id)
-                goto next;
-
-        ConsolePrintf(RED, "Failed to find workshop map %llu listed in %s\n", id, g_ConfigName);
-        ok = false;
-        next: {}
+        ConsolePrintf(RED, "No daemon is listening on %s. Start one with -daemon\n", g_PipeName);
+        return 1;
     }
 
-    g_UGCWrapper.PurgeUnused();
+    char request[_MAX_PATH * 2 + 16];
+    if (config_path)
+    {
+        char work_dir[_MAX_PATH];
+        char full_path[_MAX_PATH];
+        _getcwd(work_dir, sizeof(work_dir));
+        if (!_fullpath(full_path, config_path, sizeof(full_path)))
+        {
+            ConsolePrintf(RED, "Bad config path %s\n", config_path);
+            CloseHandle(pipe);
+            return 1;
+        }
+        snprintf(request, sizeof(request), "JOB %s\t%s\n", work_dir, full_path);
+    }
+    else
+    {
+        strcpy(request, "STOP\n");
+    }
 
-    if (g_UGCWrapper.m_Files.size() == 0)
+    DWORD written;
+    if (!WriteFile(pipe, request, (DWORD)strlen(request), &written, NULL))
     {
-        ConsolePrintf(RED, "ERROR: No owned workshop maps found!\n");
-        return false;
+        ConsolePrintf(RED, "Failed to send job to the daemon (error: %d)\n", GetLastError());
+        CloseHandle(pipe);
+        return 1;
     }
 
-    return ok;
-}
+    g_Logger.Flush();
 
-static bool DownloadUGCMaps()
-{
-    ConsolePrintf(PURPLE, "Downloading workshop maps to modify...\n");
+    int32_t ret = 1;
+    std::vector<char> payload;
+    while (true)
+    {
+        DaemonFrame frame;
+        DWORD read;
+        if (!ReadFile(pipe, &frame, sizeof(frame), &read, NULL) || read != sizeof(frame))
+        {
+            ConsolePrintf(RED, "Lost connection to the daemon\n");
+            break;
+        }
 
-    g_UGCWrapper.DownloadAll();
-    SleepUntilCondition(IsUGCDownloadFinished, 100);
-    return !g_UGCWrapper.m_Error;
-}
+        payload.resize(frame.length + 1);
+        DWORD received = 0;
+        while (received < frame.length && ReadFile(pipe, payload.data() + received, frame.length - received, &read, NULL) && read)
+            received += read;
+        payload[received] = '\0';
 
-static bool OperateUGCMaps()
-{
-    ConsolePrintf(PURPLE, "Operating on selected maps...\n");
+        if (frame.type == FRAME_EXIT)
+        {
+            if (received == sizeof(ret))
+                memcpy(&ret, payload.data(), sizeof(ret));
+            break;
+        }
 
-    g_UGCWrapper.OperateAll();
+        if (frame.type == FRAME_INPUT)
+        {
+            char input[256] = { 0 };
+            if (scanf("%255s", input) != 1)
+                strcpy(input, "abort");
+            strcat(input, "\n");
+            WriteFile(pipe, input, (DWORD)strlen(input), &written, NULL);
+            continue;
+        }
 
-    if (g_UGCWrapper.m_Error)
-        return false;
+        SetConsoleTextAttribute(g_Console, frame.color);
+        fputs(payload.data(), stdout);
+        SetConsoleTextAttribute(g_Console, DEFAULT);
+    }
 
-    ShellExecute(NULL, "open", g_MapTempPath, NULL, NULL, SW_SHOWDEFAULT);
-    return true;
+    CloseHandle(pipe);
+    return ret;
 }
 
-static bool UploadUGCMaps()
+int main(int argc, char* argv[])
 {
-    ConsolePrintf(RED, "*********************************************************\n");
-    ConsolePrintf(WHITE, "The next step uploads the modified maps to the workshop.\n");
-    ConsolePrintf(WHITE, "Before proceding, ensure you have reviewed one of the modified BSPs.\n");
-    ConsolePrintf(WHITE, "Copy paste any .bsp from the temp folder to your TF2 maps folder and check in-game to ensure it works as expected.\n");
-    ConsolePrintf(WHITE, "To continue, type in the text \"iamsure\". If something is wrong, type the text \"abort\".\n");
-    ConsolePrintf(YELLOW, "NOTE: TF2 won't launch if not currently open because Steam believes it's already running.\n");
-    ConsolePrintf(YELLOW, "      As a workaround, you can launch it manually through hl2.exe, for example through a .bat file\n");
-    ConsolePrintf(YELLOW, "      hl2.exe -game tf -steam -insecure\n");
-    ConsolePrintf(RED, "*********************************************************\n");
-
-    ShellExecute(NULL, "open", g_MapTempPath, NULL, NULL, SW_SHOWDEFAULT);
-
-    do
+	g_Console = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!g_Console)
     {
-        char input[256] = { 0 };
-        scanf("%s", input);
-
-        if (!strcmp(input, "abort"))
-            return false;
-        else if (!strcmp(input, "iamsure"))
-            break;
+        printf("Failed to get console handle\n");
+        return 1;
     }
-    while (true);
-
-    ConsolePrintf(PURPLE, "Uploading modified workshop maps...\n");
-
-    g_UGCWrapper.UploadAll();
-    SleepUntilCondition(IsUGCUploadFinished, 100);
 
-    return !g_UGCWrapper.m_Error;
-}
+    g_Logger.Start();
 
-static bool ParseIni()
-{
-    ConsolePrintf(WHITE, "Reading %s ...\n", g_ConfigName);
+    ConsolePrintf(AQUA, "Map Batch Updater by ficool2 (%s)\n", __DATE__);
 
-    FILE* ini = fopen(g_ConfigName, "r");
-    if (!ini)
+    for (int i = 1; i < argc - 1; i++)
     {
-        ConsolePrintf(RED, "Failed to open %s. Does the file exist?\n", g_ConfigName);
-        return false;
+        if (!strcmp(argv[i], "-worker"))
+            return RunWorker(argv[i + 1]);
     }
 
-    bool success = true;
-    enum IniSections
+    for (int i = 1; i < argc; i++)
     {
-        SECTION_INVALID = 1,
-        SECTION_MAPS,
-        SECTION_OPERATIONS,
-        SECTION_TOOL,
-    };
-    IniSections parse_section = SECTION_INVALID;
+        if (!strcmp(argv[i], "-watch"))
+        {
+            int ret = RunWatch();
+            ConsoleWaitForKey();
+            return ret;
+        }
 
-    char line[1024];
-    for (int line_counter = 0; fgets(line, sizeof(line), ini); line_counter++)
-    {
-        if (line[0] == '\0' || line[0] == ';' || line[0] == '\n' || line[0] == '\r')
-            continue;
+        if (!strcmp(argv[i], "-index"))
+        {
+            int ret = RunIndex();
+            g_Logger.Flush();
+            return ret;
+        }
 
-        line[strcspn(line, "\n")] = 0;
+        if (!strcmp(argv[i], "-tune"))
+        {
+            int ret = RunTune(i + 1 < argc && !strcmp(argv[i + 1], "apply"));
+            ConsoleWaitForKey();
+            return ret;
+        }
 
-        if (line[0] == '[')
+        if (!strcmp(argv[i], "-daemon"))
         {
-            if (!strnicmp(line, "[Maps]", 6))
-                parse_section = SECTION_MAPS;
-            else if (!strnicmp(line, "[Operations]", 12))
-                parse_section = SECTION_OPERATIONS;
-            else if (!strnicmp(line, "[Tool]", 6))
-                parse_section = SECTION_TOOL;
-            else
-            {
-                ConsolePrintf(RED, "%s: Unrecognized section '%s' on line %d\n", g_ConfigName, line, line_counter);
-                success = false;
-            }
-            continue;
+            int ret = RunDaemon();
+            g_Logger.Flush();
+            return ret;
         }
 
-        char* key = strtok(line, "=");
-        if (!key)
+        if (!strcmp(argv[i], "-submit") || !strcmp(argv[i], "-stopdaemon"))
         {
-            ConsolePrintf(RED, "%s: Missing token = on line %d\n", g_ConfigName, line_counter);
-            success = false;
-            continue;
+            const char* config_path = NULL;
+            if (!strcmp(argv[i], "-submit"))
+                config_path = i + 1 < argc ? argv[i + 1] : g_ConfigName;
+            int ret = RunSubmit(config_path);
+            g_Logger.Flush();
+            return ret;
         }
 
-        char* value = strtok(NULL, "=");
-        if (!value)
+        if (!strcmp(argv[i], "-checkplan"))
         {
-            ConsolePrintf(RED, "%s: Missing value on line %d\n", g_ConfigName, line_counter);
-            success = false;
-            continue;
+            int ret = RunCheckPlan();
+            ConsoleWaitForKey();
+            return ret;
         }
-        FixSlashes(value);
 
-        if (parse_section == SECTION_MAPS)
+        if (i + 1 < argc && !strcmp(argv[i], "-checkalign"))
         {
-            if (strspn(value, "0123456789") == strlen(value))
-                g_IniMaps.emplace_back(strtoull(value, NULL, 10));
-            else
-                g_IniLocalMaps.emplace_back(value);
+            int ret = RunCheckAlign(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 4096);
+            g_Logger.Flush();
+            return ret;
         }
-        else if (parse_section == SECTION_OPERATIONS)
+
+        if (i + 1 < argc && !strcmp(argv[i], "-benchpak"))
         {
-            if (!strcmp(key, "ADD"))
-                g_IniOperations.emplace_back(new OperationAdd(value));
-            else if (!strcmp(key, "REMOVE"))
-                g_IniOperations.emplace_back(new OperationRemove(value));
-            else
-            {
-                ConsolePrintf(RED, "%s: Unrecognized operation '%s' on line %d\n", g_ConfigName, value);
-                success = false;
-            }
+            int ret = RunPakBenchmark(argv[i + 1], i + 2 < argc ? argv[i + 2] : NULL);
+            g_Logger.Flush();
+            return ret;
         }
-        else if (parse_section == SECTION_TOOL)
+
+        if (i + 3 < argc && !strcmp(argv[i], "-applydelta"))
         {
-            if (!strcmp(key, "DownloadMaps"))
-                g_IniDownloadMaps = !!atoi(value);
-            else if (!strcmp(key, "LogOperations"))
-                g_IniLogOperations = !!atoi(value);
-            else if (!strcmp(key, "OperateMaps"))
-                g_IniOperateMaps = !!atoi(value);
-            else if (!strcmp(key, "PrintPakFile"))
-                g_IniPrintPakFile = !!atoi(value);
-            else if (!strcmp(key, "CompressPakFile"))
-                g_IniCompressPakFile = !!atoi(value);
-            else if (!strcmp(key, "CompressionLevel"))
-                g_IniCompressionLevel = atoi(value);
-            else if (!strcmp(key, "WritePakFile"))
-                g_IniWritePakFile = !!atoi(value);
-            else if (!strcmp(key, "UploadMaps"))
-                g_IniUploadMaps = !!atoi(value);
-            else if (!strcmp(key, "ChangeNote"))
-            {
-                if (!strcmp(value, "NULL"))
-                    g_IniChangeNote[0] = '\0';
-                else
-                    strncpy(g_IniChangeNote, value, sizeof(g_IniChangeNote));
-            }
-            else
-            {
-                ConsolePrintf(RED, "%s: Unrecognized debug key '%s' on line % d\n", g_ConfigName, value);
-                success = false;
-            }
+            int ret = RunApplyDelta(argv[i + 1], argv[i + 2], argv[i + 3]);
+            g_Logger.Flush();
+            return ret;
         }
-    }
 
-    fclose(ini);
-    return success;
-}
+        if (!strcmp(argv[i], "-fakeupload"))
+        {
+            int ret = RunFakeUpload();
+            ConsoleWaitForKey();
+            return ret;
+        }
 
-static int PerformUGCWork()
-{
-    if (!FindUGCMaps())
-        return 1;
-    if (g_IniDownloadMaps && !DownloadUGCMaps())
-        return 1;
-    if (g_IniOperateMaps && !OperateUGCMaps())
-        return 1;
-    if (g_IniUploadMaps && !UploadUGCMaps())
-        return 1;
-    return 0;
-}
+        if (i + 1 < argc && !strcmp(argv[i], "-benchlzma"))
+        {
+            int ret = RunLZMABenchmark(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 3);
+            g_Logger.Flush();
+            return ret;
+        }
 
-int main()
-{
-	g_Console = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (!g_Console)
-    {
-        printf("Failed to get console handle\n");
-        return 1;
-    }
+        if (!strcmp(argv[i], "-benchio"))
+        {
+            int ret = RunIOBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 0, i + 2 < argc ? atoi(argv[i + 2]) : 3);
+            g_Logger.Flush();
+            return ret;
+        }
 
-    ConsolePrintf(AQUA, "Map Batch Updater by ficool2 (%s)\n", __DATE__);
+        if (i + 1 < argc && !strcmp(argv[i], "-benchentities"))
+        {
+            int ret = RunEntityBenchmark(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 100);
+            g_Logger.Flush();
+            return ret;
+        }
 
-    if (!ParseIni())
+        if (i + 1 < argc && (!strcmp(argv[i], "-find") || !strcmp(argv[i], "-findcrc")))
+        {
+            int ret = RunFind(argv[i + 1], !strcmp(argv[i], "-findcrc"));
+            g_Logger.Flush();
+            return ret;
+        }
+    }
+
+    if (!ParseIni() || !PlanOperations())
     {
         ConsoleWaitForKey();
         return 1;
     }
 
+    InitMemoryBudget();
+
+    if (g_IniLogFile[0] && !g_Logger.OpenFile(g_IniLogFile))
+        ConsolePrintf(YELLOW, "Failed to open log file %s\n", g_IniLogFile);
+
     if (!SteamInit())
 	{
 		ConsoleWaitForKey();